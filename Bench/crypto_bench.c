@@ -0,0 +1,366 @@
+// Throughput benchmark for the cipher code in Code/
+//
+// Build from this directory:
+//   gcc -O2 -I../Code -o crypto_bench crypto_bench.c ../Code/aes.c ../Code/aes_ni.c
+//       ../Code/aes_bitslice.c ../Code/crypto.c ../Code/kdf.c -lpthread
+//
+// Usage: crypto_bench [max_size_mib [max_threads]]    (defaults: 64 MiB, 8 threads)
+//
+// Every backend is checked against FIPS-197 and SP 800-38A/D vectors and against the
+// reference backend before anything is timed; a mismatch aborts the run.
+
+#include "aes.h"
+#include "crypto.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#else
+#define HAVE_TSC 0
+#endif
+
+#define MIN_SECONDS 0.2   // each measurement repeats until it has run at least this long
+#define REF_MAX_SIZE (256 << 10) // the reference backend runs at a few MB/s, larger sizes only take longer
+#define THREAD_BUFFER (1 << 20)
+
+struct backend {
+    enum aes_impl impl;
+    const char* name;
+    uint8_t available;
+};
+
+struct measure {
+    double seconds;
+    double cycles;
+};
+
+struct thread_arg {
+    struct aes_ctx ctx;
+    uint8_t* buffer;
+    uint32_t rounds;
+};
+
+static struct backend backends[] = {
+    {AES_IMPL_REF, "reference", 1},
+    {AES_IMPL_TTABLE, "t-table", 1},
+    {AES_IMPL_NI, "aes-ni", 0},
+    {AES_IMPL_BITSLICE, "bitsliced", 0},
+}; // in enum aes_impl order
+#define BACKEND_COUNT (sizeof(backends) / sizeof(backends[0]))
+
+static const uint8_t nonce[AES_BLOCK_SIZE] = {0};
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static uint64_t cycles(void) {
+#if HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Key expansion and backend selection the same way aes_self_test does it
+static void make_ctx(struct aes_ctx* ctx, enum aes_impl impl, const uint8_t* key, size_t key_size) {
+    aes_init(ctx, key, key_size);
+    ctx->impl = impl;
+    if (impl == AES_IMPL_NI) aes_ni_prepare(ctx);
+}
+
+static void fill(uint8_t* buffer, size_t len, uint32_t seed) {
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        buffer[i] = (uint8_t)(seed >> 16);
+    }
+}
+
+static void hex(const char* in, uint8_t* out, size_t len) {
+    for (size_t i = 0; i < len; i++) sscanf(in + 2 * i, "%2hhx", &out[i]);
+}
+
+// SP 800-38A F.1.1 and F.1.5, run through the bulk path of one backend
+static int8_t check_ecb(enum aes_impl impl) {
+    static const char* plain =
+        "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+        "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+    static const char* keys[2] = {
+        "2b7e151628aed2a6abf7158809cf4f3c",
+        "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4"};
+    static const char* ciphers[2] = {
+        "3ad77bb40d7a3660a89ecaf32466ef97f5d3d58503b9699de785895a96fdbaaf"
+        "43b1cd7f598ece23881b00e3ed0306887b0c785e27e8ad3f8223207104725dd4",
+        "f3eed1bdb5d2a03c064b5a7e3db181f8591ccb10d410ed26dc5ba74a31362870"
+        "b6ed21b99ca6f4f9f153e7b1beafed1d23304b7a39f9f3ff067d8d8f9e24ecc7"};
+    uint8_t key[32], in[64], expected[64], out[64], back[64];
+    struct aes_ctx ctx;
+
+    hex(plain, in, sizeof(in));
+    for (int k = 0; k < 2; k++) {
+        size_t key_size = strlen(keys[k]) / 2;
+        hex(keys[k], key, key_size);
+        hex(ciphers[k], expected, sizeof(expected));
+
+        make_ctx(&ctx, impl, key, key_size);
+        aes_encrypt(&ctx, in, out, sizeof(in));
+        aes_decrypt(&ctx, out, back, sizeof(out));
+        if (memcmp(out, expected, sizeof(out)) != 0 || memcmp(back, in, sizeof(in)) != 0) return -1;
+    }
+    return 0;
+}
+
+// CTR and GCM output of a backend has to match the reference backend byte for byte
+static int8_t check_modes(enum aes_impl impl) {
+    const size_t len = 3 * 4096 + 37;
+    uint8_t key[32], iv[GCM_IV_SIZE] = {1, 2, 3};
+    uint8_t* a = malloc(len);
+    uint8_t* b = malloc(len);
+    uint8_t tag_a[GCM_TAG_SIZE], tag_b[GCM_TAG_SIZE];
+    struct aes_ctx ref, ctx;
+    int8_t result = 0;
+
+    fill(key, sizeof(key), 7);
+    make_ctx(&ref, AES_IMPL_REF, key, sizeof(key));
+    make_ctx(&ctx, impl, key, sizeof(key));
+
+    fill(a, len, 1);
+    memcpy(b, a, len);
+    ctr_xor(&ref, nonce, 5, a, len);
+    ctr_xor(&ctx, nonce, 5, b, len);
+    if (memcmp(a, b, len) != 0) result = -1;
+
+    fill(a, len, 2);
+    memcpy(b, a, len);
+    gcm_encrypt(&ref, iv, key, 13, a, len, tag_a);
+    gcm_encrypt(&ctx, iv, key, 13, b, len, tag_b);
+    if (memcmp(a, b, len) != 0 || memcmp(tag_a, tag_b, GCM_TAG_SIZE) != 0) result = -1;
+    if (result == 0 && gcm_decrypt(&ctx, iv, key, 13, b, len, tag_b) != 0) result = -1;
+
+    free(a);
+    free(b);
+    return result;
+}
+
+static uint8_t check_vectors(void) {
+    uint8_t ok = 1;
+
+    printf("Known-answer tests\n");
+    for (size_t i = 0; i < BACKEND_COUNT; i++) {
+        if (!backends[i].available) {
+            printf("  %-10s not supported by this CPU\n", backends[i].name);
+            continue;
+        }
+        int8_t fips = aes_self_test(backends[i].impl);
+        int8_t ecb = check_ecb(backends[i].impl);
+        int8_t modes = check_modes(backends[i].impl);
+        printf("  %-10s FIPS-197 %s, SP 800-38A ECB %s, CTR/GCM vs reference %s\n", backends[i].name,
+               fips == 0 ? "ok" : "FAIL", ecb == 0 ? "ok" : "FAIL", modes == 0 ? "ok" : "FAIL");
+        if (fips != 0 || ecb != 0 || modes != 0) ok = 0;
+    }
+
+    int8_t gcm = gcm_self_test();
+    printf("  GCM spec test cases 2 and 4 (%s backend): %s\n", backends[aes_active_impl].name, gcm == 0 ? "ok" : "FAIL");
+
+    uint8_t h[16], x1[16] = {0}, x2[16] = {0}, data[256];
+    fill(h, sizeof(h), 3);
+    fill(data, sizeof(data), 4);
+    ghash_portable(x1, h, data, sizeof(data) / 16);
+    if (clmul_available()) {
+        ghash_clmul(x2, h, data, sizeof(data) / 16);
+        printf("  GHASH pclmul vs portable: %s\n", memcmp(x1, x2, 16) == 0 ? "ok" : "FAIL");
+        if (memcmp(x1, x2, 16) != 0) ok = 0;
+    }
+
+    printf("\n");
+    return ok && gcm == 0;
+}
+
+// Runs op until MIN_SECONDS have passed and returns the time and cycles of one call
+#define MEASURE(result, op)                                               \
+    do {                                                                  \
+        uint64_t calls = 0;                                               \
+        double start = now(), elapsed;                                    \
+        uint64_t tsc = cycles();                                          \
+        do {                                                              \
+            op;                                                           \
+            calls++;                                                      \
+        } while ((elapsed = now() - start) < MIN_SECONDS);                \
+        (result).seconds = elapsed / calls;                               \
+        (result).cycles = (double)(cycles() - tsc) / calls;               \
+    } while (0)
+
+static void print_rate(const char* mode, const char* backend, size_t size, struct measure m) {
+    char label[32];
+    if (size >= (1 << 20)) snprintf(label, sizeof(label), "%zu MiB", size >> 20);
+    else if (size >= 1024) snprintf(label, sizeof(label), "%zu KiB", size >> 10);
+    else snprintf(label, sizeof(label), "%zu B", size);
+
+    printf("  %-12s %-10s %8s %10.1f MB/s", mode, backend, label, size / m.seconds / 1e6);
+    if (HAVE_TSC) printf(" %8.2f cycles/byte", m.cycles / size);
+    printf("\n");
+}
+
+static void bench_key_expansion(void) {
+    uint8_t key[32];
+    struct aes_ctx ctx;
+    fill(key, sizeof(key), 9);
+
+    printf("Key expansion (per key)\n");
+    for (size_t i = 0; i < BACKEND_COUNT; i++) {
+        if (!backends[i].available) continue;
+        for (size_t key_size = 16; key_size <= 32; key_size += 8) {
+            struct measure m;
+            MEASURE(m, make_ctx(&ctx, backends[i].impl, key, key_size));
+            printf("  %-10s AES-%zu %10.1f ns", backends[i].name, key_size * 8, m.seconds * 1e9);
+            if (HAVE_TSC) printf(" %8.0f cycles", m.cycles);
+            printf("\n");
+        }
+    }
+
+    uint8_t file_key[VOLUME_KEY_SIZE];
+    struct measure m;
+    MEASURE(m, derive_file_key(1, 0, file_key));
+    printf("  HKDF file subkey  %10.1f ns\n\n", m.seconds * 1e9);
+}
+
+static void bench_single_block(void) {
+    uint8_t key[32], block[AES_BLOCK_SIZE] = {0};
+    struct aes_ctx ctx;
+    fill(key, sizeof(key), 10);
+
+    printf("Single block, AES-256\n");
+    for (size_t i = 0; i < BACKEND_COUNT; i++) {
+        if (!backends[i].available) continue;
+        make_ctx(&ctx, backends[i].impl, key, sizeof(key));
+
+        struct measure m;
+        MEASURE(m, aes_encrypt(&ctx, block, block, AES_BLOCK_SIZE));
+        print_rate("encrypt", backends[i].name, AES_BLOCK_SIZE, m);
+        MEASURE(m, aes_decrypt(&ctx, block, block, AES_BLOCK_SIZE));
+        print_rate("decrypt", backends[i].name, AES_BLOCK_SIZE, m);
+    }
+    printf("\n");
+}
+
+static void bench_bulk(size_t max_size) {
+    uint8_t key[32], iv[GCM_IV_SIZE] = {0}, tag[GCM_TAG_SIZE];
+    uint8_t* buffer = malloc(max_size);
+    uint8_t* tags = malloc((max_size / CRYPTO_EXTENT_SIZE + 1) * GCM_TAG_SIZE);
+    struct aes_ctx ctx;
+
+    fill(key, sizeof(key), 11);
+    fill(buffer, max_size, 12);
+
+    printf("Bulk, AES-256 (CTR and extents use the worker pool)\n");
+    for (size_t i = 0; i < BACKEND_COUNT; i++) {
+        if (!backends[i].available) continue;
+        make_ctx(&ctx, backends[i].impl, key, sizeof(key));
+
+        for (size_t size = 16; size <= max_size; size *= 4) {
+            if (backends[i].impl == AES_IMPL_REF && size > REF_MAX_SIZE) break;
+            struct measure m;
+
+            MEASURE(m, aes_encrypt(&ctx, buffer, buffer, size));
+            print_rate("ecb-encrypt", backends[i].name, size, m);
+            MEASURE(m, aes_decrypt(&ctx, buffer, buffer, size));
+            print_rate("ecb-decrypt", backends[i].name, size, m);
+            MEASURE(m, ctr_crypt(&ctx, nonce, 0, buffer, size));
+            print_rate("ctr", backends[i].name, size, m);
+            MEASURE(m, gcm_encrypt(&ctx, iv, NULL, 0, buffer, size, tag));
+            print_rate("gcm", backends[i].name, size, m);
+            if (size >= CRYPTO_EXTENT_SIZE) {
+                MEASURE(m, gcm_crypt_extents(&ctx, nonce, 0, buffer, size, tags, 0));
+                print_rate("gcm-extents", backends[i].name, size, m);
+            }
+        }
+        printf("\n");
+    }
+
+    printf("GHASH\n");
+    for (size_t size = 64; size <= 65536; size *= 16) {
+        uint8_t h[16] = {1}, x[16] = {0};
+        struct measure m;
+        MEASURE(m, ghash_portable(x, h, buffer, size / 16));
+        print_rate("ghash", "portable", size, m);
+        if (clmul_available()) {
+            MEASURE(m, ghash_clmul(x, h, buffer, size / 16));
+            print_rate("ghash", "pclmul", size, m);
+        }
+    }
+    printf("\n");
+
+    free(tags);
+    free(buffer);
+}
+
+static void* ctr_thread(void* arg) {
+    struct thread_arg* t = arg;
+    for (uint32_t i = 0; i < t->rounds; i++) ctr_xor(&t->ctx, nonce, 0, t->buffer, THREAD_BUFFER);
+    return NULL;
+}
+
+// Independent callers, each with its own context and buffer, to see how a backend scales
+static void bench_threads(uint32_t max_threads) {
+    uint8_t key[32];
+    fill(key, sizeof(key), 13);
+
+    printf("CTR with independent threads, %d KiB per call, AES-256\n", THREAD_BUFFER >> 10);
+    for (size_t i = 0; i < BACKEND_COUNT; i++) {
+        if (!backends[i].available || backends[i].impl == AES_IMPL_REF) continue;
+
+        for (uint32_t count = 1; count <= max_threads; count *= 2) {
+            pthread_t threads[count];
+            struct thread_arg args[count];
+            uint32_t rounds = 8;
+
+            double start = now();
+            for (uint32_t t = 0; t < count; t++) {
+                make_ctx(&args[t].ctx, backends[i].impl, key, sizeof(key));
+                args[t].buffer = calloc(1, THREAD_BUFFER);
+                args[t].rounds = rounds;
+                pthread_create(&threads[t], NULL, ctr_thread, &args[t]);
+            }
+            for (uint32_t t = 0; t < count; t++) {
+                pthread_join(threads[t], NULL);
+                free(args[t].buffer);
+            }
+            double elapsed = now() - start;
+
+            printf("  %-10s %2u threads %10.1f MB/s total\n", backends[i].name, count,
+                   (double)count * rounds * THREAD_BUFFER / elapsed / 1e6);
+        }
+    }
+    printf("\n");
+}
+
+int main(int argc, char** argv) {
+    size_t max_size = (size_t)(argc > 1 ? atoi(argv[1]) : 64) << 20;
+    uint32_t max_threads = argc > 2 ? atoi(argv[2]) : 8;
+    if (max_size < 16) max_size = 16;
+    if (max_threads < 1) max_threads = 1;
+
+    backends[AES_IMPL_NI].available = aes_ni_available();
+    backends[AES_IMPL_BITSLICE].available = aes_bs_available();
+    printf("Default backend: %s\n", backends[aes_select_impl()].name);
+    if (HAVE_TSC) printf("Cycles are time stamp counter ticks, not core clock cycles\n");
+    printf("\n");
+
+    if (!check_vectors()) {
+        printf("Known-answer tests failed, not benchmarking\n");
+        return 1;
+    }
+
+    bench_key_expansion();
+    bench_single_block();
+    bench_bulk(max_size);
+    bench_threads(max_threads);
+    return 0;
+}
@@ -1,10 +1,14 @@
 #include "aes.h"
 
-int K;
-int Nb = 4;
-int Nk;
-int Nr;
-uint8_t R[] = {0x02, 0x00, 0x00, 0x00};
+#include <pthread.h>
+#include <string.h>
+
+enum aes_impl aes_active_impl = AES_IMPL_REF;
+
+// Round tables: Te* fold SubBytes into MixColumns, Td* hold the InvMixColumns products
+static uint32_t Te0[256], Te1[256], Te2[256], Te3[256];
+static uint32_t Td0[256], Td1[256], Td2[256], Td3[256];
+static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
 
 uint8_t gadd(uint8_t a, uint8_t b) {
 	return a^b;
@@ -48,23 +52,19 @@ void coef_mult(uint8_t *a, uint8_t *b, uint8_t *d) {
 	d[3] = gmult(a[3],b[0])^gmult(a[2],b[1])^gmult(a[1],b[2])^gmult(a[0],b[3]);
 }
 
-uint8_t * Rcon(uint8_t i) {
-	
-	if (i == 1) {
-		R[0] = 0x01;
-	} else if (i > 1) {
-		R[0] = 0x02;
+uint8_t Rcon(uint8_t i) {
+
+	uint8_t r = 0x01;
+
+	while (i > 1) {
+		r = gmult(r, 0x02);
 		i--;
-		while (i > 1) {
-			R[0] = gmult(R[0], 0x02);
-			i--;
-		}
 	}
-	
-	return R;
+
+	return r;
 }
 
-void add_round_key(uint8_t *state, uint8_t *w, uint8_t r) {
+void add_round_key(uint8_t *state, const uint8_t *w, uint8_t r) {
 	
 	uint8_t c;
 	
@@ -196,11 +196,13 @@ void rot_word(uint8_t *w) {
 	w[3] = tmp;
 }
 
-void aes_key_expansion(uint8_t *key, uint8_t *w) {
+void aes_key_expansion(struct aes_ctx *ctx, const uint8_t *key) {
 
 	uint8_t tmp[4];
 	uint8_t i;
-	uint8_t len = Nb*(Nr+1);
+	uint8_t *w = ctx->w;
+	int Nk = ctx->nk;
+	uint8_t len = Nb*(ctx->nr+1);
 
 	for (i = 0; i < Nk; i++) {
 		w[4*i+0] = key[4*i+0];
@@ -219,7 +221,7 @@ void aes_key_expansion(uint8_t *key, uint8_t *w) {
 
 			rot_word(tmp);
 			sub_word(tmp);
-			coef_add(tmp, Rcon(i/Nk), tmp);
+			tmp[0] ^= Rcon(i/Nk);
 
 		} else if (Nk > 6 && i%Nk == 4) {
 
@@ -234,33 +236,64 @@ void aes_key_expansion(uint8_t *key, uint8_t *w) {
 	}
 }
 
-uint8_t *aes_init(size_t key_size) {
+void aes_init(struct aes_ctx *ctx, const uint8_t *key, size_t key_size) {
 
     switch (key_size) {
         default:
-        case 16: Nk = 4; Nr = 10; break;
-        case 24: Nk = 6; Nr = 12; break;
-        case 32: Nk = 8; Nr = 14; break;
+        case 16: ctx->nk = 4; ctx->nr = 10; break;
+        case 24: ctx->nk = 6; ctx->nr = 12; break;
+        case 32: ctx->nk = 8; ctx->nr = 14; break;
     }
 
-    return (uint8_t*)malloc(Nb*(Nr+1)*4);
+    ctx->impl = aes_active_impl;
+    pthread_once(&tables_once, aes_tables_init);
+    aes_key_expansion(ctx, key);
+    if (ctx->impl == AES_IMPL_NI) aes_ni_prepare(ctx);
+}
+
+void aes_clear(struct aes_ctx *ctx) {
+    volatile uint8_t *p = (volatile uint8_t*)ctx;
+    for (size_t i = 0; i < sizeof(struct aes_ctx); i++) p[i] = 0;
 }
 
-void aes_encrypt(uint8_t* in, uint8_t* out, size_t input_len, uint8_t* w) {
+void aes_encrypt(const struct aes_ctx* ctx, uint8_t* in, uint8_t* out, size_t input_len) {
+    if (ctx->impl == AES_IMPL_NI) {
+        aes_encrypt_ni(ctx, in, out, input_len);
+        return;
+    } else if (ctx->impl == AES_IMPL_BITSLICE) {
+        aes_encrypt_bs(ctx, in, out, input_len);
+        return;
+    }
+
     size_t num_blocks = input_len / AES_BLOCK_SIZE;
+    void (*cipher)(const struct aes_ctx*, uint8_t*, uint8_t*) = ctx->impl == AES_IMPL_TTABLE ? aes_cipher_tt : aes_cipher;
+
     for (size_t i = 0; i < num_blocks; i++) {
-        aes_cipher(in + i*AES_BLOCK_SIZE, out + i*AES_BLOCK_SIZE, w);
+        cipher(ctx, in + i*AES_BLOCK_SIZE, out + i*AES_BLOCK_SIZE);
     }
 }
 
-void aes_decrypt(uint8_t* in, uint8_t* out, size_t input_len, uint8_t* w) {
+void aes_decrypt(const struct aes_ctx* ctx, uint8_t* in, uint8_t* out, size_t input_len) {
+    if (ctx->impl == AES_IMPL_NI) {
+        aes_decrypt_ni(ctx, in, out, input_len);
+        return;
+    } else if (ctx->impl == AES_IMPL_BITSLICE) {
+        aes_decrypt_bs(ctx, in, out, input_len);
+        return;
+    }
+
     size_t num_blocks = input_len / AES_BLOCK_SIZE;
+    void (*cipher)(const struct aes_ctx*, uint8_t*, uint8_t*) = ctx->impl == AES_IMPL_TTABLE ? aes_inv_cipher_tt : aes_inv_cipher;
+
     for (size_t i = 0; i < num_blocks; i++) {
-        aes_inv_cipher(in + i*AES_BLOCK_SIZE, out + i*AES_BLOCK_SIZE, w);
+        cipher(ctx, in + i*AES_BLOCK_SIZE, out + i*AES_BLOCK_SIZE);
     }
 }
 
-void aes_cipher(uint8_t *in, uint8_t *out, uint8_t *w) {
+void aes_cipher(const struct aes_ctx *ctx, uint8_t *in, uint8_t *out) {
+
+	const uint8_t *w = ctx->w;
+	int Nr = ctx->nr;
 
 	uint8_t state[4*Nb];
 	uint8_t r, i, j;
@@ -291,7 +324,10 @@ void aes_cipher(uint8_t *in, uint8_t *out, uint8_t *w) {
 	}
 }
 
-void aes_inv_cipher(uint8_t *in, uint8_t *out, uint8_t *w) {
+void aes_inv_cipher(const struct aes_ctx *ctx, uint8_t *in, uint8_t *out) {
+
+	const uint8_t *w = ctx->w;
+	int Nr = ctx->nr;
 
 	uint8_t state[4*Nb];
 	uint8_t r, i, j;
@@ -320,4 +356,150 @@ void aes_inv_cipher(uint8_t *in, uint8_t *out, uint8_t *w) {
 			out[i+4*j] = state[Nb*i+j];
 		}
 	}
-}
\ No newline at end of file
+}
+
+#define ROR8(x) (((x) >> 8) | ((x) << 24))
+#define GETU32(p) (((uint32_t)(p)[0] << 24) | ((uint32_t)(p)[1] << 16) | ((uint32_t)(p)[2] << 8) | (uint32_t)(p)[3])
+#define PUTU32(p, v) { (p)[0] = (uint8_t)((v) >> 24); (p)[1] = (uint8_t)((v) >> 16); (p)[2] = (uint8_t)((v) >> 8); (p)[3] = (uint8_t)(v); }
+
+void aes_tables_init(void) {
+
+	for (int x = 0; x < 256; x++) {
+		uint8_t s = s_box[x];
+		uint32_t e = ((uint32_t)gmult(s, 2) << 24) | ((uint32_t)s << 16) | ((uint32_t)s << 8) | gmult(s, 3);
+		Te0[x] = e;
+		Te1[x] = ROR8(e);
+		Te2[x] = ROR8(Te1[x]);
+		Te3[x] = ROR8(Te2[x]);
+
+		uint32_t d = ((uint32_t)gmult(x, 0x0e) << 24) | ((uint32_t)gmult(x, 0x09) << 16) | ((uint32_t)gmult(x, 0x0d) << 8) | gmult(x, 0x0b);
+		Td0[x] = d;
+		Td1[x] = ROR8(d);
+		Td2[x] = ROR8(Td1[x]);
+		Td3[x] = ROR8(Td2[x]);
+	}
+}
+
+// Same result as aes_cipher, one 32-bit column per word and four lookups per column
+void aes_cipher_tt(const struct aes_ctx *ctx, uint8_t *in, uint8_t *out) {
+
+	const uint8_t *w = ctx->w;
+	int Nr = ctx->nr;
+
+	uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+	uint8_t r;
+
+	s0 = GETU32(in)      ^ GETU32(w);
+	s1 = GETU32(in + 4)  ^ GETU32(w + 4);
+	s2 = GETU32(in + 8)  ^ GETU32(w + 8);
+	s3 = GETU32(in + 12) ^ GETU32(w + 12);
+
+	for (r = 1; r < Nr; r++) {
+		const uint8_t *rk = w + 16*r;
+		t0 = Te0[s0 >> 24] ^ Te1[(s1 >> 16) & 0xff] ^ Te2[(s2 >> 8) & 0xff] ^ Te3[s3 & 0xff] ^ GETU32(rk);
+		t1 = Te0[s1 >> 24] ^ Te1[(s2 >> 16) & 0xff] ^ Te2[(s3 >> 8) & 0xff] ^ Te3[s0 & 0xff] ^ GETU32(rk + 4);
+		t2 = Te0[s2 >> 24] ^ Te1[(s3 >> 16) & 0xff] ^ Te2[(s0 >> 8) & 0xff] ^ Te3[s1 & 0xff] ^ GETU32(rk + 8);
+		t3 = Te0[s3 >> 24] ^ Te1[(s0 >> 16) & 0xff] ^ Te2[(s1 >> 8) & 0xff] ^ Te3[s2 & 0xff] ^ GETU32(rk + 12);
+		s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+	}
+
+	const uint8_t *rk = w + 16*Nr;
+	t0 = ((uint32_t)s_box[s0 >> 24] << 24) ^ ((uint32_t)s_box[(s1 >> 16) & 0xff] << 16) ^ ((uint32_t)s_box[(s2 >> 8) & 0xff] << 8) ^ s_box[s3 & 0xff];
+	t1 = ((uint32_t)s_box[s1 >> 24] << 24) ^ ((uint32_t)s_box[(s2 >> 16) & 0xff] << 16) ^ ((uint32_t)s_box[(s3 >> 8) & 0xff] << 8) ^ s_box[s0 & 0xff];
+	t2 = ((uint32_t)s_box[s2 >> 24] << 24) ^ ((uint32_t)s_box[(s3 >> 16) & 0xff] << 16) ^ ((uint32_t)s_box[(s0 >> 8) & 0xff] << 8) ^ s_box[s1 & 0xff];
+	t3 = ((uint32_t)s_box[s3 >> 24] << 24) ^ ((uint32_t)s_box[(s0 >> 16) & 0xff] << 16) ^ ((uint32_t)s_box[(s1 >> 8) & 0xff] << 8) ^ s_box[s2 & 0xff];
+
+	PUTU32(out,      t0 ^ GETU32(rk));
+	PUTU32(out + 4,  t1 ^ GETU32(rk + 4));
+	PUTU32(out + 8,  t2 ^ GETU32(rk + 8));
+	PUTU32(out + 12, t3 ^ GETU32(rk + 12));
+}
+
+// Straight inverse cipher order, so the encryption key schedule can be used as is
+void aes_inv_cipher_tt(const struct aes_ctx *ctx, uint8_t *in, uint8_t *out) {
+
+	const uint8_t *w = ctx->w;
+	int Nr = ctx->nr;
+
+	uint32_t s0, s1, s2, s3, t0, t1, t2, t3;
+	int r;
+
+	const uint8_t *rk = w + 16*Nr;
+	s0 = GETU32(in)      ^ GETU32(rk);
+	s1 = GETU32(in + 4)  ^ GETU32(rk + 4);
+	s2 = GETU32(in + 8)  ^ GETU32(rk + 8);
+	s3 = GETU32(in + 12) ^ GETU32(rk + 12);
+
+	for (r = Nr - 1; r >= 1; r--) {
+		rk = w + 16*r;
+		// InvShiftRows and InvSubBytes, then AddRoundKey
+		t0 = (((uint32_t)inv_s_box[s0 >> 24] << 24) ^ ((uint32_t)inv_s_box[(s3 >> 16) & 0xff] << 16) ^ ((uint32_t)inv_s_box[(s2 >> 8) & 0xff] << 8) ^ inv_s_box[s1 & 0xff]) ^ GETU32(rk);
+		t1 = (((uint32_t)inv_s_box[s1 >> 24] << 24) ^ ((uint32_t)inv_s_box[(s0 >> 16) & 0xff] << 16) ^ ((uint32_t)inv_s_box[(s3 >> 8) & 0xff] << 8) ^ inv_s_box[s2 & 0xff]) ^ GETU32(rk + 4);
+		t2 = (((uint32_t)inv_s_box[s2 >> 24] << 24) ^ ((uint32_t)inv_s_box[(s1 >> 16) & 0xff] << 16) ^ ((uint32_t)inv_s_box[(s0 >> 8) & 0xff] << 8) ^ inv_s_box[s3 & 0xff]) ^ GETU32(rk + 8);
+		t3 = (((uint32_t)inv_s_box[s3 >> 24] << 24) ^ ((uint32_t)inv_s_box[(s2 >> 16) & 0xff] << 16) ^ ((uint32_t)inv_s_box[(s1 >> 8) & 0xff] << 8) ^ inv_s_box[s0 & 0xff]) ^ GETU32(rk + 12);
+
+		// InvMixColumns
+		s0 = Td0[t0 >> 24] ^ Td1[(t0 >> 16) & 0xff] ^ Td2[(t0 >> 8) & 0xff] ^ Td3[t0 & 0xff];
+		s1 = Td0[t1 >> 24] ^ Td1[(t1 >> 16) & 0xff] ^ Td2[(t1 >> 8) & 0xff] ^ Td3[t1 & 0xff];
+		s2 = Td0[t2 >> 24] ^ Td1[(t2 >> 16) & 0xff] ^ Td2[(t2 >> 8) & 0xff] ^ Td3[t2 & 0xff];
+		s3 = Td0[t3 >> 24] ^ Td1[(t3 >> 16) & 0xff] ^ Td2[(t3 >> 8) & 0xff] ^ Td3[t3 & 0xff];
+	}
+
+	// The last round has no InvMixColumns
+	rk = w;
+	t0 = (((uint32_t)inv_s_box[s0 >> 24] << 24) ^ ((uint32_t)inv_s_box[(s3 >> 16) & 0xff] << 16) ^ ((uint32_t)inv_s_box[(s2 >> 8) & 0xff] << 8) ^ inv_s_box[s1 & 0xff]) ^ GETU32(rk);
+	t1 = (((uint32_t)inv_s_box[s1 >> 24] << 24) ^ ((uint32_t)inv_s_box[(s0 >> 16) & 0xff] << 16) ^ ((uint32_t)inv_s_box[(s3 >> 8) & 0xff] << 8) ^ inv_s_box[s2 & 0xff]) ^ GETU32(rk + 4);
+	t2 = (((uint32_t)inv_s_box[s2 >> 24] << 24) ^ ((uint32_t)inv_s_box[(s1 >> 16) & 0xff] << 16) ^ ((uint32_t)inv_s_box[(s0 >> 8) & 0xff] << 8) ^ inv_s_box[s3 & 0xff]) ^ GETU32(rk + 8);
+	t3 = (((uint32_t)inv_s_box[s3 >> 24] << 24) ^ ((uint32_t)inv_s_box[(s2 >> 16) & 0xff] << 16) ^ ((uint32_t)inv_s_box[(s1 >> 8) & 0xff] << 8) ^ inv_s_box[s0 & 0xff]) ^ GETU32(rk + 12);
+
+	PUTU32(out,      t0);
+	PUTU32(out + 4,  t1);
+	PUTU32(out + 8,  t2);
+	PUTU32(out + 12, t3);
+}
+
+// FIPS-197 Appendix C vectors, one per key size
+int8_t aes_self_test(enum aes_impl impl) {
+
+	static const uint8_t plain[16] = {
+		0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff};
+	static const uint8_t expected[3][16] = {
+		{0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a},
+		{0xdd, 0xa9, 0x7c, 0xa4, 0x86, 0x4c, 0xdf, 0xe0, 0x6e, 0xaf, 0x70, 0xa0, 0xec, 0x0d, 0x71, 0x91},
+		{0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf, 0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89}};
+
+	struct aes_ctx ctx;
+	int8_t result = 0;
+	uint8_t key[32], in[16], out[16], back[16];
+
+	for (int i = 0; i < 32; i++) key[i] = i;
+	if (impl == AES_IMPL_BITSLICE && aes_bs_sbox_check() != 0) return -3;
+
+	for (int k = 0; k < 3 && result == 0; k++) {
+		aes_init(&ctx, key, 16 + 8*k);
+		ctx.impl = impl;
+		if (impl == AES_IMPL_NI) aes_ni_prepare(&ctx);
+
+		memcpy(in, plain, sizeof(in));
+		aes_encrypt(&ctx, in, out, AES_BLOCK_SIZE);
+		aes_decrypt(&ctx, out, back, AES_BLOCK_SIZE);
+
+		if (memcmp(out, expected[k], AES_BLOCK_SIZE) != 0) result = -1;
+		else if (memcmp(back, plain, AES_BLOCK_SIZE) != 0) result = -2;
+	}
+
+	aes_clear(&ctx);
+	return result;
+}
+
+// Picks the fastest implementation that passes the known-answer test. Without AES-NI the
+// constant-time bitsliced engine wins over T-tables, whose lookups leak through the cache.
+enum aes_impl aes_select_impl(void) {
+
+	aes_active_impl = AES_IMPL_REF;
+	if (aes_ni_available() && aes_self_test(AES_IMPL_NI) == 0) aes_active_impl = AES_IMPL_NI;
+	else if (aes_bs_available() && aes_self_test(AES_IMPL_BITSLICE) == 0) aes_active_impl = AES_IMPL_BITSLICE;
+	else if (aes_self_test(AES_IMPL_TTABLE) == 0) aes_active_impl = AES_IMPL_TTABLE;
+
+	return aes_active_impl;
+}
@@ -5,8 +5,27 @@
 
 #define AES_BLOCK_SIZE 16
 
-void aes_cipher(uint8_t *in, uint8_t *out, uint8_t *w);
-void aes_inv_cipher(uint8_t *in, uint8_t *out, uint8_t *w);
+enum aes_impl {
+	AES_IMPL_REF,
+	AES_IMPL_TTABLE,
+	AES_IMPL_NI,
+	AES_IMPL_BITSLICE
+};
+
+#define Nb 4
+#define AES_MAX_ROUNDS 14
+#define AES_SCHEDULE_SIZE (4*Nb*(AES_MAX_ROUNDS+1))
+
+// Everything one key needs, so several keys and threads can encrypt at the same time
+struct aes_ctx {
+	int nk;
+	int nr;
+	enum aes_impl impl;
+	uint8_t w[AES_SCHEDULE_SIZE];  // encryption round keys
+	uint8_t dw[AES_SCHEDULE_SIZE]; // equivalent inverse cipher round keys, AES-NI only
+};
+
+extern enum aes_impl aes_active_impl;
 
 uint8_t gadd(uint8_t a, uint8_t b);
 uint8_t gsub(uint8_t a, uint8_t b);
@@ -14,10 +33,6 @@ uint8_t gmult(uint8_t a, uint8_t b);
 void coef_add(uint8_t a[], uint8_t b[], uint8_t d[]);
 void coef_mult(uint8_t *a, uint8_t *b, uint8_t *d);
 
-extern int K;
-extern int Nb;
-extern int Nk;
-extern int Nr;
 
 static uint8_t s_box[256] = {
 	
@@ -57,10 +72,8 @@ static uint8_t inv_s_box[256] = {
 	0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61, 
 	0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d};
 
-extern uint8_t R[];
- 
-uint8_t* Rcon(uint8_t i);
-void add_round_key(uint8_t *state, uint8_t *w, uint8_t r);
+uint8_t Rcon(uint8_t i);
+void add_round_key(uint8_t *state, const uint8_t *w, uint8_t r);
 void mix_columns(uint8_t *state);
 void inv_mix_columns(uint8_t *state);
 void shift_rows(uint8_t *state);
@@ -69,12 +82,31 @@ void sub_bytes(uint8_t *state);
 void inv_sub_bytes(uint8_t *state);
 void sub_word(uint8_t *w);
 void rot_word(uint8_t *w);
-void aes_key_expansion(uint8_t *key, uint8_t *w);
+void aes_key_expansion(struct aes_ctx *ctx, const uint8_t *key);
+
+void aes_init(struct aes_ctx *ctx, const uint8_t *key, size_t key_size);
+void aes_clear(struct aes_ctx *ctx);
+
+void aes_encrypt(const struct aes_ctx* ctx, uint8_t* in, uint8_t* out, size_t input_len);
+void aes_decrypt(const struct aes_ctx* ctx, uint8_t* in, uint8_t* out, size_t input_len);
+
+void aes_cipher(const struct aes_ctx *ctx, uint8_t *in, uint8_t *out);
+void aes_inv_cipher(const struct aes_ctx *ctx, uint8_t *in, uint8_t *out);
 
-uint8_t *aes_init(size_t key_size);
+void aes_tables_init(void);
+void aes_cipher_tt(const struct aes_ctx *ctx, uint8_t *in, uint8_t *out);
+void aes_inv_cipher_tt(const struct aes_ctx *ctx, uint8_t *in, uint8_t *out);
+int8_t aes_self_test(enum aes_impl impl);
+enum aes_impl aes_select_impl(void);
 
-void aes_encrypt(uint8_t* in, uint8_t* out, size_t input_len, uint8_t* w);
-void aes_decrypt(uint8_t* in, uint8_t* out, size_t input_len, uint8_t* w);
+uint8_t aes_ni_available(void);
+void aes_ni_prepare(struct aes_ctx* ctx);
+void aes_encrypt_ni(const struct aes_ctx* ctx, uint8_t* in, uint8_t* out, size_t input_len);
+void aes_decrypt_ni(const struct aes_ctx* ctx, uint8_t* in, uint8_t* out, size_t input_len);
+uint8_t clmul_available(void);
+void ghash_clmul(uint8_t* x, const uint8_t* h, const uint8_t* data, size_t blocks);
 
-void aes_cipher(uint8_t *in, uint8_t *out, uint8_t *w);
-void aes_inv_cipher(uint8_t *in, uint8_t *out, uint8_t *w);
\ No newline at end of file
+void aes_encrypt_bs(const struct aes_ctx *ctx, uint8_t *in, uint8_t *out, size_t input_len);
+void aes_decrypt_bs(const struct aes_ctx *ctx, uint8_t *in, uint8_t *out, size_t input_len);
+uint8_t aes_bs_available(void);
+int8_t aes_bs_sbox_check(void);
@@ -0,0 +1,389 @@
+#include "aes.h"
+
+#include <string.h>
+
+// Byte shuffles need pshufb to be cheap; without it GCC lowers them to scalar code
+#if defined(__x86_64__) || defined(__i386__)
+#pragma GCC target("ssse3")
+
+uint8_t aes_bs_available(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("ssse3");
+}
+#else
+uint8_t aes_bs_available(void) {
+	return 1;
+}
+#endif
+
+// Plane b holds bit b of every state byte: vector byte j carries byte j of all eight blocks,
+// one block per bit. Every step is a fixed sequence of logic ops and shuffles, so nothing
+// depends on secret data.
+typedef uint8_t bs_vec __attribute__((vector_size(16)));
+
+#define BS_LANES 8
+
+static const bs_vec shift_rows_mask = {0, 5, 10, 15, 4, 9, 14, 3, 8, 13, 2, 7, 12, 1, 6, 11};
+static const bs_vec inv_shift_rows_mask = {0, 13, 10, 7, 4, 1, 14, 11, 8, 5, 2, 15, 12, 9, 6, 3};
+static const bs_vec rot1_mask = {1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12};
+static const bs_vec rot2_mask = {2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13};
+static const bs_vec rot3_mask = {3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14};
+
+// 8x8 bit matrix transpose, bit 8*r+c <-> bit 8*c+r
+static inline uint64_t transpose8(uint64_t x) {
+
+	uint64_t t;
+
+	t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+	x = x ^ t ^ (t << 28);
+
+	return x;
+}
+
+static void bs_pack(const uint8_t *in, bs_vec *s) {
+
+	for (int j = 0; j < 16; j++) {
+		uint64_t x = 0;
+
+		for (int k = 0; k < BS_LANES; k++) x |= (uint64_t)in[k*AES_BLOCK_SIZE + j] << (8*k);
+		x = transpose8(x);
+		for (int b = 0; b < 8; b++) s[b][j] = (uint8_t)(x >> (8*b));
+	}
+}
+
+static void bs_unpack(const bs_vec *s, uint8_t *out) {
+
+	for (int j = 0; j < 16; j++) {
+		uint64_t x = 0;
+
+		for (int b = 0; b < 8; b++) x |= (uint64_t)s[b][j] << (8*b);
+		x = transpose8(x);
+		for (int k = 0; k < BS_LANES; k++) out[k*AES_BLOCK_SIZE + j] = (uint8_t)(x >> (8*k));
+	}
+}
+
+// Same round key for all eight blocks: every bit becomes an all-zero or all-one byte
+static void bs_round_key(const uint8_t *w, bs_vec *rk) {
+
+	for (int b = 0; b < 8; b++) {
+		for (int j = 0; j < 16; j++) rk[b][j] = (uint8_t)-((w[j] >> b) & 1);
+	}
+}
+
+static inline void bs_add_round_key(bs_vec *s, const bs_vec *rk) {
+
+	for (int b = 0; b < 8; b++) s[b] ^= rk[b];
+}
+
+// Boyar-Peralta SubBytes circuit: 113 gates, 32 of them AND. U0/S0 are the most significant bits.
+static void bs_sub_bytes(bs_vec *s) {
+
+	bs_vec U0 = s[7], U1 = s[6], U2 = s[5], U3 = s[4], U4 = s[3], U5 = s[2], U6 = s[1], U7 = s[0];
+	bs_vec T1, T2, T3, T4, T5, T6, T7, T8, T9, T10, T11, T12, T13, T14, T15, T16, T17, T18, T19, T20,
+		T21, T22, T23, T24, T25, T26, T27;
+	bs_vec M1, M2, M3, M4, M5, M6, M7, M8, M9, M10, M11, M12, M13, M14, M15, M16, M17, M18, M19, M20,
+		M21, M22, M23, M24, M25, M26, M27, M28, M29, M30, M31, M32, M33, M34, M35, M36, M37, M38, M39,
+		M40, M41, M42, M43, M44, M45, M46, M47, M48, M49, M50, M51, M52, M53, M54, M55, M56, M57, M58,
+		M59, M60, M61, M62, M63;
+	bs_vec L0, L1, L2, L3, L4, L5, L6, L7, L8, L9, L10, L11, L12, L13, L14, L15, L16, L17, L18, L19,
+		L20, L21, L22, L23, L24, L25, L26, L27, L28, L29;
+	bs_vec S0, S1, S2, S3, S4, S5, S6, S7;
+
+	T1 = U0 ^ U3;
+	T2 = U0 ^ U5;
+	T3 = U0 ^ U6;
+	T4 = U3 ^ U5;
+	T5 = U4 ^ U6;
+	T6 = T1 ^ T5;
+	T7 = U1 ^ U2;
+	T8 = U7 ^ T6;
+	T9 = U7 ^ T7;
+	T10 = T6 ^ T7;
+	T11 = U1 ^ U5;
+	T12 = U2 ^ U5;
+	T13 = T3 ^ T4;
+	T14 = T6 ^ T11;
+	T15 = T5 ^ T11;
+	T16 = T5 ^ T12;
+	T17 = T9 ^ T16;
+	T18 = U3 ^ U7;
+	T19 = T7 ^ T18;
+	T20 = T1 ^ T19;
+	T21 = U6 ^ U7;
+	T22 = T7 ^ T21;
+	T23 = T2 ^ T22;
+	T24 = T2 ^ T10;
+	T25 = T20 ^ T17;
+	T26 = T3 ^ T16;
+	T27 = T1 ^ T12;
+	M1 = T13 & T6;
+	M2 = T23 & T8;
+	M3 = T14 ^ M1;
+	M4 = T19 & U7;
+	M5 = M4 ^ M1;
+	M6 = T3 & T16;
+	M7 = T22 & T9;
+	M8 = T26 ^ M6;
+	M9 = T20 & T17;
+	M10 = M9 ^ M6;
+	M11 = T1 & T15;
+	M12 = T4 & T27;
+	M13 = M12 ^ M11;
+	M14 = T2 & T10;
+	M15 = M14 ^ M11;
+	M16 = M3 ^ M2;
+	M17 = M5 ^ T24;
+	M18 = M8 ^ M7;
+	M19 = M10 ^ M15;
+	M20 = M16 ^ M13;
+	M21 = M17 ^ M15;
+	M22 = M18 ^ M13;
+	M23 = M19 ^ T25;
+	M24 = M22 ^ M23;
+	M25 = M22 & M20;
+	M26 = M21 ^ M25;
+	M27 = M20 ^ M21;
+	M28 = M23 ^ M25;
+	M29 = M28 & M27;
+	M30 = M26 & M24;
+	M31 = M20 & M23;
+	M32 = M27 & M31;
+	M33 = M27 ^ M25;
+	M34 = M21 & M22;
+	M35 = M24 & M34;
+	M36 = M24 ^ M25;
+	M37 = M21 ^ M29;
+	M38 = M32 ^ M33;
+	M39 = M23 ^ M30;
+	M40 = M35 ^ M36;
+	M41 = M38 ^ M40;
+	M42 = M37 ^ M39;
+	M43 = M37 ^ M38;
+	M44 = M39 ^ M40;
+	M45 = M42 ^ M41;
+	M46 = M44 & T6;
+	M47 = M40 & T8;
+	M48 = M39 & U7;
+	M49 = M43 & T16;
+	M50 = M38 & T9;
+	M51 = M37 & T17;
+	M52 = M42 & T15;
+	M53 = M45 & T27;
+	M54 = M41 & T10;
+	M55 = M44 & T13;
+	M56 = M40 & T23;
+	M57 = M39 & T19;
+	M58 = M43 & T3;
+	M59 = M38 & T22;
+	M60 = M37 & T20;
+	M61 = M42 & T1;
+	M62 = M45 & T4;
+	M63 = M41 & T2;
+	L0 = M61 ^ M62;
+	L1 = M50 ^ M56;
+	L2 = M46 ^ M48;
+	L3 = M47 ^ M55;
+	L4 = M54 ^ M58;
+	L5 = M49 ^ M61;
+	L6 = M62 ^ L5;
+	L7 = M46 ^ L3;
+	L8 = M51 ^ M59;
+	L9 = M52 ^ M53;
+	L10 = M53 ^ L4;
+	L11 = M60 ^ L2;
+	L12 = M48 ^ M51;
+	L13 = M50 ^ L0;
+	L14 = M52 ^ M61;
+	L15 = M55 ^ L1;
+	L16 = M56 ^ L0;
+	L17 = M57 ^ L1;
+	L18 = M58 ^ L8;
+	L19 = M63 ^ L4;
+	L20 = L0 ^ L1;
+	L21 = L1 ^ L7;
+	L22 = L3 ^ L12;
+	L23 = L18 ^ L2;
+	L24 = L15 ^ L9;
+	L25 = L6 ^ L10;
+	L26 = L7 ^ L9;
+	L27 = L8 ^ L10;
+	L28 = L11 ^ L14;
+	L29 = L11 ^ L17;
+	S0 = L6 ^ L24;
+	S1 = ~(L16 ^ L26);
+	S2 = ~(L19 ^ L28);
+	S3 = L6 ^ L21;
+	S4 = L20 ^ L22;
+	S5 = L25 ^ L29;
+	S6 = ~(L13 ^ L27);
+	S7 = ~(L6 ^ L23);
+
+	s[7] = S0; s[6] = S1; s[5] = S2; s[4] = S3; s[3] = S4; s[2] = S5; s[1] = S6; s[0] = S7;
+}
+
+// (x + 0x63) under the inverse affine map; applying it around SubBytes gives InvSubBytes
+static void bs_inv_affine(bs_vec *s) {
+
+	bs_vec t[8];
+	const bs_vec ones = ~(bs_vec){0};
+
+	for (int i = 0; i < 8; i++) {
+		t[i] = s[(i+2) % 8] ^ s[(i+5) % 8] ^ s[(i+7) % 8];
+		if ((0x05 >> i) & 1) t[i] ^= ones;
+	}
+	memcpy(s, t, sizeof(t));
+}
+
+static void bs_inv_sub_bytes(bs_vec *s) {
+
+	bs_inv_affine(s);
+	bs_sub_bytes(s);
+	bs_inv_affine(s);
+}
+
+static inline void bs_shuffle(bs_vec *s, bs_vec mask) {
+
+	for (int b = 0; b < 8; b++) s[b] = __builtin_shuffle(s[b], mask);
+}
+
+static inline void bs_xtime(const bs_vec *x, bs_vec *r) {
+
+	r[0] = x[7];
+	r[1] = x[0] ^ x[7];
+	r[2] = x[1];
+	r[3] = x[2] ^ x[7];
+	r[4] = x[3] ^ x[7];
+	r[5] = x[4];
+	r[6] = x[5];
+	r[7] = x[6];
+}
+
+// out_r = 2*(a_r ^ a_r+1) ^ a_r+1 ^ a_r+2 ^ a_r+3
+static void bs_mix_columns(bs_vec *s) {
+
+	bs_vec x[8], d[8];
+
+	for (int b = 0; b < 8; b++) {
+		bs_vec r1 = __builtin_shuffle(s[b], rot1_mask);
+		x[b] = s[b] ^ r1;
+		s[b] = r1 ^ __builtin_shuffle(s[b], rot2_mask) ^ __builtin_shuffle(s[b], rot3_mask);
+	}
+	bs_xtime(x, d);
+	for (int b = 0; b < 8; b++) s[b] ^= d[b];
+}
+
+// InvMixColumns = MixColumns after a_r ^= 4*(a_r ^ a_r+2)
+static void bs_inv_mix_columns(bs_vec *s) {
+
+	bs_vec x[8], d[8];
+
+	for (int b = 0; b < 8; b++) x[b] = s[b] ^ __builtin_shuffle(s[b], rot2_mask);
+	bs_xtime(x, d);
+	bs_xtime(d, x);
+	for (int b = 0; b < 8; b++) s[b] ^= x[b];
+	bs_mix_columns(s);
+}
+
+static void bs_encrypt8(const bs_vec (*rk)[8], int nr, const uint8_t *in, uint8_t *out) {
+
+	bs_vec s[8];
+
+	bs_pack(in, s);
+	bs_add_round_key(s, rk[0]);
+	for (int r = 1; r < nr; r++) {
+		bs_sub_bytes(s);
+		bs_shuffle(s, shift_rows_mask);
+		bs_mix_columns(s);
+		bs_add_round_key(s, rk[r]);
+	}
+	bs_sub_bytes(s);
+	bs_shuffle(s, shift_rows_mask);
+	bs_add_round_key(s, rk[nr]);
+	bs_unpack(s, out);
+}
+
+static void bs_decrypt8(const bs_vec (*rk)[8], int nr, const uint8_t *in, uint8_t *out) {
+
+	bs_vec s[8];
+
+	bs_pack(in, s);
+	bs_add_round_key(s, rk[nr]);
+	for (int r = nr - 1; r >= 1; r--) {
+		bs_shuffle(s, inv_shift_rows_mask);
+		bs_inv_sub_bytes(s);
+		bs_add_round_key(s, rk[r]);
+		bs_inv_mix_columns(s);
+	}
+	bs_shuffle(s, inv_shift_rows_mask);
+	bs_inv_sub_bytes(s);
+	bs_add_round_key(s, rk[0]);
+	bs_unpack(s, out);
+}
+
+static void bs_process(const struct aes_ctx *ctx, uint8_t *in, uint8_t *out, size_t input_len, uint8_t decrypt) {
+
+	bs_vec rk[AES_MAX_ROUNDS + 1][8];
+	uint8_t tail[BS_LANES * AES_BLOCK_SIZE];
+	size_t num_blocks = input_len / AES_BLOCK_SIZE;
+	size_t i = 0;
+
+	for (int r = 0; r <= ctx->nr; r++) bs_round_key(ctx->w + 16*r, rk[r]);
+
+	for (; i + BS_LANES <= num_blocks; i += BS_LANES) {
+		if (decrypt) bs_decrypt8((const bs_vec (*)[8])rk, ctx->nr, in + i*AES_BLOCK_SIZE, out + i*AES_BLOCK_SIZE);
+		else bs_encrypt8((const bs_vec (*)[8])rk, ctx->nr, in + i*AES_BLOCK_SIZE, out + i*AES_BLOCK_SIZE);
+	}
+
+	// Fewer than eight blocks left: run a padded batch and keep what was asked for
+	if (i < num_blocks) {
+		size_t left = (num_blocks - i) * AES_BLOCK_SIZE;
+
+		memset(tail, 0, sizeof(tail));
+		memcpy(tail, in + i*AES_BLOCK_SIZE, left);
+		if (decrypt) bs_decrypt8((const bs_vec (*)[8])rk, ctx->nr, tail, tail);
+		else bs_encrypt8((const bs_vec (*)[8])rk, ctx->nr, tail, tail);
+		memcpy(out + i*AES_BLOCK_SIZE, tail, left);
+		memset(tail, 0, sizeof(tail));
+	}
+
+	memset(rk, 0, sizeof(rk));
+}
+
+void aes_encrypt_bs(const struct aes_ctx *ctx, uint8_t *in, uint8_t *out, size_t input_len) {
+	bs_process(ctx, in, out, input_len, 0);
+}
+
+void aes_decrypt_bs(const struct aes_ctx *ctx, uint8_t *in, uint8_t *out, size_t input_len) {
+	bs_process(ctx, in, out, input_len, 1);
+}
+
+// Runs every byte value through the bitsliced S-boxes and compares with the tables
+int8_t aes_bs_sbox_check(void) {
+
+	uint8_t in[BS_LANES * AES_BLOCK_SIZE], out[BS_LANES * AES_BLOCK_SIZE];
+	bs_vec s[8];
+
+	for (int half = 0; half < 2; half++) {
+		for (int i = 0; i < (int)sizeof(in); i++) in[i] = (uint8_t)(half * sizeof(in) + i);
+
+		bs_pack(in, s);
+		bs_sub_bytes(s);
+		bs_unpack(s, out);
+		for (int i = 0; i < (int)sizeof(in); i++) {
+			if (out[i] != s_box[in[i]]) return -1;
+		}
+
+		bs_pack(in, s);
+		bs_inv_sub_bytes(s);
+		bs_unpack(s, out);
+		for (int i = 0; i < (int)sizeof(in); i++) {
+			if (out[i] != inv_s_box[in[i]]) return -1;
+		}
+	}
+
+	return 0;
+}
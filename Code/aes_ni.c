@@ -0,0 +1,193 @@
+#include "aes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+
+#define AES_NI_TARGET __attribute__((target("aes,sse2")))
+#define CLMUL_TARGET __attribute__((target("pclmul,ssse3")))
+#define AES_NI_LANES 8
+
+uint8_t aes_ni_available(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2");
+}
+
+uint8_t clmul_available(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3");
+}
+
+// GF(2^128) product of byte-reflected operands: four carry-less multiplies, then the
+// shift-by-one and reduction from Intel's GCM white paper
+CLMUL_TARGET static __m128i gfmul(__m128i a, __m128i b) {
+
+	__m128i t2, t3, t4, t5, t6, t7, t8, t9;
+
+	t3 = _mm_clmulepi64_si128(a, b, 0x00);
+	t4 = _mm_clmulepi64_si128(a, b, 0x10);
+	t5 = _mm_clmulepi64_si128(a, b, 0x01);
+	t6 = _mm_clmulepi64_si128(a, b, 0x11);
+
+	t4 = _mm_xor_si128(t4, t5);
+	t5 = _mm_slli_si128(t4, 8);
+	t4 = _mm_srli_si128(t4, 8);
+	t3 = _mm_xor_si128(t3, t5);
+	t6 = _mm_xor_si128(t6, t4);
+
+	t7 = _mm_srli_epi32(t3, 31);
+	t8 = _mm_srli_epi32(t6, 31);
+	t3 = _mm_slli_epi32(t3, 1);
+	t6 = _mm_slli_epi32(t6, 1);
+	t9 = _mm_srli_si128(t7, 12);
+	t8 = _mm_slli_si128(t8, 4);
+	t7 = _mm_slli_si128(t7, 4);
+	t3 = _mm_or_si128(t3, t7);
+	t6 = _mm_or_si128(t6, t8);
+	t6 = _mm_or_si128(t6, t9);
+
+	t7 = _mm_slli_epi32(t3, 31);
+	t8 = _mm_slli_epi32(t3, 30);
+	t9 = _mm_slli_epi32(t3, 25);
+	t7 = _mm_xor_si128(t7, t8);
+	t7 = _mm_xor_si128(t7, t9);
+	t8 = _mm_srli_si128(t7, 4);
+	t7 = _mm_slli_si128(t7, 12);
+	t3 = _mm_xor_si128(t3, t7);
+
+	t2 = _mm_srli_epi32(t3, 1);
+	t4 = _mm_srli_epi32(t3, 2);
+	t5 = _mm_srli_epi32(t3, 7);
+	t2 = _mm_xor_si128(t2, t4);
+	t2 = _mm_xor_si128(t2, t5);
+	t2 = _mm_xor_si128(t2, t8);
+	t3 = _mm_xor_si128(t3, t2);
+
+	return _mm_xor_si128(t6, t3);
+}
+
+// x = (x ^ block) * h over whole 16-byte blocks
+CLMUL_TARGET void ghash_clmul(uint8_t* x, const uint8_t* h, const uint8_t* data, size_t blocks) {
+
+	const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+	__m128i hv = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)h), bswap);
+	__m128i xv = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)x), bswap);
+
+	for (size_t i = 0; i < blocks; i++) {
+		__m128i d = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + i*AES_BLOCK_SIZE)), bswap);
+		xv = gfmul(_mm_xor_si128(xv, d), hv);
+	}
+
+	_mm_storeu_si128((__m128i*)x, _mm_shuffle_epi8(xv, bswap));
+}
+
+// aesdec expects the equivalent inverse cipher schedule, derived once per key with aesimc
+AES_NI_TARGET void aes_ni_prepare(struct aes_ctx* ctx) {
+
+	int Nr = ctx->nr;
+
+	_mm_storeu_si128((__m128i*)ctx->dw, _mm_loadu_si128((const __m128i*)(ctx->w + 16*Nr)));
+	for (int r = 1; r < Nr; r++) {
+		_mm_storeu_si128((__m128i*)(ctx->dw + 16*r), _mm_aesimc_si128(_mm_loadu_si128((const __m128i*)(ctx->w + 16*(Nr - r)))));
+	}
+	_mm_storeu_si128((__m128i*)(ctx->dw + 16*Nr), _mm_loadu_si128((const __m128i*)ctx->w));
+}
+
+// Eight independent blocks per round keep the aesenc pipeline full
+AES_NI_TARGET void aes_encrypt_ni(const struct aes_ctx* ctx, uint8_t* in, uint8_t* out, size_t input_len) {
+
+	__m128i rk[AES_MAX_ROUNDS + 1];
+	size_t num_blocks = input_len / AES_BLOCK_SIZE;
+	size_t i = 0;
+	int Nr = ctx->nr;
+	int r;
+
+	for (r = 0; r <= Nr; r++) rk[r] = _mm_loadu_si128((const __m128i*)(ctx->w + 16*r));
+
+	for (; i + AES_NI_LANES <= num_blocks; i += AES_NI_LANES) {
+		__m128i b[AES_NI_LANES];
+		int j;
+
+		for (j = 0; j < AES_NI_LANES; j++) {
+			b[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + (i + j)*AES_BLOCK_SIZE)), rk[0]);
+		}
+		for (r = 1; r < Nr; r++) {
+			for (j = 0; j < AES_NI_LANES; j++) b[j] = _mm_aesenc_si128(b[j], rk[r]);
+		}
+		for (j = 0; j < AES_NI_LANES; j++) {
+			_mm_storeu_si128((__m128i*)(out + (i + j)*AES_BLOCK_SIZE), _mm_aesenclast_si128(b[j], rk[Nr]));
+		}
+	}
+
+	for (; i < num_blocks; i++) {
+		__m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + i*AES_BLOCK_SIZE)), rk[0]);
+		for (r = 1; r < Nr; r++) b = _mm_aesenc_si128(b, rk[r]);
+		_mm_storeu_si128((__m128i*)(out + i*AES_BLOCK_SIZE), _mm_aesenclast_si128(b, rk[Nr]));
+	}
+}
+
+AES_NI_TARGET void aes_decrypt_ni(const struct aes_ctx* ctx, uint8_t* in, uint8_t* out, size_t input_len) {
+
+	__m128i rk[AES_MAX_ROUNDS + 1];
+	size_t num_blocks = input_len / AES_BLOCK_SIZE;
+	size_t i = 0;
+	int Nr = ctx->nr;
+	int r;
+
+	for (r = 0; r <= Nr; r++) rk[r] = _mm_loadu_si128((const __m128i*)(ctx->dw + 16*r));
+
+	for (; i + AES_NI_LANES <= num_blocks; i += AES_NI_LANES) {
+		__m128i b[AES_NI_LANES];
+		int j;
+
+		for (j = 0; j < AES_NI_LANES; j++) {
+			b[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + (i + j)*AES_BLOCK_SIZE)), rk[0]);
+		}
+		for (r = 1; r < Nr; r++) {
+			for (j = 0; j < AES_NI_LANES; j++) b[j] = _mm_aesdec_si128(b[j], rk[r]);
+		}
+		for (j = 0; j < AES_NI_LANES; j++) {
+			_mm_storeu_si128((__m128i*)(out + (i + j)*AES_BLOCK_SIZE), _mm_aesdeclast_si128(b[j], rk[Nr]));
+		}
+	}
+
+	for (; i < num_blocks; i++) {
+		__m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in + i*AES_BLOCK_SIZE)), rk[0]);
+		for (r = 1; r < Nr; r++) b = _mm_aesdec_si128(b, rk[r]);
+		_mm_storeu_si128((__m128i*)(out + i*AES_BLOCK_SIZE), _mm_aesdeclast_si128(b, rk[Nr]));
+	}
+}
+
+#else
+
+uint8_t aes_ni_available(void) {
+	return 0;
+}
+
+uint8_t clmul_available(void) {
+	return 0;
+}
+
+void ghash_clmul(uint8_t* x, const uint8_t* h, const uint8_t* data, size_t blocks) {
+}
+
+void aes_ni_prepare(struct aes_ctx* ctx) {
+	ctx->impl = AES_IMPL_TTABLE;
+}
+
+void aes_encrypt_ni(const struct aes_ctx* ctx, uint8_t* in, uint8_t* out, size_t input_len) {
+	struct aes_ctx tmp = *ctx;
+	tmp.impl = AES_IMPL_TTABLE;
+	aes_encrypt(&tmp, in, out, input_len);
+	aes_clear(&tmp);
+}
+
+void aes_decrypt_ni(const struct aes_ctx* ctx, uint8_t* in, uint8_t* out, size_t input_len) {
+	struct aes_ctx tmp = *ctx;
+	tmp.impl = AES_IMPL_TTABLE;
+	aes_decrypt(&tmp, in, out, input_len);
+	aes_clear(&tmp);
+}
+
+#endif
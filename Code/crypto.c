@@ -0,0 +1,454 @@
+#include "crypto.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint8_t master_key[VOLUME_KEY_SIZE];
+
+static struct file_key_entry file_keys[FILE_KEY_SLOTS];
+static pthread_mutex_t file_keys_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct crypto_pool pool = {
+    .mutex = PTHREAD_MUTEX_INITIALIZER, .work = PTHREAD_COND_INITIALIZER, .done = PTHREAD_COND_INITIALIZER
+};
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pool_submit = PTHREAD_MUTEX_INITIALIZER; // one request owns the pool at a time
+
+// Stretches the passphrase with the per-volume salt; check receives a value that tells a wrong passphrase apart
+void derive_master_key(const char* passphrase, const uint8_t* salt, uint8_t* key, uint8_t* check) {
+    pbkdf2_sha256(passphrase, strlen(passphrase), salt, KEY_SALT_SIZE, MASTER_KEY_ITERATIONS, key, VOLUME_KEY_SIZE);
+    hkdf_expand(key, "sfs key check", 13, check, KEY_CHECK_SIZE);
+}
+
+// Installing a key drops every derived schedule
+void set_master_key(const uint8_t* key) {
+    pthread_mutex_lock(&file_keys_mutex);
+    memcpy(master_key, key, VOLUME_KEY_SIZE);
+    pthread_mutex_unlock(&file_keys_mutex);
+
+    file_key_flush();
+}
+
+void derive_file_key(uint32_t inode_num, uint32_t key_gen, uint8_t* key) {
+    uint8_t info[16] = "sfs file key";
+    for (int k = 0; k < 4; k++) {
+        info[8 + k] = (uint8_t)(inode_num >> (24 - 8 * k));
+        info[12 + k] = (uint8_t)(key_gen >> (24 - 8 * k));
+    }
+    hkdf_expand(master_key, info, sizeof(info), key, VOLUME_KEY_SIZE);
+}
+
+// HKDF and key expansion run once per inode and generation, every later block reuses the schedule
+void file_key_get(uint32_t inode_num, uint32_t key_gen, struct aes_ctx* ctx) {
+    pthread_mutex_lock(&file_keys_mutex);
+
+    struct file_key_entry* entry = &file_keys[inode_num % FILE_KEY_SLOTS];
+    if (!entry->used || entry->inode_num != inode_num || entry->key_gen != key_gen) {
+        uint8_t key[VOLUME_KEY_SIZE];
+        derive_file_key(inode_num, key_gen, key);
+        aes_clear(&entry->ctx);
+        aes_init(&entry->ctx, key, VOLUME_KEY_SIZE);
+        memset(key, 0, sizeof(key));
+
+        entry->inode_num = inode_num;
+        entry->key_gen = key_gen;
+        entry->used = 1;
+    }
+    // Copied out, so the slot can be replaced while the caller still uses it
+    *ctx = entry->ctx;
+
+    pthread_mutex_unlock(&file_keys_mutex);
+}
+
+void file_key_flush(void) {
+    pthread_mutex_lock(&file_keys_mutex);
+
+    for (int i = 0; i < FILE_KEY_SLOTS; i++) {
+        aes_clear(&file_keys[i].ctx);
+        file_keys[i].used = 0;
+    }
+
+    pthread_mutex_unlock(&file_keys_mutex);
+}
+
+void random_bytes(uint8_t* buffer, size_t len) {
+    int rnd = open("/dev/urandom", O_RDONLY);
+    ssize_t readden = rnd == -1 ? -1 : read(rnd, buffer, len);
+    if (rnd != -1) close(rnd);
+
+    if (readden != (ssize_t)len) {
+        // Nonces only have to be unique, so a time-seeded fallback is acceptable
+        uint64_t x = (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32) ^ (uintptr_t)buffer;
+        for (size_t i = 0; i < len; i++) {
+            x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+            buffer[i] = (uint8_t)x;
+        }
+    }
+}
+
+static uint64_t to_be64(uint64_t v) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap64(v);
+#else
+    return v;
+#endif
+}
+
+static uint32_t to_be32(uint32_t v) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    return __builtin_bswap32(v);
+#else
+    return v;
+#endif
+}
+
+// data ^= stream a word at a time; memcpy keeps it alignment-free and lets the compiler vectorize
+static void xor_stream(uint8_t* data, const uint8_t* stream, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, data + i, 8);
+        memcpy(&b, stream + i, 8);
+        a ^= b;
+        memcpy(data + i, &a, 8);
+    }
+    for (; i < n; i++) data[i] ^= stream[i];
+}
+
+// Counter block is nonce || be64(offset / 16), so any 16-byte position can be decrypted on its own
+void ctr_xor(const struct aes_ctx* ctx, const uint8_t* nonce, uint64_t offset, uint8_t* data, size_t len) {
+    uint8_t counters[CTR_BATCH_BLOCKS * AES_BLOCK_SIZE];
+    uint8_t stream[CTR_BATCH_BLOCKS * AES_BLOCK_SIZE];
+    uint64_t block = offset / AES_BLOCK_SIZE;
+    size_t skip = offset % AES_BLOCK_SIZE;
+    size_t done = 0;
+
+    // The nonce half is written once, every batch only moves the counter half on
+    size_t slots = (skip + len + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+    if (slots > CTR_BATCH_BLOCKS) slots = CTR_BATCH_BLOCKS;
+    for (size_t b = 0; b < slots; b++) memcpy(counters + b * AES_BLOCK_SIZE, nonce, AES_BLOCK_SIZE / 2);
+
+    while (done < len) {
+        size_t blocks = (skip + len - done + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+        if (blocks > CTR_BATCH_BLOCKS) blocks = CTR_BATCH_BLOCKS;
+
+        for (size_t b = 0; b < blocks; b++) {
+            uint64_t value = to_be64(block + b);
+            memcpy(counters + b * AES_BLOCK_SIZE + AES_BLOCK_SIZE / 2, &value, sizeof(value));
+        }
+        aes_encrypt(ctx, counters, stream, blocks * AES_BLOCK_SIZE);
+
+        size_t n = blocks * AES_BLOCK_SIZE - skip;
+        if (n > len - done) n = len - done;
+        xor_stream(data + done, stream + skip, n);
+
+        done += n;
+        block += blocks;
+        skip = 0;
+    }
+
+    memset(stream, 0, sizeof(stream));
+}
+
+static void crypto_run(struct crypto_job* job) {
+    if (job->op == CRYPTO_OP_CTR) {
+        ctr_xor(job->ctx, job->nonce, job->offset, job->data, job->len);
+        job->status = 0;
+        return;
+    }
+
+    uint8_t iv[GCM_IV_SIZE];
+    uint32_t extent = job->offset / CRYPTO_EXTENT_SIZE;
+    job->status = 0;
+
+    for (size_t done = 0; done < job->len; done += CRYPTO_EXTENT_SIZE, extent++) {
+        size_t n = job->len - done < CRYPTO_EXTENT_SIZE ? job->len - done : CRYPTO_EXTENT_SIZE;
+        uint8_t* tag = job->tags + (done / CRYPTO_EXTENT_SIZE) * GCM_TAG_SIZE;
+
+        // IV is nonce || be32(extent), so every block of every file gets its own counter space
+        memcpy(iv, job->nonce, GCM_IV_SIZE - 4);
+        for (int k = 0; k < 4; k++) iv[GCM_IV_SIZE - 1 - k] = (uint8_t)(extent >> (8 * k));
+
+        if (job->op == CRYPTO_OP_GCM_ENCRYPT) gcm_encrypt(job->ctx, iv, NULL, 0, job->data + done, n, tag);
+        else if (gcm_decrypt(job->ctx, iv, NULL, 0, job->data + done, n, tag) != 0) job->status = -1;
+    }
+}
+
+void* crypto_worker(void* arg) {
+    while (1) {
+        pthread_mutex_lock(&pool.mutex);
+        while (pool.next_job >= pool.job_count) pthread_cond_wait(&pool.work, &pool.mutex);
+        struct crypto_job* job = &pool.jobs[pool.next_job++];
+        pthread_mutex_unlock(&pool.mutex);
+
+        crypto_run(job);
+
+        pthread_mutex_lock(&pool.mutex);
+        if (--pool.pending == 0) pthread_cond_signal(&pool.done);
+        pthread_mutex_unlock(&pool.mutex);
+    }
+    return NULL;
+}
+
+static void crypto_pool_start(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t workers = cpus > 1 ? cpus - 1 : 0;
+    if (workers > CRYPTO_MAX_WORKERS) workers = CRYPTO_MAX_WORKERS;
+
+    for (uint32_t i = 0; i < workers; i++) {
+        if (pthread_create(&pool.threads[i], NULL, crypto_worker, NULL) != 0) break;
+        pthread_detach(pool.threads[i]);
+        pool.workers++;
+    }
+}
+
+// Large requests are split on align boundaries across the pool, the caller taking one share
+static int8_t crypto_dispatch(struct crypto_job* request, size_t align) {
+    pthread_once(&pool_once, crypto_pool_start);
+
+    // AES-NI gets through a share faster than a worker wakes up, so it needs far bigger ones
+    size_t share_min = request->ctx->impl == AES_IMPL_NI ? CRYPTO_PARALLEL_MIN_NI : CRYPTO_PARALLEL_MIN;
+    if (request->len < 2 * share_min || pool.workers == 0) {
+        crypto_run(request);
+        return request->status;
+    }
+
+    pthread_mutex_lock(&pool_submit);
+
+    uint32_t parts = pool.workers + 1;
+    if (parts > request->len / share_min) parts = request->len / share_min;
+    size_t part_len = (request->len / parts + align - 1) / align * align;
+
+    pthread_mutex_lock(&pool.mutex);
+    size_t start = 0;
+    for (uint32_t i = 0; i < parts; i++) {
+        size_t n = i == parts - 1 || start + part_len > request->len ? request->len - start : part_len;
+        pool.jobs[i] = *request;
+        pool.jobs[i].offset += start;
+        pool.jobs[i].data += start;
+        pool.jobs[i].len = n;
+        if (request->tags != NULL) pool.jobs[i].tags += start / CRYPTO_EXTENT_SIZE * GCM_TAG_SIZE;
+        start += n;
+    }
+    pool.next_job = 1;
+    pool.job_count = parts;
+    pool.pending = parts - 1;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.mutex);
+
+    crypto_run(&pool.jobs[0]);
+
+    pthread_mutex_lock(&pool.mutex);
+    while (pool.pending > 0) pthread_cond_wait(&pool.done, &pool.mutex);
+    int8_t status = 0;
+    for (uint32_t i = 0; i < parts; i++) {
+        if (pool.jobs[i].status != 0) status = pool.jobs[i].status;
+    }
+    pool.next_job = pool.job_count = 0;
+    pthread_mutex_unlock(&pool.mutex);
+
+    pthread_mutex_unlock(&pool_submit);
+    return status;
+}
+
+// Encrypts or decrypts in place
+void ctr_crypt(const struct aes_ctx* ctx, const uint8_t* nonce, uint64_t offset, uint8_t* data, size_t len) {
+    struct crypto_job request = { ctx, nonce, offset, data, len, CRYPTO_OP_CTR, NULL, 0 };
+    crypto_dispatch(&request, AES_BLOCK_SIZE);
+}
+
+// x = (x ^ block) * h in GF(2^128), bit by bit with masks instead of branches
+void ghash_portable(uint8_t* x, const uint8_t* h, const uint8_t* data, size_t blocks) {
+    uint64_t hh = 0, hl = 0, xh = 0, xl = 0;
+
+    for (int k = 0; k < 8; k++) {
+        hh = (hh << 8) | h[k];
+        hl = (hl << 8) | h[8 + k];
+        xh = (xh << 8) | x[k];
+        xl = (xl << 8) | x[8 + k];
+    }
+
+    for (size_t b = 0; b < blocks; b++) {
+        const uint8_t* d = data + b * AES_BLOCK_SIZE;
+        uint64_t zh = 0, zl = 0, vh = hh, vl = hl;
+
+        for (int k = 0; k < 8; k++) {
+            xh ^= (uint64_t)d[k] << (56 - 8 * k);
+            xl ^= (uint64_t)d[8 + k] << (56 - 8 * k);
+        }
+
+        for (int i = 0; i < 128; i++) {
+            uint64_t bit = i < 64 ? (xh >> (63 - i)) & 1 : (xl >> (127 - i)) & 1;
+            uint64_t mask = -bit;
+            zh ^= vh & mask;
+            zl ^= vl & mask;
+
+            uint64_t lsb = -(vl & 1);
+            vl = (vl >> 1) | (vh << 63);
+            vh = (vh >> 1) ^ (0xE100000000000000ULL & lsb);
+        }
+
+        xh = zh;
+        xl = zl;
+    }
+
+    for (int k = 0; k < 8; k++) {
+        x[k] = (uint8_t)(xh >> (56 - 8 * k));
+        x[8 + k] = (uint8_t)(xl >> (56 - 8 * k));
+    }
+}
+
+static void ghash(uint8_t* x, const uint8_t* h, const uint8_t* data, size_t len) {
+    size_t blocks = len / AES_BLOCK_SIZE;
+
+    if (clmul_available()) ghash_clmul(x, h, data, blocks);
+    else ghash_portable(x, h, data, blocks);
+
+    if (len % AES_BLOCK_SIZE != 0) {
+        uint8_t last[AES_BLOCK_SIZE] = {0};
+        memcpy(last, data + blocks * AES_BLOCK_SIZE, len % AES_BLOCK_SIZE);
+        if (clmul_available()) ghash_clmul(x, h, last, 1);
+        else ghash_portable(x, h, last, 1);
+    }
+}
+
+// One pass: each batch of keystream is applied and hashed while it is still in cache
+static void gcm_crypt(const struct aes_ctx* ctx, const uint8_t* iv, const uint8_t* aad, size_t aad_len,
+                      uint8_t* data, size_t len, uint8_t* tag, uint8_t decrypt) {
+    uint8_t h[AES_BLOCK_SIZE] = {0};
+    uint8_t j0[AES_BLOCK_SIZE];
+    uint8_t x[AES_BLOCK_SIZE] = {0};
+    uint8_t counters[CTR_BATCH_BLOCKS * AES_BLOCK_SIZE];
+    uint8_t stream[CTR_BATCH_BLOCKS * AES_BLOCK_SIZE];
+    uint32_t counter = 2;
+
+    aes_encrypt(ctx, h, h, AES_BLOCK_SIZE);
+    memcpy(j0, iv, GCM_IV_SIZE);
+    j0[12] = 0; j0[13] = 0; j0[14] = 0; j0[15] = 1;
+
+    if (aad_len > 0) ghash(x, h, aad, aad_len);
+
+    size_t slots = (len + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+    if (slots > CTR_BATCH_BLOCKS) slots = CTR_BATCH_BLOCKS;
+    for (size_t b = 0; b < slots; b++) memcpy(counters + b * AES_BLOCK_SIZE, j0, GCM_IV_SIZE);
+
+    for (size_t done = 0; done < len; ) {
+        size_t blocks = (len - done + AES_BLOCK_SIZE - 1) / AES_BLOCK_SIZE;
+        if (blocks > CTR_BATCH_BLOCKS) blocks = CTR_BATCH_BLOCKS;
+
+        for (size_t b = 0; b < blocks; b++, counter++) {
+            uint32_t value = to_be32(counter);
+            memcpy(counters + b * AES_BLOCK_SIZE + GCM_IV_SIZE, &value, sizeof(value));
+        }
+        aes_encrypt(ctx, counters, stream, blocks * AES_BLOCK_SIZE);
+
+        size_t n = blocks * AES_BLOCK_SIZE;
+        if (n > len - done) n = len - done;
+        // The hash always covers the ciphertext
+        if (decrypt) ghash(x, h, data + done, n);
+        xor_stream(data + done, stream, n);
+        if (!decrypt) ghash(x, h, data + done, n);
+
+        done += n;
+    }
+
+    uint8_t lengths[AES_BLOCK_SIZE];
+    uint64_t aad_bits = (uint64_t)aad_len * 8, data_bits = (uint64_t)len * 8;
+    for (int k = 0; k < 8; k++) {
+        lengths[7 - k] = (uint8_t)(aad_bits >> (8 * k));
+        lengths[15 - k] = (uint8_t)(data_bits >> (8 * k));
+    }
+    ghash(x, h, lengths, AES_BLOCK_SIZE);
+
+    aes_encrypt(ctx, j0, j0, AES_BLOCK_SIZE);
+    for (int i = 0; i < AES_BLOCK_SIZE; i++) tag[i] = x[i] ^ j0[i];
+
+    memset(stream, 0, sizeof(stream));
+    memset(h, 0, sizeof(h));
+}
+
+void gcm_encrypt(const struct aes_ctx* ctx, const uint8_t* iv, const uint8_t* aad, size_t aad_len,
+                 uint8_t* data, size_t len, uint8_t* tag) {
+    gcm_crypt(ctx, iv, aad, aad_len, data, len, tag, 0);
+}
+
+// On a tag mismatch the output is wiped, so unauthenticated plaintext never reaches the caller
+int8_t gcm_decrypt(const struct aes_ctx* ctx, const uint8_t* iv, const uint8_t* aad, size_t aad_len,
+                   uint8_t* data, size_t len, const uint8_t* tag) {
+    uint8_t expected[GCM_TAG_SIZE];
+    uint8_t diff = 0;
+
+    gcm_crypt(ctx, iv, aad, aad_len, data, len, expected, 1);
+    for (int i = 0; i < GCM_TAG_SIZE; i++) diff |= expected[i] ^ tag[i];
+
+    if (diff != 0) {
+        memset(data, 0, len);
+        return -1;
+    }
+    return 0;
+}
+
+// Authenticates each CRYPTO_EXTENT_SIZE extent separately; tags holds one tag per extent
+int8_t gcm_crypt_extents(const struct aes_ctx* ctx, const uint8_t* nonce, uint32_t first_extent,
+                         uint8_t* data, size_t len, uint8_t* tags, uint8_t decrypt) {
+    struct crypto_job request = {
+        ctx, nonce, (uint64_t)first_extent * CRYPTO_EXTENT_SIZE, data, len,
+        decrypt ? CRYPTO_OP_GCM_DECRYPT : CRYPTO_OP_GCM_ENCRYPT, tags, 0
+    };
+    return crypto_dispatch(&request, CRYPTO_EXTENT_SIZE);
+}
+
+// Test cases 2 and 4 from the GCM specification (AES-128, 96-bit IV, the second with AAD)
+int8_t gcm_self_test(void) {
+    static const uint8_t key4[16] = {
+        0xfe, 0xff, 0xe9, 0x92, 0x86, 0x65, 0x73, 0x1c, 0x6d, 0x6a, 0x8f, 0x94, 0x67, 0x30, 0x83, 0x08};
+    static const uint8_t iv4[GCM_IV_SIZE] = {
+        0xca, 0xfe, 0xba, 0xbe, 0xfa, 0xce, 0xdb, 0xad, 0xde, 0xca, 0xf8, 0x88};
+    static const uint8_t aad4[20] = {
+        0xfe, 0xed, 0xfa, 0xce, 0xde, 0xad, 0xbe, 0xef, 0xfe, 0xed, 0xfa, 0xce, 0xde, 0xad, 0xbe, 0xef,
+        0xab, 0xad, 0xda, 0xd2};
+    static const uint8_t plain4[60] = {
+        0xd9, 0x31, 0x32, 0x25, 0xf8, 0x84, 0x06, 0xe5, 0xa5, 0x59, 0x09, 0xc5, 0xaf, 0xf5, 0x26, 0x9a,
+        0x86, 0xa7, 0xa9, 0x53, 0x15, 0x34, 0xf7, 0xda, 0x2e, 0x4c, 0x30, 0x3d, 0x8a, 0x31, 0x8a, 0x72,
+        0x1c, 0x3c, 0x0c, 0x95, 0x95, 0x68, 0x09, 0x53, 0x2f, 0xcf, 0x0e, 0x24, 0x49, 0xa6, 0xb5, 0x25,
+        0xb1, 0x6a, 0xed, 0xf5, 0xaa, 0x0d, 0xe6, 0x57, 0xba, 0x63, 0x7b, 0x39};
+    static const uint8_t cipher4[60] = {
+        0x42, 0x83, 0x1e, 0xc2, 0x21, 0x77, 0x74, 0x24, 0x4b, 0x72, 0x21, 0xb7, 0x84, 0xd0, 0xd4, 0x9c,
+        0xe3, 0xaa, 0x21, 0x2f, 0x2c, 0x02, 0xa4, 0xe0, 0x35, 0xc1, 0x7e, 0x23, 0x29, 0xac, 0xa1, 0x2e,
+        0x21, 0xd5, 0x14, 0xb2, 0x54, 0x66, 0x93, 0x1c, 0x7d, 0x8f, 0x6a, 0x5a, 0xac, 0x84, 0xaa, 0x05,
+        0x1b, 0xa3, 0x0b, 0x39, 0x6a, 0x0a, 0xac, 0x97, 0x3d, 0x58, 0xe0, 0x91};
+    static const uint8_t tag4[GCM_TAG_SIZE] = {
+        0x5b, 0xc9, 0x4f, 0xbc, 0x32, 0x21, 0xa5, 0xdb, 0x94, 0xfa, 0xe9, 0x5a, 0xe7, 0x12, 0x1a, 0x47};
+    static const uint8_t cipher2[16] = {
+        0x03, 0x88, 0xda, 0xce, 0x60, 0xb6, 0xa3, 0x92, 0xf3, 0x28, 0xc2, 0xb9, 0x71, 0xb2, 0xfe, 0x78};
+    static const uint8_t tag2[GCM_TAG_SIZE] = {
+        0xab, 0x6e, 0x47, 0xd4, 0x2c, 0xec, 0x13, 0xbd, 0xf5, 0x3a, 0x67, 0xb2, 0x12, 0x57, 0xbd, 0xdf};
+
+    struct aes_ctx ctx;
+    uint8_t zero_key[16] = {0}, zero_iv[GCM_IV_SIZE] = {0};
+    uint8_t data[60], tag[GCM_TAG_SIZE];
+    int8_t result = 0;
+
+    aes_init(&ctx, zero_key, sizeof(zero_key));
+    memset(data, 0, 16);
+    gcm_encrypt(&ctx, zero_iv, NULL, 0, data, 16, tag);
+    if (memcmp(data, cipher2, 16) != 0 || memcmp(tag, tag2, GCM_TAG_SIZE) != 0) result = -1;
+
+    aes_init(&ctx, key4, sizeof(key4));
+    memcpy(data, plain4, sizeof(plain4));
+    gcm_encrypt(&ctx, iv4, aad4, sizeof(aad4), data, sizeof(plain4), tag);
+    if (memcmp(data, cipher4, sizeof(cipher4)) != 0 || memcmp(tag, tag4, GCM_TAG_SIZE) != 0) result = -1;
+
+    if (result == 0 && gcm_decrypt(&ctx, iv4, aad4, sizeof(aad4), data, sizeof(cipher4), tag4) != 0) result = -2;
+    if (result == 0 && memcmp(data, plain4, sizeof(plain4)) != 0) result = -2;
+
+    // A flipped bit has to be rejected
+    memcpy(data, cipher4, sizeof(cipher4));
+    data[7] ^= 1;
+    if (result == 0 && gcm_decrypt(&ctx, iv4, aad4, sizeof(aad4), data, sizeof(cipher4), tag4) != -1) result = -3;
+
+    aes_clear(&ctx);
+    return result;
+}
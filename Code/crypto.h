@@ -0,0 +1,78 @@
+#pragma once
+
+#include "aes.h"
+#include "kdf.h"
+
+#include <pthread.h>
+
+#define FILE_KEY_SLOTS 256 // one per inode
+#define VOLUME_KEY_SIZE 32
+#define KEY_SALT_SIZE 16
+#define KEY_CHECK_SIZE 16
+#define MASTER_KEY_ITERATIONS 100000
+
+#define CRYPTO_MAX_WORKERS 4
+#define CRYPTO_PARALLEL_MIN 16384 // smallest share worth handing to the pool
+#define CRYPTO_PARALLEL_MIN_NI 262144 // the same with AES-NI
+#define CTR_BATCH_BLOCKS 64
+
+#define GCM_IV_SIZE 12
+#define GCM_TAG_SIZE 16
+#define CRYPTO_EXTENT_SIZE 4096 // one file system block, authenticated on its own
+
+#define CRYPTO_OP_CTR 0
+#define CRYPTO_OP_GCM_ENCRYPT 1
+#define CRYPTO_OP_GCM_DECRYPT 2
+
+// Expanded schedule of one file's subkey, valid for a single key generation
+struct file_key_entry {
+    uint32_t inode_num;
+    uint32_t key_gen;
+    uint8_t used;
+    struct aes_ctx ctx;
+};
+
+void derive_master_key(const char* passphrase, const uint8_t* salt, uint8_t* key, uint8_t* check);
+void set_master_key(const uint8_t* key);
+void derive_file_key(uint32_t inode_num, uint32_t key_gen, uint8_t* key);
+void file_key_get(uint32_t inode_num, uint32_t key_gen, struct aes_ctx* ctx);
+void file_key_flush(void);
+
+// A slice of a request; offset is the byte position of data within the file.
+// GCM slices always start on an extent boundary and carry one tag per extent.
+struct crypto_job {
+    const struct aes_ctx* ctx;
+    const uint8_t* nonce;
+    uint64_t offset;
+    uint8_t* data;
+    size_t len;
+    uint8_t op;
+    uint8_t* tags;
+    int8_t status;
+};
+
+struct crypto_pool {
+    pthread_t threads[CRYPTO_MAX_WORKERS];
+    uint32_t workers;
+    pthread_mutex_t mutex;
+    pthread_cond_t work;
+    pthread_cond_t done;
+    struct crypto_job jobs[CRYPTO_MAX_WORKERS + 1];
+    uint32_t next_job;
+    uint32_t job_count;
+    uint32_t pending;
+};
+
+void random_bytes(uint8_t* buffer, size_t len);
+void ctr_xor(const struct aes_ctx* ctx, const uint8_t* nonce, uint64_t offset, uint8_t* data, size_t len);
+void ctr_crypt(const struct aes_ctx* ctx, const uint8_t* nonce, uint64_t offset, uint8_t* data, size_t len);
+void* crypto_worker(void* arg);
+
+void ghash_portable(uint8_t* x, const uint8_t* h, const uint8_t* data, size_t blocks);
+void gcm_encrypt(const struct aes_ctx* ctx, const uint8_t* iv, const uint8_t* aad, size_t aad_len,
+                 uint8_t* data, size_t len, uint8_t* tag);
+int8_t gcm_decrypt(const struct aes_ctx* ctx, const uint8_t* iv, const uint8_t* aad, size_t aad_len,
+                   uint8_t* data, size_t len, const uint8_t* tag);
+int8_t gcm_crypt_extents(const struct aes_ctx* ctx, const uint8_t* nonce, uint32_t first_extent,
+                         uint8_t* data, size_t len, uint8_t* tags, uint8_t decrypt);
+int8_t gcm_self_test(void);
@@ -0,0 +1,138 @@
+#include "delta.h"
+#include "kdf.h"
+
+#include <string.h>
+
+// rsync's rolling checksum: a is the plain byte sum, b weighs every byte by its distance to the end
+uint32_t weak_checksum(const uint8_t* data, size_t len) {
+    uint32_t a = 0, b = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        a += data[i];
+        b += (uint32_t)(len - i) * data[i];
+    }
+    return (a & 0xFFFF) | (b << 16);
+}
+
+// Slides the window one byte: out leaves, in enters
+static uint32_t weak_roll(uint32_t weak, uint8_t out, uint8_t in, size_t len) {
+    uint32_t a = weak & 0xFFFF, b = weak >> 16;
+
+    a = (a - out + in) & 0xFFFF;
+    b = (b - (uint32_t)len * out + a) & 0xFFFF;
+    return a | (b << 16);
+}
+
+void strong_checksum(const uint8_t* data, size_t len, uint8_t* out) {
+    struct sha256_ctx ctx;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, digest);
+    memcpy(out, digest, DELTA_STRONG_SIZE);
+}
+
+uint32_t delta_signatures(const uint8_t* basis, size_t size, struct block_signature* sigs, uint32_t max_sigs) {
+    uint32_t count = 0;
+
+    for (size_t offset = 0; offset < size && count < max_sigs; offset += DELTA_BLOCK_SIZE) {
+        sigs[count].length = size - offset < DELTA_BLOCK_SIZE ? size - offset : DELTA_BLOCK_SIZE;
+        sigs[count].weak = weak_checksum(basis + offset, sigs[count].length);
+        strong_checksum(basis + offset, sigs[count].length, sigs[count].strong);
+        count++;
+    }
+    return count;
+}
+
+static int32_t find_match(const uint8_t* window, uint32_t weak, const struct block_signature* sigs, uint32_t sig_count) {
+    uint8_t strong[DELTA_STRONG_SIZE];
+    uint8_t have_strong = 0;
+
+    // Files hold MAX_BLOCK_COUNT blocks at most, a linear scan beats a hash table here
+    for (uint32_t i = 0; i < sig_count; i++) {
+        if (sigs[i].length != DELTA_BLOCK_SIZE || sigs[i].weak != weak) continue;
+        if (!have_strong) {
+            strong_checksum(window, DELTA_BLOCK_SIZE, strong);
+            have_strong = 1;
+        }
+        if (memcmp(sigs[i].strong, strong, DELTA_STRONG_SIZE) == 0) return i;
+    }
+    return -1;
+}
+
+// The short last block of the old file can only match the very end of the new one
+static int32_t find_tail_match(const uint8_t* data, size_t size, const struct block_signature* sigs, uint32_t sig_count) {
+    const struct block_signature* tail = sig_count ? &sigs[sig_count - 1] : NULL;
+    uint8_t strong[DELTA_STRONG_SIZE];
+
+    if (!tail || tail->length == DELTA_BLOCK_SIZE || tail->length > size) return -1;
+    const uint8_t* window = data + size - tail->length;
+    if (weak_checksum(window, tail->length) != tail->weak) return -1;
+    strong_checksum(window, tail->length, strong);
+    return memcmp(strong, tail->strong, DELTA_STRONG_SIZE) == 0 ? (int32_t)(sig_count - 1) : -1;
+}
+
+static uint32_t push_literal(struct delta_op* ops, uint32_t count, uint32_t max_ops, size_t start, size_t end) {
+    if (end == start || count >= max_ops) return count;
+    ops[count] = (struct delta_op){ .type = DELTA_LITERAL, .offset = start, .length = end - start };
+    return count + 1;
+}
+
+// Walks the new file byte by byte looking for blocks the receiver already has; everything between
+// matches goes as literal bytes. Returns the number of ops, 0 if max_ops was too small
+uint32_t delta_compute(const uint8_t* data, size_t size, const struct block_signature* sigs, uint32_t sig_count,
+                       struct delta_op* ops, uint32_t max_ops) {
+    uint32_t count = 0;
+    size_t literal_start = 0;
+    size_t pos = 0;
+
+    uint32_t weak = size >= DELTA_BLOCK_SIZE ? weak_checksum(data, DELTA_BLOCK_SIZE) : 0;
+    while (sig_count > 0 && pos + DELTA_BLOCK_SIZE <= size) {
+        int32_t match = find_match(data + pos, weak, sigs, sig_count);
+        if (match >= 0) {
+            count = push_literal(ops, count, max_ops, literal_start, pos);
+            if (count >= max_ops) return 0;
+            ops[count++] = (struct delta_op){ .type = DELTA_COPY, .block = match, .length = DELTA_BLOCK_SIZE };
+
+            pos += DELTA_BLOCK_SIZE;
+            literal_start = pos;
+            if (pos + DELTA_BLOCK_SIZE <= size) weak = weak_checksum(data + pos, DELTA_BLOCK_SIZE);
+            continue;
+        }
+
+        if (pos + DELTA_BLOCK_SIZE < size) weak = weak_roll(weak, data[pos], data[pos + DELTA_BLOCK_SIZE], DELTA_BLOCK_SIZE);
+        pos++;
+    }
+
+    size_t end = size;
+    int32_t tail = find_tail_match(data + literal_start, size - literal_start, sigs, sig_count);
+    if (tail >= 0) end = size - sigs[tail].length;
+
+    uint32_t before = count;
+    count = push_literal(ops, count, max_ops, literal_start, end);
+    if (count == before && literal_start < end) return 0;
+    if (tail >= 0) {
+        if (count >= max_ops) return 0;
+        ops[count++] = (struct delta_op){ .type = DELTA_COPY, .block = tail, .length = sigs[tail].length };
+    }
+    return count;
+}
+
+void signature_encode(const struct block_signature* sigs, uint32_t count, uint8_t* out) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t* p = out + i * DELTA_SIGNATURE_SIZE;
+        p[0] = sigs[i].weak >> 24; p[1] = sigs[i].weak >> 16; p[2] = sigs[i].weak >> 8; p[3] = sigs[i].weak;
+        memcpy(p + 4, sigs[i].strong, DELTA_STRONG_SIZE);
+    }
+}
+
+// tail is the length of the last block, DELTA_BLOCK_SIZE when the old file ends on a block boundary
+void signature_decode(const uint8_t* in, uint32_t count, uint32_t tail, struct block_signature* sigs) {
+    for (uint32_t i = 0; i < count; i++) {
+        const uint8_t* p = in + i * DELTA_SIGNATURE_SIZE;
+        sigs[i].weak = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+        memcpy(sigs[i].strong, p + 4, DELTA_STRONG_SIZE);
+        sigs[i].length = i + 1 == count ? tail : DELTA_BLOCK_SIZE;
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define DELTA_BLOCK_SIZE 4096
+#define DELTA_STRONG_SIZE 16 // truncated SHA-256
+#define DELTA_SIGNATURE_SIZE (4 + DELTA_STRONG_SIZE)
+
+#define DELTA_COPY 0    // block of the receiver's old file
+#define DELTA_LITERAL 1 // bytes of the new file
+
+// Checksums of one block of the receiver's old file; only the last one may be short
+struct block_signature {
+    uint32_t weak;
+    uint8_t strong[DELTA_STRONG_SIZE];
+    uint32_t length;
+};
+
+// One step of rebuilding the new file
+struct delta_op {
+    uint8_t type;
+    uint32_t block;  // DELTA_COPY
+    size_t offset;   // DELTA_LITERAL, into the new file
+    size_t length;
+};
+
+uint32_t weak_checksum(const uint8_t* data, size_t len);
+void strong_checksum(const uint8_t* data, size_t len, uint8_t* out);
+uint32_t delta_signatures(const uint8_t* basis, size_t size, struct block_signature* sigs, uint32_t max_sigs);
+uint32_t delta_compute(const uint8_t* data, size_t size, const struct block_signature* sigs, uint32_t sig_count,
+                       struct delta_op* ops, uint32_t max_ops);
+void signature_encode(const struct block_signature* sigs, uint32_t count, uint8_t* out);
+void signature_decode(const uint8_t* in, uint32_t count, uint32_t tail, struct block_signature* sigs);
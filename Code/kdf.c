@@ -0,0 +1,197 @@
+#include "kdf.h"
+
+#include <string.h>
+
+static const uint32_t K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(uint32_t* state, const uint8_t* block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+        uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+void sha256_init(struct sha256_ctx* ctx) {
+    static const uint32_t iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->length = 0;
+    ctx->used = 0;
+}
+
+void sha256_update(struct sha256_ctx* ctx, const void* data, size_t len) {
+    const uint8_t* bytes = data;
+    ctx->length += len;
+
+    while (len > 0) {
+        size_t n = SHA256_BLOCK_SIZE - ctx->used;
+        if (n > len) n = len;
+        memcpy(ctx->buffer + ctx->used, bytes, n);
+        ctx->used += n;
+        bytes += n;
+        len -= n;
+
+        if (ctx->used == SHA256_BLOCK_SIZE) {
+            sha256_block(ctx->state, ctx->buffer);
+            ctx->used = 0;
+        }
+    }
+}
+
+void sha256_final(struct sha256_ctx* ctx, uint8_t* digest) {
+    uint64_t bits = ctx->length * 8;
+    uint8_t pad = 0x80;
+
+    sha256_update(ctx, &pad, 1);
+    pad = 0;
+    while (ctx->used != SHA256_BLOCK_SIZE - 8) sha256_update(ctx, &pad, 1);
+
+    uint8_t length[8];
+    for (int i = 0; i < 8; i++) length[i] = (uint8_t)(bits >> (56 - 8 * i));
+    sha256_update(ctx, length, 8);
+
+    for (int i = 0; i < 8; i++) {
+        digest[4 * i] = (uint8_t)(ctx->state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(ctx->state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(ctx->state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)ctx->state[i];
+    }
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void hmac_sha256(const uint8_t* key, size_t key_len, const void* data, size_t len, uint8_t* mac) {
+    uint8_t block[SHA256_BLOCK_SIZE] = {0};
+    uint8_t inner[SHA256_DIGEST_SIZE];
+    struct sha256_ctx ctx;
+
+    if (key_len > SHA256_BLOCK_SIZE) {
+        sha256_init(&ctx);
+        sha256_update(&ctx, key, key_len);
+        sha256_final(&ctx, block);
+    } else {
+        memcpy(block, key, key_len);
+    }
+
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) block[i] ^= 0x36;
+    sha256_init(&ctx);
+    sha256_update(&ctx, block, SHA256_BLOCK_SIZE);
+    sha256_update(&ctx, data, len);
+    sha256_final(&ctx, inner);
+
+    for (int i = 0; i < SHA256_BLOCK_SIZE; i++) block[i] ^= 0x36 ^ 0x5c;
+    sha256_init(&ctx);
+    sha256_update(&ctx, block, SHA256_BLOCK_SIZE);
+    sha256_update(&ctx, inner, SHA256_DIGEST_SIZE);
+    sha256_final(&ctx, mac);
+
+    memset(block, 0, sizeof(block));
+    memset(inner, 0, sizeof(inner));
+}
+
+// Deliberately slow, it turns a typed passphrase into the volume master key once per mount
+void pbkdf2_sha256(const void* password, size_t password_len, const uint8_t* salt, size_t salt_len,
+                   uint32_t iterations, uint8_t* out, size_t out_len) {
+    uint8_t input[SHA256_BLOCK_SIZE + 4];
+    uint8_t u[SHA256_DIGEST_SIZE], t[SHA256_DIGEST_SIZE];
+
+    for (uint32_t index = 1; out_len > 0; index++) {
+        size_t salt_part = salt_len > SHA256_BLOCK_SIZE ? SHA256_BLOCK_SIZE : salt_len;
+        memcpy(input, salt, salt_part);
+        for (int k = 0; k < 4; k++) input[salt_part + k] = (uint8_t)(index >> (24 - 8 * k));
+
+        hmac_sha256(password, password_len, input, salt_part + 4, u);
+        memcpy(t, u, sizeof(t));
+        for (uint32_t i = 1; i < iterations; i++) {
+            hmac_sha256(password, password_len, u, sizeof(u), u);
+            for (int k = 0; k < SHA256_DIGEST_SIZE; k++) t[k] ^= u[k];
+        }
+
+        size_t n = out_len < SHA256_DIGEST_SIZE ? out_len : SHA256_DIGEST_SIZE;
+        memcpy(out, t, n);
+        out += n;
+        out_len -= n;
+    }
+
+    memset(u, 0, sizeof(u));
+    memset(t, 0, sizeof(t));
+}
+
+// RFC 5869
+void hkdf_extract(const uint8_t* salt, size_t salt_len, const void* ikm, size_t ikm_len, uint8_t* prk) {
+    uint8_t zero[SHA256_DIGEST_SIZE] = {0};
+    if (salt == NULL) {
+        salt = zero;
+        salt_len = sizeof(zero);
+    }
+    hmac_sha256(salt, salt_len, ikm, ikm_len, prk);
+}
+
+void hkdf_expand(const uint8_t* prk, const void* info, size_t info_len, uint8_t* out, size_t out_len) {
+    uint8_t block[SHA256_DIGEST_SIZE + 256 + 1];
+    uint8_t t[SHA256_DIGEST_SIZE];
+    size_t t_len = 0;
+
+    if (info_len > 256) info_len = 256;
+
+    for (uint8_t counter = 1; out_len > 0; counter++) {
+        memcpy(block, t, t_len);
+        memcpy(block + t_len, info, info_len);
+        block[t_len + info_len] = counter;
+        hmac_sha256(prk, SHA256_DIGEST_SIZE, block, t_len + info_len + 1, t);
+        t_len = SHA256_DIGEST_SIZE;
+
+        size_t n = out_len < SHA256_DIGEST_SIZE ? out_len : SHA256_DIGEST_SIZE;
+        memcpy(out, t, n);
+        out += n;
+        out_len -= n;
+    }
+
+    memset(block, 0, sizeof(block));
+    memset(t, 0, sizeof(t));
+}
+
+// RFC 5869 test case 1
+int8_t kdf_self_test(void) {
+    static const uint8_t salt[13] = {0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c};
+    static const uint8_t info[10] = {0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9};
+    static const uint8_t okm[42] = {
+        0x3c, 0xb2, 0x5f, 0x25, 0xfa, 0xac, 0xd5, 0x7a, 0x90, 0x43, 0x4f, 0x64, 0xd0, 0x36, 0x2f, 0x2a,
+        0x2d, 0x2d, 0x0a, 0x90, 0xcf, 0x1a, 0x5a, 0x4c, 0x5d, 0xb0, 0x2d, 0x56, 0xec, 0xc4, 0xc5, 0xbf,
+        0x34, 0x00, 0x72, 0x08, 0xd5, 0xb8, 0x87, 0x18, 0x58, 0x65};
+    uint8_t ikm[22], prk[SHA256_DIGEST_SIZE], out[42];
+
+    memset(ikm, 0x0b, sizeof(ikm));
+    hkdf_extract(salt, sizeof(salt), ikm, sizeof(ikm), prk);
+    hkdf_expand(prk, info, sizeof(info), out, sizeof(out));
+
+    return memcmp(out, okm, sizeof(okm)) == 0 ? 0 : -1;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define SHA256_BLOCK_SIZE 64
+#define SHA256_DIGEST_SIZE 32
+
+struct sha256_ctx {
+    uint32_t state[8];
+    uint64_t length;
+    uint8_t buffer[SHA256_BLOCK_SIZE];
+    size_t used;
+};
+
+void sha256_init(struct sha256_ctx* ctx);
+void sha256_update(struct sha256_ctx* ctx, const void* data, size_t len);
+void sha256_final(struct sha256_ctx* ctx, uint8_t* digest);
+
+void hmac_sha256(const uint8_t* key, size_t key_len, const void* data, size_t len, uint8_t* mac);
+void pbkdf2_sha256(const void* password, size_t password_len, const uint8_t* salt, size_t salt_len,
+                   uint32_t iterations, uint8_t* out, size_t out_len);
+void hkdf_extract(const uint8_t* salt, size_t salt_len, const void* ikm, size_t ikm_len, uint8_t* prk);
+void hkdf_expand(const uint8_t* prk, const void* info, size_t info_len, uint8_t* out, size_t out_len);
+int8_t kdf_self_test(void);
@@ -0,0 +1,105 @@
+#include "lz.h"
+
+#include <string.h>
+
+static uint32_t lz_hash(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Length bytes beyond the nibble
+static uint8_t put_length(uint8_t* out, size_t* op, size_t cap, size_t n) {
+    for (; n >= 255; n -= 255) {
+        if (*op >= cap) return 0;
+        out[(*op)++] = 255;
+    }
+    if (*op >= cap) return 0;
+    out[(*op)++] = n;
+    return 1;
+}
+
+// One sequence; match 0 marks the last one, which carries no offset
+static uint8_t put_sequence(uint8_t* out, size_t* op, size_t cap, const uint8_t* literals, size_t literal_len,
+                            size_t offset, size_t match) {
+    size_t extra = match ? match - LZ_MIN_MATCH : 0;
+
+    if (*op >= cap) return 0;
+    out[(*op)++] = (literal_len < 15 ? literal_len : 15) << 4 | (extra < 15 ? extra : 15);
+    if (literal_len >= 15 && !put_length(out, op, cap, literal_len - 15)) return 0;
+    if (literal_len > cap - *op) return 0;
+    memcpy(out + *op, literals, literal_len);
+    *op += literal_len;
+    if (match == 0) return 1;
+
+    if (cap - *op < 2) return 0;
+    out[(*op)++] = offset;
+    out[(*op)++] = offset >> 8;
+    return extra < 15 || put_length(out, op, cap, extra - 15);
+}
+
+// Greedy single-pass matcher. Returns the compressed size, 0 if it does not fit in cap, so a
+// caller passing cap below len gets 0 for anything not worth compressing
+size_t lz_compress(const uint8_t* in, size_t len, uint8_t* out, size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS] = {0}; // position + 1 of the last 4 bytes seen with each hash
+    size_t anchor = 0, pos = 0, op = 0;
+
+    while (pos + LZ_MIN_MATCH <= len) {
+        uint32_t h = lz_hash(in + pos);
+        size_t candidate = table[h];
+        table[h] = pos + 1;
+
+        if (candidate == 0 || pos - (candidate - 1) > LZ_MAX_OFFSET || memcmp(in + candidate - 1, in + pos, LZ_MIN_MATCH) != 0) {
+            // The longer nothing matches, the bigger the steps; incompressible data costs little
+            pos += 1 + ((pos - anchor) >> 6);
+            continue;
+        }
+
+        candidate--;
+        size_t match = LZ_MIN_MATCH;
+        while (pos + match < len && in[candidate + match] == in[pos + match]) match++;
+        if (!put_sequence(out, &op, cap, in + anchor, pos - anchor, pos - candidate, match)) return 0;
+        pos += match;
+        anchor = pos;
+    }
+    if (!put_sequence(out, &op, cap, in + anchor, len - anchor, 0, 0)) return 0;
+    return op;
+}
+
+static int8_t get_length(const uint8_t* in, size_t len, size_t* ip, size_t* n) {
+    uint8_t byte;
+    do {
+        if (*ip >= len) return -1;
+        byte = in[(*ip)++];
+        *n += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+// Returns the bytes written, -1 if the input is malformed or expands past cap
+int32_t lz_decompress(const uint8_t* in, size_t len, uint8_t* out, size_t cap) {
+    size_t ip = 0, op = 0;
+
+    while (ip < len) {
+        uint8_t token = in[ip++];
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && get_length(in, len, &ip, &literal_len) != 0) return -1;
+        if (literal_len > len - ip || literal_len > cap - op) return -1;
+        memcpy(out + op, in + ip, literal_len);
+        ip += literal_len;
+        op += literal_len;
+        if (ip == len) return op;
+
+        if (len - ip < 2) return -1;
+        size_t offset = in[ip] | (size_t)in[ip + 1] << 8;
+        size_t match = token & 15;
+        ip += 2;
+        if (match == 15 && get_length(in, len, &ip, &match) != 0) return -1;
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || match > cap - op) return -1;
+
+        // Byte by byte, a match may overlap the bytes it produces
+        for (size_t i = 0; i < match; i++, op++) out[op] = out[op - offset];
+    }
+    return -1;
+}
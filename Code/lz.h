@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// LZ4-style byte format: a token with the literal count and match length in its two nibbles
+// (15 means more length bytes follow, each 255 meaning yet another), the literals, then a
+// little-endian 16-bit offset back into the output. The last sequence has literals only
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+size_t lz_compress(const uint8_t* in, size_t len, uint8_t* out, size_t cap);
+int32_t lz_decompress(const uint8_t* in, size_t len, uint8_t* out, size_t cap);
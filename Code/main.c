@@ -2,6 +2,9 @@
 #include "ui.h"
 #include "network.h"
 #include "aes.h"
+#include "crypto.h"
+
+#include <termios.h>
 
 int main() {
     signal(SIGWINCH, handle_sigwinch);
@@ -15,9 +18,41 @@ int main() {
     scanf("%d", &server_port);
     //noecho();
 
-    sfs_init(sfs_name);
+    // The passphrase is typed without echo
+    char passphrase[128];
+    struct termios old_termios, new_termios;
+    printf("Enter volume key: ");
+    fflush(stdout);
+    tcgetattr(STDIN_FILENO, &old_termios);
+    new_termios = old_termios;
+    new_termios.c_lflag &= ~ECHO;
+    tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+    scanf("%127s", passphrase);
+    tcsetattr(STDIN_FILENO, TCSANOW, &old_termios);
+    printf("\n");
+
+    int8_t mounted = sfs_mount(sfs_name);
+    if (mounted == -1) {
+        printf("Error: '%s' has no valid superblock copy\n", sfs_name);
+        return 1;
+    } else if (mounted == 2) {
+        printf("Superblock was restored from a backup copy\n");
+    }
     read_sb(&sb);
+    if (aes_self_test(aes_select_impl()) != 0 || gcm_self_test() != 0 || kdf_self_test() != 0) {
+        printf("Error: AES self-test failed\n");
+        return 1;
+    }
+    int8_t unlocked = unlock_volume(passphrase);
+    memset(passphrase, 0, sizeof(passphrase));
+    if (unlocked == -1) {
+        printf("Error: wrong volume key\n");
+        return 1;
+    } else if (unlocked == 1) {
+        printf("Volume key was set\n");
+    }
     pthread_create(&server_tid, NULL, server_thread, NULL);
+    pthread_create(&reclaim_tid, NULL, reclaim_thread, NULL);
 
     // Инициализация интерфейса
     init_ui();
@@ -25,6 +60,8 @@ int main() {
     
     // Основной цикл
     while(1) {
+        // Incoming requests are taken off the ring whatever tab is shown, so it never fills up
+        collect_requests();
         draw_tabs();
         tabs[current_tab].draw_content();
         update_panels();
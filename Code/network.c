@@ -1,53 +1,1155 @@
+#define _GNU_SOURCE
 #include "network.h"
+#include "protocol.h"
 #include "sfs.h"
 
 #include <ncurses.h>
 
 int server_port;
-pthread_mutex_t requests_mutex;
-file_request pending_requests[MAX_PENDING_REQUESTS];
-int request_count;
 
+static struct transfer_conn conns[MAX_CONNECTIONS];
+static struct partial_transfer partials[MAX_PARTIAL_TRANSFERS];
+static struct request_slot request_ring[REQUEST_QUEUE_CAPACITY];
+static size_t ring_head; // next position a producer claims
+static size_t ring_tail; // next position the UI takes, only the UI thread writes it
+static file_request waiting[MAX_CONNECTIONS]; // UI thread: requests taken off the ring, one per connection at most
+static int waiting_count;
+static pthread_mutex_t decisions_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct transfer_decision decisions[REQUEST_QUEUE_CAPACITY];
+static int decision_count;
+static int epoll_fd = -1;
+static int wake_fd = -1;
+static pthread_mutex_t progress_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct transfer_progress progress[MAX_PROGRESS_ENTRIES];
+
+// Inode of the entry with this name in a directory, 0 if there is none
+static uint32_t dir_find_entry(uint32_t dir_inode_num, const char* name) {
+    struct inode dir;
+    char buffer[BLOCK_SIZE] = {0};
+    uint32_t found = 0;
+
+    sfs_lock();
+    read_inode(dir_inode_num, &dir);
+    if (dir.blocks[0] != 0 || dir_inode_num == ROOT_INODE) read_block(dir.blocks[0], buffer);
+    sfs_unlock();
+
+    struct dirent* dir_entries = (struct dirent*)buffer;
+    for (int i = 0; i < BLOCK_SIZE / sizeof(struct dirent) && dir_entries[i].inode_num != 0; i++) {
+        if (strcmp(dir_entries[i].name, name) == 0) found = dir_entries[i].inode_num;
+    }
+    return found;
+}
+
+static uint32_t root_find_entry(const char* name) {
+    return dir_find_entry(ROOT_INODE, name);
+}
+
+// Inode of the directory at path, -1 if there is no such directory
+static int32_t find_dir(const char* path) {
+    char copy[MAX_PATH_LEN];
+    struct inode node;
+
+    strncpy(copy, path, MAX_PATH_LEN - 1);
+    copy[MAX_PATH_LEN - 1] = '\0';
+    struct path_components path_c = parse_path(copy);
+    sfs_lock();
+    int32_t inode_num = find_dir_to_print(path_c);
+    if (inode_num >= 0) read_inode(inode_num, &node);
+    sfs_unlock();
+    free_path_component_struct(&path_c);
+    return inode_num >= 0 && node.type == DIR ? inode_num : -1;
+}
+
+static uint8_t root_has_entry(const char* name) {
+    return root_find_entry(name) != 0;
+}
+
+#if REQUEST_QUEUE_CAPACITY & (REQUEST_QUEUE_CAPACITY - 1)
+#error "REQUEST_QUEUE_CAPACITY must be a power of two"
+#endif
+
+// Bounded multi-producer, single-consumer ring after Vyukov. A producer claims a position with a
+// CAS on ring_head, and the slot's sequence tells both sides whether it is free or filled, so
+// neither ever waits on a lock. Returns 0 when the ring is full; pos_out, if given, gets the position
+static uint8_t publish_request(const struct request_event* event, size_t* pos_out) {
+    size_t pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    struct request_slot* slot;
+
+    while (1) {
+        slot = &request_ring[pos & (REQUEST_QUEUE_CAPACITY - 1)];
+        intptr_t diff = (intptr_t)__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+        if (diff < 0) return 0;
+        if (diff > 0) pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        else if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    }
+    slot->event = *event;
+    __atomic_store_n(&slot->withdrawn, ~event->request.conn_id, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    if (pos_out) *pos_out = pos;
+    return 1;
+}
+
+// Consumer side, UI thread only. A request withdrawn while it sat in the ring comes out as its
+// own withdrawal. The mark is read after ring_tail moves and before the slot is handed back
+static uint8_t take_request(struct request_event* event) {
+    size_t pos = ring_tail;
+    struct request_slot* slot = &request_ring[pos & (REQUEST_QUEUE_CAPACITY - 1)];
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1) return 0;
+
+    *event = slot->event;
+    __atomic_store_n(&ring_tail, pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&slot->withdrawn, __ATOMIC_SEQ_CST) == event->request.conn_id) event->withdrawn = 1;
+    __atomic_store_n(&slot->sequence, pos + REQUEST_QUEUE_CAPACITY, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// A request the UI has not taken yet is only marked in its slot, so the withdrawal takes no room
+// in the ring. The mark goes up before ring_tail is read and take_request reads it after moving
+// ring_tail, so at least one side sees the other. A withdrawal lost to a full ring only leaves
+// the request listed until its deadline; an answer to it finds the connection gone
+static void withdraw_request(const struct transfer_conn* conn) {
+    struct request_slot* slot = &request_ring[conn->ring_pos & (REQUEST_QUEUE_CAPACITY - 1)];
+    __atomic_store_n(&slot->withdrawn, conn->id, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring_tail, __ATOMIC_SEQ_CST) <= conn->ring_pos) return;
+
+    struct request_event event = { .withdrawn = 1, .request.conn_id = conn->id };
+    publish_request(&event, NULL);
+}
+
+static void forget_request(uint32_t conn_id) {
+    for (int i = 0; i < waiting_count; i++) {
+        if (waiting[i].conn_id != conn_id) continue;
+        waiting[i] = waiting[--waiting_count];
+        break;
+    }
+}
+
+// UI thread, once per main loop tick and whenever the list is needed: brings the waiting list up
+// to date with the ring and drops requests whose time is up
+void collect_requests(void) {
+    struct request_event event;
+    time_t now = time(NULL);
+
+    while (take_request(&event)) {
+        if (event.withdrawn) forget_request(event.request.conn_id);
+        else if (waiting_count < MAX_CONNECTIONS) waiting[waiting_count++] = event.request;
+    }
+    for (int i = 0; i < waiting_count;) {
+        if (now >= waiting[i].deadline) waiting[i] = waiting[--waiting_count];
+        else i++;
+    }
+}
+
+// Publishes how far a transfer has got. A resumed transfer keeps its line, found by transfer ID;
+// a new one takes the line that changed least recently. Done is final
+static void report_progress(const struct transfer_conn* conn, uint8_t state) {
+    uint32_t percent = 100;
+    if (conn->fm.flags & TRANSFER_DELTA) {
+        if (conn->fm.file_size > 0) percent = conn->received * 100 / conn->fm.file_size;
+    } else if (conn->chunk_total > 0) {
+        percent = (uint64_t)conn->chunks_landed * 100 / conn->chunk_total;
+    } else if (state != PROGRESS_DONE) {
+        percent = 0;
+    }
+
+    pthread_mutex_lock(&progress_mutex);
+    struct transfer_progress* slot = &progress[0];
+    for (int i = 0; i < MAX_PROGRESS_ENTRIES; i++) {
+        if (progress[i].transfer_id == conn->fm.transfer_id) {
+            slot = &progress[i];
+            break;
+        }
+        if (progress[i].updated < slot->updated) slot = &progress[i];
+    }
+    if (slot->transfer_id != conn->fm.transfer_id || slot->state != PROGRESS_DONE) {
+        *slot = (struct transfer_progress){
+            .transfer_id = conn->fm.transfer_id, .flags = conn->fm.flags, .state = state,
+            .percent = percent, .updated = time(NULL)
+        };
+        strcpy(slot->name, conn->fm.filename);
+        strcpy(slot->sender_ip, conn->sender_ip);
+    }
+    pthread_mutex_unlock(&progress_mutex);
+}
+
+// Primary connection of an extra stream, NULL once it is gone
+static struct transfer_conn* stream_primary(const struct transfer_conn* conn) {
+    struct transfer_conn* primary = &conns[conn->primary_id & 0xFFFF];
+    return primary->state == CONN_RECEIVING && primary->id == conn->primary_id ? primary : NULL;
+}
+
+static void close_conn(struct transfer_conn* conn) {
+    uint8_t state = conn->state;
+    if (state == CONN_PENDING) withdraw_request(conn);
+
+    // suspend_conn has taken the data already
+    if (state == CONN_RECEIVING) report_progress(conn, conn->data ? PROGRESS_FAILED : PROGRESS_INTERRUPTED);
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    free(conn->data);
+    free(conn->basis);
+    free(conn->entries);
+    conn->data = NULL;
+    conn->basis = NULL;
+    conn->entries = NULL;
+    conn->state = CONN_FREE;
+
+    // The streams of a parallel transfer fill one buffer: they go with the primary, and one that
+    // breaks off before its range is in leaves a hole no other stream fills
+    for (int i = 0; state == CONN_RECEIVING && conn->streams > 1 && i < MAX_CONNECTIONS; i++) {
+        if (conns[i].state == CONN_STREAM && conns[i].primary_id == conn->id) close_conn(&conns[i]);
+    }
+    struct transfer_conn* primary = state == CONN_STREAM ? stream_primary(conn) : NULL;
+    if (primary && conn->chunks_received < conn->stream_end) close_conn(primary);
+}
+
+// Chunks of a delta sync are not kept, they only make sense against the old copy; trees are
+// streamed in one go
+static uint8_t resumable(const struct transfer_conn* conn) {
+    return conn->fm.transfer_id != 0 && !(conn->fm.flags & (TRANSFER_DELTA | TRANSFER_TREE));
+}
+
+// Keeps the chunks of a transfer whose link broke and closes the connection; the oldest kept
+// transfer makes room if the table is full
+static void suspend_conn(struct transfer_conn* conn) {
+    struct partial_transfer* slot = &partials[0];
+    for (int i = 0; i < MAX_PARTIAL_TRANSFERS; i++) {
+        if (partials[i].transfer_id == 0) {
+            slot = &partials[i];
+            break;
+        }
+        if (partials[i].expires < slot->expires) slot = &partials[i];
+    }
+
+    free(slot->data);
+    *slot = (struct partial_transfer){
+        .transfer_id = conn->fm.transfer_id,
+        .fm = conn->fm,
+        .data = conn->data,
+        .streams = conn->streams,
+        .expires = time(NULL) + RESUME_RETENTION
+    };
+    memcpy(slot->stream_next, conn->stream_next, sizeof(slot->stream_next));
+    conn->data = NULL;
+    close_conn(conn);
+}
+
+// Takes back the chunks kept for this transfer, if they belong to the same file split the same way
+static struct partial_transfer* find_partial(const file_metadata* fm, uint32_t streams) {
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        // The sender may reconnect before the old connection is noticed to be dead
+        if (conns[i].state == CONN_RECEIVING && resumable(&conns[i]) && conns[i].fm.transfer_id == fm->transfer_id) {
+            suspend_conn(&conns[i]);
+        }
+    }
+
+    for (int i = 0; i < MAX_PARTIAL_TRANSFERS; i++) {
+        struct partial_transfer* p = &partials[i];
+        if (p->transfer_id == 0 || p->transfer_id != fm->transfer_id) continue;
+        if (strcmp(p->fm.filename, fm->filename) == 0 && p->fm.file_size == fm->file_size && p->streams == streams) return p;
+    }
+    return NULL;
+}
+
+static void drop_partial(struct partial_transfer* p) {
+    free(p->data);
+    *p = (struct partial_transfer){0};
+}
+
+// A link that broke or went quiet; a resumable transfer keeps its chunks, whichever stream it was
+static void break_conn(struct transfer_conn* conn) {
+    struct transfer_conn* primary = conn->state == CONN_STREAM ? stream_primary(conn) : conn;
+    uint8_t range_done = conn->state == CONN_STREAM && conn->chunks_received == conn->stream_end;
+
+    if (!range_done && primary && primary->state == CONN_RECEIVING && resumable(primary)) suspend_conn(primary);
+    else close_conn(conn);
+}
+
+// Splits the chunks into one range per stream
+static void lay_out_streams(struct transfer_conn* conn) {
+    for (uint32_t i = 0; i < conn->streams; i++) conn->stream_next[i] = stream_first_chunk(conn->chunk_total, conn->streams, i);
+}
+
+static void set_events(struct transfer_conn* conn, uint32_t events) {
+    struct epoll_event ev = { .events = events, .data.u32 = conn - conns };
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev);
+}
+
+static void accept_connections(int server_fd) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int client_fd = accept4(server_fd, (struct sockaddr*)&client_addr, &client_len, SOCK_NONBLOCK);
+        if (client_fd == -1) return;
+
+        struct transfer_conn* conn = NULL;
+        for (int i = 0; i < MAX_CONNECTIONS && conn == NULL; i++) {
+            if (conns[i].state == CONN_FREE) conn = &conns[i];
+        }
+        if (conn == NULL) {
+            close(client_fd);
+            continue;
+        }
+
+        uint16_t generation = conn->generation + 1;
+        *conn = (struct transfer_conn){
+            .fd = client_fd,
+            .state = CONN_HELLO,
+            .generation = generation,
+            .id = (uint32_t)(conn - conns) | (uint32_t)generation << 16,
+            .deadline = time(NULL) + HANDSHAKE_TIMEOUT
+        };
+        inet_ntop(AF_INET, &client_addr.sin_addr, conn->sender_ip, INET_ADDRSTRLEN);
+
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLRDHUP, .data.u32 = conn - conns };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
+            close(client_fd);
+            conn->state = CONN_FREE;
+        }
+    }
+}
+
+// Frees inodes and blocks up to what a store needs, reclaiming the trash like find_free_block
+// would; 0 if the volume cannot hold it, in which case nothing should be written
+static uint8_t make_room(uint32_t inodes, uint32_t blocks) {
+    struct superblock current;
+
+    do {
+        uint32_t free_inodes = 0, free_blocks = 0;
+        read_sb(&current);
+        for (int i = 0; i < TOTAL_INODE; i++) free_inodes += !current.bitmap_inode[i];
+        for (int i = 1; i < TOTAL_BLOCKS; i++) free_blocks += !current.bitmap_blocks[i];
+        if (free_inodes >= inodes && free_blocks >= blocks) return 1;
+    } while (trash_reclaim_oldest() == 1);
+    return 0;
+}
+
+// Takes back something a failed store created, for good rather than into the trash
+static void discard_entry(char* path, uint32_t inode_num, uint8_t type) {
+    if ((type == DIR ? delete_dir(path) : delete_file(path)) == 1) trash_purge(inode_num);
+}
+
+// Creates the file at path with the received bytes; .enc files are sealed with their own key.
+// Space is checked before anything is created, and a store that fails anyway leaves no file behind
+static int8_t store_file(char* path, char* data, uint64_t size) {
+    const char* name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    uint32_t block_count = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    sfs_lock();
+    // An empty directory gets its dirent block with the first entry
+    struct path_components path_c = parse_path(path);
+    uint32_t parent_inode_num = find_parent_dir(path_c);
+    free_path_component_struct(&path_c);
+    struct inode parent;
+    if (parent_inode_num != -1) read_inode(parent_inode_num, &parent);
+    uint32_t dirent_block = parent_inode_num != -1 && parent_inode_num != ROOT_INODE && parent.blocks[0] == 0;
+
+    int32_t file_inode_num = make_room(1, block_count + dirent_block) ? create_file(path) : -1;
+    if (file_inode_num < 0) {
+        sfs_unlock();
+        return -1;
+    }
+
+    struct inode file_inode;
+    read_inode(file_inode_num, &file_inode);
+    uint8_t encrypted = strlen(name) >= 4 && compare_last_n_chars(name, ".enc", 4);
+    if (encrypted) renew_file_nonce(&file_inode);
+
+    int8_t result = 0;
+    for (uint32_t j = 0; j < block_count; j++) {
+        char* block = data + j * BLOCK_SIZE;
+        uint32_t block_num = find_free_block();
+        if (block_num == -1) {
+            result = -1;
+            break;
+        }
+        set_block(block_num, 1);
+        if (encrypted) encrypt_data(block, BLOCK_SIZE, file_inode_num, &file_inode, j);
+        write_block(block_num, block);
+        file_inode.blocks[j] = block_num;
+    }
+    file_inode.size = size;
+    write_inode(file_inode_num, &file_inode);
+    if (result != 0) discard_entry(path, file_inode_num, FIL);
+    sfs_unlock();
+    return result;
+}
+
+// Writes a finished transfer into the root directory
+static int8_t store_received_file(struct transfer_conn* conn) {
+    char path[MAX_NAME_LEN + 1];
+    snprintf(path, sizeof(path), "/%s", conn->fm.filename);
+    uint32_t block_count = (conn->fm.file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    sfs_lock();
+    uint32_t old_inode_num = root_find_entry(conn->fm.filename);
+    if (old_inode_num != 0 && !(conn->fm.flags & TRANSFER_DELTA)) {
+        sfs_unlock();
+        return -1;
+    }
+    // A synced file replaces the old copy, which goes to the trash like any other delete. Room for the
+    // new copy is made first, and the old one comes back if the new one cannot be stored after all
+    if (old_inode_num != 0 && (!make_room(1, block_count) || delete_file(path) != 1)) {
+        sfs_unlock();
+        return -1;
+    }
+    int8_t result = store_file(path, conn->data, conn->fm.file_size);
+    if (result != 0 && old_inode_num != 0) undelete(old_inode_num);
+    sfs_unlock();
+    return result;
+}
+
+// Recreates a received tree as target/name; parents come first in the manifest.
+// A tree that cannot be stored whole is taken back out, so no part of it is left
+static int8_t store_tree(struct transfer_conn* conn) {
+    char path[2 * MAX_PATH_LEN + MAX_NAME_LEN + 3];
+    uint32_t dirs = 1;
+    int8_t result = 0;
+
+    for (uint32_t i = 0; i < conn->entry_count; i++) dirs += conn->entries[i].type == DIR;
+
+    sfs_lock();
+    snprintf(path, sizeof(path), "%s/%s", conn->target, conn->fm.filename);
+    // The estimate the manifest was checked against, plus a dirent block for target, taken again
+    // now that the volume may have filled up
+    if (find_dir(conn->target) < 0 || !make_room(conn->entry_count + 1, conn->chunk_total + dirs + 1) ||
+        create_dir(path) != 1) {
+        sfs_unlock();
+        return -1;
+    }
+    int32_t tree_inode_num = find_dir(path);
+
+    for (uint32_t i = 0; i < conn->entry_count && result == 0; i++) {
+        const struct tree_entry* entry = &conn->entries[i];
+        snprintf(path, sizeof(path), "%s/%s/%s", conn->target, conn->fm.filename, entry->path);
+        if (entry->type == DIR) {
+            if (create_dir(path) != 1) result = -1;
+        } else {
+            result = store_file(path, conn->data + (uint64_t)entry->first_chunk * BLOCK_SIZE, entry->size);
+        }
+    }
+    if (result != 0 && tree_inode_num >= 0) {
+        snprintf(path, sizeof(path), "%s/%s", conn->target, conn->fm.filename);
+        discard_entry(path, tree_inode_num, DIR);
+    }
+    sfs_unlock();
+    return result;
+}
+
+// One path component: no slash, not . or ..
+static uint8_t single_name(const char* name) {
+    return tree_path_valid(name) && strchr(name, '/') == NULL;
+}
+
+// Control frames are small; whatever the socket does not take now goes out on EPOLLOUT
+static void flush_out(struct transfer_conn* conn) {
+    while (conn->out_len > 0) {
+        ssize_t n = send(conn->fd, conn->out, conn->out_len, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        memmove(conn->out, conn->out + n, conn->out_len - n);
+        conn->out_len -= n;
+    }
+    uint32_t events = conn->state == CONN_PENDING ? EPOLLRDHUP : EPOLLIN | EPOLLRDHUP;
+    set_events(conn, conn->out_len > 0 ? events | EPOLLOUT : events);
+}
+
+static void queue_frame(struct transfer_conn* conn, uint8_t type, uint32_t seq, const void* payload, uint32_t length) {
+    if (conn->out_len + FRAME_HEADER_SIZE + length > sizeof(conn->out)) return;
+    conn->out_len += frame_build(conn->out + conn->out_len, type, seq, payload, length);
+    flush_out(conn);
+}
+
+// Sends a last frame and hangs up
+static void finish_conn(struct transfer_conn* conn, uint8_t type, uint32_t seq) {
+    queue_frame(conn, type, seq, NULL, 0);
+    close_conn(conn);
+}
+
+// Loads the receiver's copy of a file being synced; one that fails to decrypt is treated as missing
+static void load_basis(struct transfer_conn* conn) {
+    uint32_t inode_num = root_find_entry(conn->fm.filename);
+    struct inode node;
+    if (inode_num == 0 || (conn->basis = calloc(MAX_BLOCK_COUNT, BLOCK_SIZE)) == NULL) return;
+
+    sfs_lock();
+    read_inode(inode_num, &node);
+    sfs_unlock();
+
+    uint32_t block_count = 0;
+    while (block_count < MAX_BLOCK_COUNT && node.blocks[block_count] != 0) block_count++;
+    conn->basis_size = node.size < (uint64_t)block_count * BLOCK_SIZE ? node.size : (uint64_t)block_count * BLOCK_SIZE;
+
+    if (compare_last_n_chars(conn->fm.filename, ".enc", 4)) {
+        if (read_encrypted_file(inode_num, &node, conn->basis, block_count) != 0) conn->basis_size = 0;
+    } else {
+        sfs_lock();
+        for (uint32_t i = 0; i < block_count; i++) read_block(node.blocks[i], conn->basis + i * BLOCK_SIZE);
+        sfs_unlock();
+    }
+}
+
+// Payload: the first chunk still needed on this connection, the stream count, the flags granted
+static void queue_accept(struct transfer_conn* conn) {
+    uint8_t accept[ACCEPT_SIZE];
+
+    put32(accept, conn->chunks_received);
+    put32(accept + 4, conn->streams);
+    put32(accept + 8, conn->fm.flags);
+    queue_frame(conn, FRAME_ACCEPT, conn->window, accept, sizeof(accept));
+}
+
+static void start_receiving(struct transfer_conn* conn) {
+
+    conn->state = CONN_RECEIVING;
+    conn->window = conn->fm.window < TRANSFER_WINDOW ? conn->fm.window : TRANSFER_WINDOW;
+    if (conn->window == 0) conn->window = 1;
+    conn->deadline = time(NULL) + TRANSFER_IDLE_TIMEOUT;
+    conn->stream_end = stream_first_chunk(conn->chunk_total, conn->streams, 1);
+    queue_accept(conn);
+    report_progress(conn, PROGRESS_RECEIVING);
+
+    if (conn->fm.flags & TRANSFER_DELTA) {
+        struct block_signature sigs[MAX_BLOCK_COUNT];
+        uint8_t payload[4 + MAX_BLOCK_COUNT * DELTA_SIGNATURE_SIZE];
+
+        // Payload: length of the last block, then the signature of every block
+        load_basis(conn);
+        uint32_t count = conn->basis ? delta_signatures((uint8_t*)conn->basis, conn->basis_size, sigs, MAX_BLOCK_COUNT) : 0;
+        put32(payload, count ? sigs[count - 1].length : 0);
+        signature_encode(sigs, count, payload + 4);
+        queue_frame(conn, FRAME_SIGNATURE, count, payload, 4 + count * DELTA_SIGNATURE_SIZE);
+    }
+}
+
+// An extra connection of a parallel transfer; it takes over one range of the chunks
+static void handle_join(struct transfer_conn* conn, const struct frame_header* header, const uint8_t* payload) {
+    uint64_t transfer_id = get64(payload);
+    struct transfer_conn* primary = NULL;
+
+    for (int i = 0; i < MAX_CONNECTIONS && primary == NULL && transfer_id != 0; i++) {
+        struct transfer_conn* c = &conns[i];
+        if (c->state == CONN_RECEIVING && c->streams > 1 && c->fm.transfer_id == transfer_id &&
+            strcmp(c->sender_ip, conn->sender_ip) == 0) {
+            primary = c;
+        }
+    }
+    // A tree's chunks are only laid out once its manifest is complete
+    if (primary == NULL || header->seq == 0 || header->seq >= primary->streams || (primary->joined & 1u << header->seq) ||
+        (primary->entries && primary->entry_count < primary->fm.chunk_count)) {
+        finish_conn(conn, FRAME_REJECT, REJECT_DECLINED);
+        return;
+    }
+
+    primary->joined |= 1u << header->seq;
+    conn->state = CONN_STREAM;
+    conn->fm = primary->fm;
+    conn->streams = primary->streams;
+    conn->primary_id = primary->id;
+    conn->window = primary->window;
+    conn->stream_index = header->seq;
+    conn->chunks_received = conn->chunks_acked = primary->stream_next[header->seq];
+    conn->stream_end = stream_first_chunk(primary->chunk_total, primary->streams, header->seq + 1);
+    conn->deadline = time(NULL) + TRANSFER_IDLE_TIMEOUT;
+    queue_accept(conn);
+}
+
+static void handle_hello(struct transfer_conn* conn, const struct frame_header* header, const uint8_t* payload) {
+    if (header->type == FRAME_JOIN && header->version == PROTO_VERSION && header->length == JOIN_SIZE) {
+        handle_join(conn, header, payload);
+        return;
+    }
+    if (header->type != FRAME_HELLO || header->length != HELLO_SIZE) {
+        close_conn(conn);
+        return;
+    }
+    if (header->version != PROTO_VERSION) {
+        finish_conn(conn, FRAME_REJECT, REJECT_VERSION);
+        return;
+    }
+
+    hello_decode(payload, &conn->fm);
+    // ACCEPT grants back the flags; ones this end does not know are left out
+    conn->fm.flags &= TRANSFER_DELTA | TRANSFER_TREE | TRANSFER_COMPRESS | TRANSFER_CLEARTEXT;
+    uint64_t chunk = conn->fm.chunk_size;
+    uint8_t tree = (conn->fm.flags & TRANSFER_TREE) != 0;
+    // Files land in the root and trees in target under this name, never in a directory it points into
+    if (chunk != TRANSFER_CHUNK_SIZE || !single_name(conn->fm.filename) ||
+        (tree ? conn->fm.chunk_count == 0 || (conn->fm.flags & TRANSFER_DELTA)
+              : conn->fm.chunk_count != (conn->fm.file_size + chunk - 1) / chunk)) {
+        finish_conn(conn, FRAME_ERROR, ERROR_SIZE);
+        return;
+    }
+    if (tree ? conn->fm.chunk_count > MAX_TREE_ENTRIES || conn->fm.file_size > (uint64_t)TOTAL_BLOCKS * BLOCK_SIZE
+             : conn->fm.file_size > (uint64_t)MAX_BLOCK_COUNT * BLOCK_SIZE) {
+        finish_conn(conn, FRAME_REJECT, REJECT_TOO_LARGE);
+        return;
+    }
+    // Where a tree goes is only known once the user has picked the target directory
+    if (!tree && !(conn->fm.flags & TRANSFER_DELTA) && root_has_entry(conn->fm.filename)) {
+        finish_conn(conn, FRAME_REJECT, REJECT_EXISTS);
+        return;
+    }
+
+    // Every stream gets at least one chunk; delta frames only make sense in order
+    uint64_t min_chunks = (conn->fm.file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    conn->streams = conn->fm.streams < TRANSFER_STREAMS ? conn->fm.streams : TRANSFER_STREAMS;
+    if (conn->streams > min_chunks) conn->streams = min_chunks;
+    if (conn->streams == 0 || (conn->fm.flags & TRANSFER_DELTA)) conn->streams = 1;
+
+    // A transfer the user already accepted goes on where it broke off, without asking again
+    struct partial_transfer* partial = resumable(conn) ? find_partial(&conn->fm, conn->streams) : NULL;
+    if (partial) {
+        conn->data = partial->data;
+        conn->chunk_total = conn->fm.chunk_count;
+        memcpy(conn->stream_next, partial->stream_next, sizeof(conn->stream_next));
+        for (uint32_t i = 0; i < conn->streams; i++) {
+            conn->chunks_landed += conn->stream_next[i] - stream_first_chunk(conn->chunk_total, conn->streams, i);
+        }
+        conn->chunks_received = conn->chunks_acked = conn->stream_next[0];
+        partial->data = NULL;
+        drop_partial(partial);
+        start_receiving(conn);
+        return;
+    }
+
+    struct request_event event = {
+        .request = { .fm = conn->fm, .conn_id = conn->id, .deadline = time(NULL) + DECISION_TIMEOUT }
+    };
+    strcpy(event.request.sender_ip, conn->sender_ip);
+    if (!publish_request(&event, &conn->ring_pos)) {
+        finish_conn(conn, FRAME_REJECT, REJECT_BUSY);
+        return;
+    }
+    // Nothing is expected from the sender until it gets an answer, only a hang-up
+    conn->state = CONN_PENDING;
+    conn->deadline = time(NULL) + DECISION_TIMEOUT;
+    set_events(conn, EPOLLRDHUP);
+}
+
+// Copies the bytes a DATA or LITERAL frame carries to out, expanding them if they came compressed.
+// Returns how many there were, -1 if they do not decode or fit in cap
+static int32_t unpack_payload(const struct transfer_conn* conn, const struct frame_header* header, const uint8_t* payload,
+                              char* out, uint32_t cap) {
+    if (!(header->flags & FRAME_COMPRESSED)) {
+        if (header->length > cap) return -1;
+        memcpy(out, payload, header->length);
+        return header->length;
+    }
+    if (!(conn->fm.flags & TRANSFER_COMPRESS)) return -1;
+    return lz_decompress(payload, header->length, (uint8_t*)out, cap);
+}
+
+static void handle_delta(struct transfer_conn* conn, const struct frame_header* header, const uint8_t* payload) {
+    uint64_t left = conn->fm.file_size - conn->received;
+
+    if (header->type == FRAME_COPY) {
+        uint64_t offset = (uint64_t)header->seq * BLOCK_SIZE;
+        uint64_t length = offset < conn->basis_size ? conn->basis_size - offset : 0;
+        if (length > BLOCK_SIZE) length = BLOCK_SIZE;
+        if (length == 0 || length > left || header->length != 0) {
+            finish_conn(conn, FRAME_ERROR, ERROR_SEQUENCE);
+            return;
+        }
+        memcpy(conn->data + conn->received, conn->basis + offset, length);
+        conn->received += length;
+    } else if (header->type == FRAME_LITERAL) {
+        int32_t length = unpack_payload(conn, header, payload, conn->data + conn->received,
+                                        left < conn->fm.chunk_size ? left : conn->fm.chunk_size);
+        if (length < 0) {
+            finish_conn(conn, FRAME_ERROR, ERROR_SIZE);
+            return;
+        }
+        conn->received += length;
+    } else if (header->type == FRAME_END) {
+        if (left != 0 || header->length != 4 || crc32(conn->data, conn->fm.file_size) != get32(payload)) {
+            finish_conn(conn, FRAME_ERROR, ERROR_CHECKSUM);
+            return;
+        }
+        if (store_received_file(conn) != 0) {
+            finish_conn(conn, FRAME_ERROR, ERROR_STORE);
+            return;
+        }
+        report_progress(conn, PROGRESS_DONE);
+        finish_conn(conn, FRAME_DONE, conn->fm.chunk_count);
+        return;
+    } else {
+        finish_conn(conn, FRAME_ERROR, ERROR_SEQUENCE);
+        return;
+    }
+    conn->deadline = time(NULL) + TRANSFER_IDLE_TIMEOUT;
+    report_progress(conn, PROGRESS_RECEIVING);
+}
+
+// Bytes of chunk seq: files fill whole chunks, only the last chunk of each may be short
+static uint32_t chunk_length(const struct transfer_conn* conn, uint32_t seq) {
+    uint64_t size = conn->fm.file_size;
+    uint32_t first = 0;
+
+    for (uint32_t i = 0; conn->entries && i < conn->entry_count; i++) {
+        uint32_t chunks = (conn->entries[i].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (conn->entries[i].type != FIL || seq >= conn->entries[i].first_chunk + chunks) continue;
+        size = conn->entries[i].size;
+        first = conn->entries[i].first_chunk;
+        break;
+    }
+
+    uint64_t offset = (uint64_t)(seq - first) * BLOCK_SIZE;
+    uint64_t left = offset < size ? size - offset : 0;
+    return left < BLOCK_SIZE ? left : BLOCK_SIZE;
+}
+
+// A tree is checked as the CRC32 over the CRC32 of every file in manifest order
+static uint32_t received_checksum(const struct transfer_conn* conn) {
+    if (!conn->entries) return crc32(conn->data, conn->fm.file_size);
+
+    uint32_t crc = 0;
+    for (uint32_t i = 0; i < conn->entry_count; i++) {
+        if (conn->entries[i].type != FIL) continue;
+        uint8_t file_crc[4];
+        put32(file_crc, crc32(conn->data + (uint64_t)conn->entries[i].first_chunk * BLOCK_SIZE, conn->entries[i].size));
+        crc = crc32_update(crc, file_crc, sizeof(file_crc));
+    }
+    return crc;
+}
+
+// Collects the manifest of a tree and lays its files out in chunks; no data comes before it is complete
+static void handle_manifest(struct transfer_conn* conn, const struct frame_header* header, const uint8_t* payload) {
+    size_t used = 0;
+
+    if (header->type != FRAME_MANIFEST || header->seq > conn->fm.chunk_count - conn->entry_count) {
+        finish_conn(conn, FRAME_ERROR, ERROR_SEQUENCE);
+        return;
+    }
+    for (uint32_t i = 0; i < header->seq; i++) {
+        struct tree_entry* entry = &conn->entries[conn->entry_count];
+        size_t n = manifest_entry_decode(payload + used, header->length - used, entry);
+        if (n == 0 || !tree_path_valid(entry->path) || (entry->type == FIL && entry->size > MAX_BLOCK_COUNT * BLOCK_SIZE)) {
+            finish_conn(conn, FRAME_ERROR, ERROR_SIZE);
+            return;
+        }
+        entry->first_chunk = conn->chunk_total;
+        if (entry->type == FIL) conn->chunk_total += (entry->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        conn->received += entry->type == FIL ? entry->size : 0;
+        conn->entry_count++;
+        used += n;
+    }
+    conn->deadline = time(NULL) + TRANSFER_IDLE_TIMEOUT;
+    if (conn->entry_count < conn->fm.chunk_count) return;
+
+    // Every directory needs an inode and a dirent block, every file an inode and its blocks
+    struct superblock current;
+    uint32_t dirs = 1, free_inodes = 0, free_blocks = 0;
+    for (uint32_t i = 0; i < conn->entry_count; i++) dirs += conn->entries[i].type == DIR;
+    sfs_lock();
+    read_sb(&current);
+    sfs_unlock();
+    for (int i = 0; i < TOTAL_INODE; i++) free_inodes += !current.bitmap_inode[i];
+    for (int i = 1; i < TOTAL_BLOCKS; i++) free_blocks += !current.bitmap_blocks[i];
+
+    if (conn->received != conn->fm.file_size) {
+        finish_conn(conn, FRAME_ERROR, ERROR_SIZE);
+    } else if (conn->entry_count + 1 > free_inodes || conn->chunk_total + dirs > free_blocks) {
+        finish_conn(conn, FRAME_ERROR, ERROR_SPACE);
+    } else {
+        // Extra streams may only join once the chunks are laid out
+        lay_out_streams(conn);
+        conn->stream_end = stream_first_chunk(conn->chunk_total, conn->streams, 1);
+        queue_frame(conn, FRAME_ACK, 0, NULL, 0);
+    }
+}
+
+// Lands one chunk of conn's range in the transfer's buffer; owner is conn itself, or its primary
+static void receive_chunk(struct transfer_conn* conn, struct transfer_conn* owner, const struct frame_header* header,
+                          const uint8_t* payload) {
+    if (header->seq != conn->chunks_received || header->seq >= conn->stream_end) {
+        finish_conn(conn, FRAME_ERROR, ERROR_SEQUENCE);
+        return;
+    }
+    uint32_t length = chunk_length(owner, header->seq);
+    if (unpack_payload(owner, header, payload, owner->data + (uint64_t)header->seq * BLOCK_SIZE, length) != (int32_t)length) {
+        finish_conn(conn, FRAME_ERROR, ERROR_SIZE);
+        return;
+    }
+
+    conn->chunks_received++;
+    owner->stream_next[conn->stream_index] = conn->chunks_received;
+    owner->chunks_landed++;
+    conn->deadline = owner->deadline = time(NULL) + TRANSFER_IDLE_TIMEOUT;
+
+    // Acknowledge every half window, and the end of the range right away
+    if (conn->chunks_received - conn->chunks_acked >= (conn->window + 1) / 2 ||
+        conn->chunks_received == conn->stream_end) {
+        conn->chunks_acked = conn->chunks_received;
+        queue_frame(conn, FRAME_ACK, conn->chunks_acked, NULL, 0);
+        report_progress(owner, PROGRESS_RECEIVING);
+    }
+}
+
+static void handle_stream(struct transfer_conn* conn, const struct frame_header* header, const uint8_t* payload) {
+    struct transfer_conn* primary = stream_primary(conn);
+    if (primary == NULL) close_conn(conn);
+    else if (header->type == FRAME_DATA) receive_chunk(conn, primary, header, payload);
+    else finish_conn(conn, FRAME_ERROR, ERROR_SEQUENCE);
+}
+
+static void handle_data(struct transfer_conn* conn, const struct frame_header* header, const uint8_t* payload) {
+    if (conn->entries && conn->entry_count < conn->fm.chunk_count) {
+        handle_manifest(conn, header, payload);
+        return;
+    }
+
+    if (header->type == FRAME_DATA) {
+        receive_chunk(conn, conn, header, payload);
+    } else if (header->type == FRAME_END) {
+        if (conn->chunks_landed != conn->chunk_total || header->length != 4 || received_checksum(conn) != get32(payload)) {
+            finish_conn(conn, FRAME_ERROR, ERROR_CHECKSUM);
+            return;
+        }
+        int8_t stored = conn->entries ? store_tree(conn) : store_received_file(conn);
+        if (stored != 0) {
+            finish_conn(conn, FRAME_ERROR, ERROR_STORE);
+            return;
+        }
+        report_progress(conn, PROGRESS_DONE);
+        finish_conn(conn, FRAME_DONE, conn->fm.chunk_count);
+    } else {
+        finish_conn(conn, FRAME_ERROR, ERROR_SEQUENCE);
+    }
+}
+
+// One step of a connection's state machine; reads whatever the socket has without blocking
+// and handles every complete frame in the buffer
+static void handle_conn(struct transfer_conn* conn, uint32_t events) {
+    if (events & EPOLLOUT) flush_out(conn);
+
+    if (conn->state == CONN_PENDING) {
+        if (events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) close_conn(conn);
+        return;
+    }
+    if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) return;
+
+    while (conn->state == CONN_HELLO || conn->state == CONN_RECEIVING || conn->state == CONN_STREAM) {
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len, 0);
+        if (n == 0 || (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            break_conn(conn);
+            return;
+        }
+        if (n > 0) conn->in_len += n;
+
+        size_t used = 0;
+        struct frame_header header;
+        while (conn->in_len - used >= FRAME_HEADER_SIZE && conn->state != CONN_FREE) {
+            if (frame_parse(conn->in + used, &header) != FRAME_OK) {
+                close_conn(conn);
+                return;
+            }
+            if (conn->in_len - used < FRAME_HEADER_SIZE + header.length) break;
+
+            const uint8_t* payload = conn->in + used + FRAME_HEADER_SIZE;
+            used += FRAME_HEADER_SIZE + header.length;
+            if (!frame_payload_valid(&header, payload)) {
+                finish_conn(conn, FRAME_ERROR, ERROR_CHECKSUM);
+                return;
+            }
+
+            if (conn->state == CONN_HELLO) handle_hello(conn, &header, payload);
+            else if (conn->state == CONN_RECEIVING && (conn->fm.flags & TRANSFER_DELTA)) handle_delta(conn, &header, payload);
+            else if (conn->state == CONN_RECEIVING) handle_data(conn, &header, payload);
+            else if (conn->state == CONN_STREAM) handle_stream(conn, &header, payload);
+            else break;
+        }
+        if (conn->state == CONN_FREE) return;
+
+        memmove(conn->in, conn->in + used, conn->in_len - used);
+        conn->in_len -= used;
+        if (n == -1) return;
+    }
+}
+
+static void apply_decisions(void) {
+    struct transfer_decision local[REQUEST_QUEUE_CAPACITY];
+    uint64_t counter;
+
+    read(wake_fd, &counter, sizeof(counter));
+    pthread_mutex_lock(&decisions_mutex);
+    int count = decision_count;
+    memcpy(local, decisions, count * sizeof(struct transfer_decision));
+    decision_count = 0;
+    pthread_mutex_unlock(&decisions_mutex);
+
+    for (int i = 0; i < count; i++) {
+        struct transfer_conn* conn = &conns[local[i].conn_id & 0xFFFF];
+        if (conn->state != CONN_PENDING || conn->id != local[i].conn_id) continue;
+
+        if (!local[i].accept) {
+            finish_conn(conn, FRAME_REJECT, local[i].reason);
+            continue;
+        }
+
+        if (conn->fm.flags & TRANSFER_TREE) {
+            int32_t target = find_dir(local[i].target);
+            if (target < 0 || dir_find_entry(target, conn->fm.filename) != 0) {
+                finish_conn(conn, FRAME_REJECT, REJECT_EXISTS);
+                continue;
+            }
+            strcpy(conn->target, local[i].target);
+            conn->entries = calloc(conn->fm.chunk_count, sizeof(struct tree_entry));
+            conn->data = calloc(TOTAL_BLOCKS, BLOCK_SIZE);
+        } else {
+            conn->chunk_total = conn->fm.chunk_count;
+            conn->data = calloc(MAX_BLOCK_COUNT, BLOCK_SIZE);
+            lay_out_streams(conn);
+        }
+        if (conn->data == NULL || ((conn->fm.flags & TRANSFER_TREE) && conn->entries == NULL)) {
+            finish_conn(conn, FRAME_REJECT, REJECT_BUSY);
+            continue;
+        }
+
+        withdraw_request(conn);
+        start_receiving(conn);
+    }
+}
+
+static void expire_connections(time_t now) {
+    for (int i = 0; i < MAX_CONNECTIONS; i++) {
+        if (conns[i].state == CONN_FREE || conns[i].deadline > now) continue;
+        if (conns[i].state == CONN_PENDING) finish_conn(&conns[i], FRAME_REJECT, REJECT_DECLINED);
+        else if (conns[i].state == CONN_RECEIVING || conns[i].state == CONN_STREAM) break_conn(&conns[i]);
+        else close_conn(&conns[i]);
+    }
+
+    for (int i = 0; i < MAX_PARTIAL_TRANSFERS; i++) {
+        if (partials[i].transfer_id != 0 && partials[i].expires <= now) drop_partial(&partials[i]);
+    }
+}
+
+// Called from the UI thread; the event loop picks the answer up on its next wake-up.
+// target is only used by tree transfers
+void post_decision(uint32_t conn_id, uint8_t accept, uint32_t reason, const char* target) {
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&decisions_mutex);
+    if (decision_count < REQUEST_QUEUE_CAPACITY) {
+        decisions[decision_count] = (struct transfer_decision){ .conn_id = conn_id, .accept = accept, .reason = reason };
+        strncpy(decisions[decision_count].target, target ? target : "/", MAX_PATH_LEN - 1);
+        decision_count++;
+    }
+    pthread_mutex_unlock(&decisions_mutex);
+
+    write(wake_fd, &one, sizeof(one));
+}
+
+// A single thread drives every inbound connection with epoll, none of them can stall the others
 void* server_thread(void* arg) {
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int server_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int reuse = 1;
     struct sockaddr_in addr = {
         .sin_family = AF_INET,
         .sin_port = htons(server_port),
         .sin_addr.s_addr = INADDR_ANY
     };
 
+    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     if (bind(server_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("bind");
         return NULL;
     }
-    if (listen(server_fd, MAX_PENDING_REQUESTS) < 0) {
+    if (listen(server_fd, SOMAXCONN) < 0) {
         perror("listen");
         return NULL;
     }
 
-    while (1) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        int client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
+    for (size_t i = 0; i < REQUEST_QUEUE_CAPACITY; i++) __atomic_store_n(&request_ring[i].sequence, i, __ATOMIC_RELEASE);
+    epoll_fd = epoll_create1(0);
+    wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (epoll_fd == -1 || wake_fd == -1) {
+        perror("epoll");
+        return NULL;
+    }
 
-        file_metadata fm;
-        recv(client_fd, &fm, sizeof(file_metadata), 0);
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = LISTEN_TAG };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev);
+    ev.data.u32 = WAKE_TAG;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
 
-        pthread_mutex_lock(&requests_mutex);
-        if (request_count < MAX_PENDING_REQUESTS) {
-            pending_requests[request_count].fm = fm;
-            inet_ntop(AF_INET, &client_addr.sin_addr, pending_requests[request_count].sender_ip, INET_ADDRSTRLEN);
-            pending_requests[request_count].socket_fd = client_fd;
-            request_count++;
-        } else {
-            close(client_fd);
+    struct epoll_event events[EVENT_BATCH];
+    while (1) {
+        int n = epoll_wait(epoll_fd, events, EVENT_BATCH, EVENT_LOOP_TICK_MS);
+
+        for (int i = 0; i < n; i++) {
+            uint32_t tag = events[i].data.u32;
+            if (tag == LISTEN_TAG) accept_connections(server_fd);
+            else if (tag == WAKE_TAG) apply_decisions();
+            else if (conns[tag].state != CONN_FREE) handle_conn(&conns[tag], events[i].events);
         }
-        pthread_mutex_unlock(&requests_mutex);
+
+        expire_connections(time(NULL));
     }
     return NULL;
 }
 
-int8_t send_file(char* filepath, const char* ip, int port) {
+static int8_t reject_code(uint32_t reason) {
+    return reason == REJECT_EXISTS ? -7 : reason == REJECT_VERSION ? -8 : -5;
+}
+
+static int8_t error_code(const struct frame_header* header) {
+    return header->type == FRAME_ERROR && header->seq == ERROR_SPACE ? -10 : -9;
+}
+
+// One file of an outgoing transfer; plaintext has no data buffer and goes from the image blocks
+struct outgoing_file {
+    char* data;
+    uint64_t size;
+    uint32_t first_chunk;
+    uint32_t chunk_count;
+    uint16_t blocks[MAX_BLOCK_COUNT];
+    uint32_t chunk_crc[MAX_BLOCK_COUNT];
+    uint32_t file_crc;
+};
+
+// Everything one transfer sends: a single file, or the files of a tree in manifest order
+struct outgoing {
+    file_metadata fm;
+    struct outgoing_file* files;
+    uint32_t file_count;
+    struct tree_entry* entries;
+    uint32_t chunk_total;
+    uint32_t checksum; // carried by END
+};
+
+static uint8_t encrypted_name(const char* name) {
+    return strlen(name) >= 4 && compare_last_n_chars(name, ".enc", 4);
+}
+
+// File keys never leave the volume: .enc data is decrypted here and sealed again by the receiver.
+// The link is plain TCP, so that only happens when the caller allowed cleartext, -12 otherwise.
+// Plaintext stays in the image and is sent from there with sendfile, only checksummed in place;
+// in_memory loads it anyway. image is the volume mapped read-only
+static int8_t prepare_file(uint32_t inode_num, const struct inode* node, const char* name, uint8_t in_memory,
+                           uint8_t cleartext, const uint8_t* image, struct outgoing_file* out) {
+    uint32_t block_count = 0;
+    while (block_count < MAX_BLOCK_COUNT && node->blocks[block_count] != 0) block_count++;
+
+    out->size = node->size < (uint64_t)block_count * BLOCK_SIZE ? node->size : (uint64_t)block_count * BLOCK_SIZE;
+    out->chunk_count = (out->size + TRANSFER_CHUNK_SIZE - 1) / TRANSFER_CHUNK_SIZE;
+    out->file_crc = 0;
+    memcpy(out->blocks, node->blocks, sizeof(out->blocks));
+
+    if (encrypted_name(name)) {
+        if (!cleartext) return -12;
+        out->data = calloc(MAX_BLOCK_COUNT, BLOCK_SIZE);
+        if (out->data == NULL) return -1;
+        if (read_encrypted_file(inode_num, node, out->data, block_count) != 0) return -6;
+        out->file_crc = crc32(out->data, out->size);
+    } else if (in_memory) {
+        out->data = calloc(MAX_BLOCK_COUNT, BLOCK_SIZE);
+        if (out->data == NULL) return -1;
+        sfs_lock();
+        for (uint32_t i = 0; i < block_count; i++) read_block(out->blocks[i], out->data + i * BLOCK_SIZE);
+        sfs_unlock();
+        out->file_crc = crc32(out->data, out->size);
+    } else {
+        sfs_lock();
+        for (uint32_t i = 0; i < out->chunk_count; i++) {
+            uint64_t left = out->size - (uint64_t)i * BLOCK_SIZE;
+            uint32_t length = left < BLOCK_SIZE ? left : BLOCK_SIZE;
+            const uint8_t* block = image + BLOCK_OFFSET(out->blocks[i]);
+            out->chunk_crc[i] = crc32(block, length);
+            out->file_crc = crc32_update(out->file_crc, block, length);
+        }
+        sfs_unlock();
+    }
+    return 0;
+}
+
+static void free_outgoing(struct outgoing* out) {
+    for (uint32_t i = 0; i < out->file_count; i++) free(out->files[i].data);
+}
+
+// Compressed when that makes the payload smaller; what does not shrink goes as it is
+static int8_t send_payload(int sock, uint8_t type, uint32_t seq, const void* data, uint32_t length, uint8_t compress) {
+    uint8_t packed[TRANSFER_CHUNK_SIZE];
+    size_t packed_len = compress && length > 1 ? lz_compress(data, length, packed, length - 1) : 0;
+
+    if (packed_len > 0) return send_frame_flags(sock, type, FRAME_COMPRESSED, seq, packed, packed_len);
+    return send_frame(sock, type, seq, data, length);
+}
+
+// Sends only what the receiver's old copy lacks: COPY for blocks it already has, LITERAL for the rest
+static int8_t run_delta(int sock, const struct outgoing* out, uint8_t compress) {
+    uint8_t payload[MAX_FRAME_PAYLOAD];
+    struct frame_header header;
+    struct block_signature sigs[MAX_BLOCK_COUNT];
+    struct delta_op ops[2 * MAX_BLOCK_COUNT + 1];
+    const struct outgoing_file* file = &out->files[0];
+    const file_metadata* fm = &out->fm;
+
+    int8_t code = recv_frame(sock, &header, payload, TRANSFER_IDLE_TIMEOUT * 1000);
+    if (code != FRAME_OK || header.type != FRAME_SIGNATURE || header.seq > MAX_BLOCK_COUNT ||
+        header.length != 4 + header.seq * DELTA_SIGNATURE_SIZE) {
+        return -9;
+    }
+    uint32_t tail = get32(payload);
+    if (header.seq > 0 && (tail == 0 || tail > BLOCK_SIZE)) return -9;
+    signature_decode(payload + 4, header.seq, tail, sigs);
+
+    uint32_t op_count = delta_compute((uint8_t*)file->data, file->size, sigs, header.seq, ops, 2 * MAX_BLOCK_COUNT + 1);
+    for (uint32_t i = 0; i < op_count && code == FRAME_OK; i++) {
+        if (ops[i].type == DELTA_COPY) {
+            code = send_frame(sock, FRAME_COPY, ops[i].block, NULL, 0);
+            continue;
+        }
+        for (size_t done = 0; done < ops[i].length && code == FRAME_OK; done += fm->chunk_size) {
+            size_t length = ops[i].length - done < fm->chunk_size ? ops[i].length - done : fm->chunk_size;
+            code = send_payload(sock, FRAME_LITERAL, 0, file->data + ops[i].offset + done, length, compress);
+        }
+    }
+
+    uint8_t checksum[4];
+    put32(checksum, out->checksum);
+    if (code == FRAME_OK) code = send_frame(sock, FRAME_END, fm->chunk_count, checksum, sizeof(checksum));
+    if (code == FRAME_OK) code = recv_frame(sock, &header, payload, TRANSFER_IDLE_TIMEOUT * 1000);
+    return code == FRAME_OK && header.type == FRAME_DONE ? 1 : -9;
+}
+
+// Packs as many manifest entries into each frame as fit
+static int8_t send_manifest(int sock, const struct outgoing* out) {
+    uint8_t payload[MAX_FRAME_PAYLOAD];
+    size_t used = 0;
+    uint32_t in_frame = 0;
+
+    for (uint32_t i = 0; i <= out->fm.chunk_count; i++) {
+        if (in_frame > 0 && (i == out->fm.chunk_count || used + MANIFEST_ENTRY_MAX > sizeof(payload))) {
+            if (send_frame(sock, FRAME_MANIFEST, in_frame, payload, used) != FRAME_OK) return FRAME_CLOSED;
+            used = 0;
+            in_frame = 0;
+        }
+        if (i == out->fm.chunk_count) break;
+        used += manifest_entry_encode(&out->entries[i], payload + used);
+        in_frame++;
+    }
+    return FRAME_OK;
+}
+
+// A block rewritten after it was checksummed fails the receiver's check, never lands silently.
+// Compression needs the bytes in hand, so plaintext is then read from the image instead of sendfile
+static int8_t send_chunk(int sock, const struct outgoing* out, uint32_t seq, uint8_t compress) {
+    const struct outgoing_file* file = out->files;
+    while (seq >= file->first_chunk + file->chunk_count) file++;
+
+    uint32_t local = seq - file->first_chunk;
+    uint64_t offset = (uint64_t)local * TRANSFER_CHUNK_SIZE;
+    uint32_t length = file->size - offset < TRANSFER_CHUNK_SIZE ? file->size - offset : TRANSFER_CHUNK_SIZE;
+    if (file->data) return send_payload(sock, FRAME_DATA, seq, file->data + offset, length, compress);
+    if (!compress) return send_frame_file(sock, FRAME_DATA, seq, fd, BLOCK_OFFSET(file->blocks[local]), length, file->chunk_crc[local]);
+
+    char block[TRANSFER_CHUNK_SIZE];
+    if (pread(fd, block, length, BLOCK_OFFSET(file->blocks[local])) != length) return FRAME_CLOSED;
+    return send_payload(sock, FRAME_DATA, seq, block, length, compress);
+}
+
+static int connect_to(const char* ip, int port) {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     struct sockaddr_in receiver_addr = {
         .sin_family = AF_INET,
@@ -56,141 +1158,393 @@ int8_t send_file(char* filepath, const char* ip, int port) {
     };
 
     if (connect(sock, (struct sockaddr*)&receiver_addr, sizeof(receiver_addr)) < 0) {
+        close(sock);
         return -1;
     }
+    return sock;
+}
 
+// Sends chunks [next, end) with up to window of them in flight; the sender only stops when the
+// receiver falls that far behind. Returns 0 once all are acknowledged, a broken link sets *broken
+static int8_t send_range(int sock, const struct outgoing* out, uint32_t next, uint32_t end, uint32_t window, uint8_t compress,
+                         uint8_t* broken) {
+    uint8_t payload[MAX_FRAME_PAYLOAD];
+    struct frame_header header;
+    uint32_t acked = next;
+
+    while (acked < end) {
+        while (next < end && next - acked < window) {
+            if (send_chunk(sock, out, next, compress) != FRAME_OK) {
+                *broken = 1;
+                return -9;
+            }
+            next++;
+        }
+
+        if (recv_frame(sock, &header, payload, TRANSFER_IDLE_TIMEOUT * 1000) != FRAME_OK) {
+            *broken = 1;
+            return -9;
+        }
+        if (header.type != FRAME_ACK || header.seq > next || header.seq < acked) return error_code(&header);
+        acked = header.seq;
+    }
+    return 0;
+}
+
+// An extra connection of a parallel transfer, run on a thread of its own
+struct outgoing_stream {
+    pthread_t thread;
+    const struct outgoing* out;
+    const char* ip;
+    int port;
+    uint32_t index;
+    uint32_t streams;
+    uint32_t window;
+    uint8_t compress;
+    int8_t result;
+    uint8_t broken;
+};
+
+static void* run_stream(void* arg) {
+    struct outgoing_stream* stream = arg;
+    uint8_t payload[MAX_FRAME_PAYLOAD];
+    uint8_t id[JOIN_SIZE];
+    struct frame_header header;
+    uint32_t first = stream_first_chunk(stream->out->chunk_total, stream->streams, stream->index);
+    uint32_t end = stream_first_chunk(stream->out->chunk_total, stream->streams, stream->index + 1);
+
+    // Until the receiver has answered, a failed stream counts as a broken link
+    stream->result = -9;
+    stream->broken = 1;
+    int sock = connect_to(stream->ip, stream->port);
+    if (sock < 0) return NULL;
+
+    // A resumed transfer picks each range up where it stopped
+    put64(id, stream->out->fm.transfer_id);
+    if (send_frame(sock, FRAME_JOIN, stream->index, id, sizeof(id)) == FRAME_OK &&
+        recv_frame(sock, &header, payload, TRANSFER_IDLE_TIMEOUT * 1000) == FRAME_OK) {
+        stream->broken = 0;
+        if (header.type == FRAME_ACCEPT && header.length == ACCEPT_SIZE && get32(payload) >= first && get32(payload) <= end) {
+            stream->result = send_range(sock, stream->out, get32(payload), end, stream->window, stream->compress, &stream->broken);
+        }
+    }
+    close(sock);
+    return NULL;
+}
+
+// One connection's worth of a transfer. Once the receiver has accepted, *resumable is set and
+// a broken link leaves *retry set, the next connection starts from the chunk the receiver asks for.
+// A parallel transfer opens its extra streams to ip:port
+static int8_t run_transfer(int sock, const struct outgoing* out, const char* ip, int port, uint8_t* resumable, uint8_t* retry) {
+    uint8_t hello[HELLO_SIZE];
+    uint8_t payload[MAX_FRAME_PAYLOAD];
+    struct frame_header header;
+    const file_metadata* fm = &out->fm;
+
+    *retry = *resumable;
+    hello_encode(fm, hello);
+    if (send_frame(sock, FRAME_HELLO, 0, hello, HELLO_SIZE) != FRAME_OK) return -1;
+
+    int8_t code = recv_frame(sock, &header, payload, (DECISION_TIMEOUT + 2) * 1000);
+    if (code == FRAME_TIMEOUT) return -4;
+    if (code != FRAME_OK) return -1;
+    *retry = 0;
+    if (header.type == FRAME_REJECT) return reject_code(header.seq);
+    if (header.type != FRAME_ACCEPT || header.length != ACCEPT_SIZE || get32(payload) > out->chunk_total) return -9;
+
+    uint32_t window = header.seq > 0 ? header.seq : 1;
+    uint32_t next = get32(payload), streams = get32(payload + 4);
+    uint8_t compress = (fm->flags & get32(payload + 8) & TRANSFER_COMPRESS) != 0;
+    if (streams == 0 || streams > (fm->streams > 1 ? fm->streams : 1)) return -9;
+    if (fm->flags & TRANSFER_DELTA) return run_delta(sock, out, compress);
+    if (fm->flags & TRANSFER_TREE) {
+        // The receiver confirms the manifest before any data, or says why it cannot take the tree
+        if (send_manifest(sock, out) != FRAME_OK) return -9;
+        if (recv_frame(sock, &header, payload, TRANSFER_IDLE_TIMEOUT * 1000) != FRAME_OK) return -9;
+        if (header.type != FRAME_ACK || header.seq != 0) return error_code(&header);
+    }
+    *resumable = !(fm->flags & TRANSFER_TREE);
+
+    // This connection is stream 0, the others connect now and each sends its own range
+    struct outgoing_stream extra[TRANSFER_STREAMS];
+    uint32_t started = 0;
+    for (uint32_t i = 1; i < streams; i++) {
+        extra[started] = (struct outgoing_stream){
+            .out = out, .ip = ip, .port = port, .index = i, .streams = streams, .window = window, .compress = compress
+        };
+        if (pthread_create(&extra[started].thread, NULL, run_stream, &extra[started]) != 0) break;
+        started++;
+    }
+
+    uint8_t broken = 0;
+    int8_t result = send_range(sock, out, next, stream_first_chunk(out->chunk_total, streams, 1), window, compress, &broken);
+    for (uint32_t i = 0; i < started; i++) {
+        pthread_join(extra[i].thread, NULL);
+        if (result == 0) result = extra[i].result;
+        broken |= extra[i].broken;
+    }
+    if (result == 0 && started + 1 < streams) result = -1;
+    if (result != 0) {
+        *retry = broken && *resumable;
+        return result;
+    }
+
+    uint8_t checksum[4];
+    put32(checksum, out->checksum);
+    code = send_frame(sock, FRAME_END, fm->chunk_count, checksum, sizeof(checksum));
+    if (code == FRAME_OK) code = recv_frame(sock, &header, payload, TRANSFER_IDLE_TIMEOUT * 1000);
+    if (code != FRAME_OK) {
+        *retry = *resumable;
+        return -9;
+    }
+    return header.type == FRAME_DONE ? 1 : error_code(&header);
+}
+
+// Runs a prepared transfer; a dropped link costs only the chunks the receiver had not got yet
+static int8_t run_outgoing(const struct outgoing* out, const char* ip, int port) {
+    uint8_t resumable = 0, retry = 0;
+    int sock = connect_to(ip, port);
+    if (sock < 0) return -1;
+
+    int8_t result = run_transfer(sock, out, ip, port, &resumable, &retry);
+    close(sock);
+    for (int attempt = 0; result != 1 && retry && attempt < TRANSFER_RETRIES; attempt++) {
+        sleep(RETRY_DELAY);
+        sock = connect_to(ip, port);
+        if (sock < 0) continue;
+        result = run_transfer(sock, out, ip, port, &resumable, &retry);
+        close(sock);
+    }
+    return result;
+}
+
+static int8_t transfer_file(char* filepath, const char* ip, int port, uint32_t flags, uint32_t options) {
     struct path_components path_c = parse_path(filepath);
+    sfs_lock();
     uint32_t parent_inode = find_parent_dir(path_c);
     if (parent_inode == -1) {
-        close(sock);
+        sfs_unlock();
+        free_path_component_struct(&path_c);
         return -2;
     }
+    // An empty directory has no dirent block, and a directory is not sent as a file
     struct inode file_inode;
-    
+    uint32_t file_inode_num = path_c.count > 0 ? dir_find_entry(parent_inode, path_c.components[path_c.count - 1]) : 0;
+    if (file_inode_num != 0) read_inode(file_inode_num, &file_inode);
+    sfs_unlock();
+    if (file_inode_num == 0 || file_inode.type != FIL) {
+        free_path_component_struct(&path_c);
+        return -3;
+    }
+
+    struct outgoing_file file = {0};
+    struct outgoing out = {
+        .fm = {
+            .send_time = time(NULL),
+            .chunk_size = TRANSFER_CHUNK_SIZE,
+            .window = TRANSFER_WINDOW,
+            .flags = flags | (options & TRANSFER_COMPRESS)
+        },
+        .files = &file,
+        .file_count = 1
+    };
+    strncpy(out.fm.filename, path_c.components[path_c.count - 1], MAX_NAME_LEN - 1);
+    free_path_component_struct(&path_c);
+    while (out.fm.transfer_id == 0) random_bytes((uint8_t*)&out.fm.transfer_id, sizeof(out.fm.transfer_id));
+
+    uint8_t* image = mmap(NULL, SFS_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) return -1;
+    // Matching blocks at any byte offset needs the whole file in memory
+    int8_t result = prepare_file(file_inode_num, &file_inode, out.fm.filename, (flags & TRANSFER_DELTA) != 0,
+                                 (options & TRANSFER_CLEARTEXT) != 0, image, &file);
+    munmap(image, SFS_SIZE);
+    // The receiver is told, so it can warn before accepting
+    if (encrypted_name(out.fm.filename)) out.fm.flags |= TRANSFER_CLEARTEXT;
+
+    out.fm.file_size = file.size;
+    out.fm.chunk_count = out.chunk_total = file.chunk_count;
+    out.fm.streams = (flags & TRANSFER_DELTA) || file.chunk_count < PARALLEL_MIN_CHUNKS ? 1 : TRANSFER_STREAMS;
+    out.checksum = file.file_crc;
+    if (result == 0) result = run_outgoing(&out, ip, port);
+
+    free_outgoing(&out);
+    return result;
+}
+
+// options may hold TRANSFER_CLEARTEXT, which lets .enc files go over the wire decrypted, and
+// TRANSFER_COMPRESS. Without compression plaintext chunks go straight from the image with sendfile
+int8_t send_file(char* filepath, const char* ip, int port, uint32_t options) {
+    return transfer_file(filepath, ip, port, 0, options);
+}
+
+// Like send_file, but a receiver that already has the file gets only the changed parts
+int8_t sync_file(char* filepath, const char* ip, int port, uint32_t options) {
+    return transfer_file(filepath, ip, port, TRANSFER_DELTA, options);
+}
+
+// Lists a directory's subtree in pre-order, so parents always come before their contents
+static int8_t collect_tree(uint32_t dir_inode_num, const char* prefix, uint8_t cleartext, const uint8_t* image,
+                           struct outgoing* out) {
+    struct inode dir;
     char buffer[BLOCK_SIZE];
-    read_block(parent_inode, buffer);
+
+    sfs_lock();
+    read_inode(dir_inode_num, &dir);
+    if (dir.blocks[0] != 0 || dir_inode_num == ROOT_INODE) read_block(dir.blocks[0], buffer);
+    sfs_unlock();
+    if (dir.blocks[0] == 0 && dir_inode_num != ROOT_INODE) return 0;
+
     struct dirent* dir_entries = (struct dirent*)buffer;
-    
-    for (int i = 0; i < BLOCK_SIZE / sizeof(struct dirent); i++) {
-        if (dir_entries[i].inode_num == 0) {
-            close(sock);
-            return -3;
-        }
+    for (int i = 0; i < BLOCK_SIZE / sizeof(struct dirent) && dir_entries[i].inode_num != 0; i++) {
+        if (out->fm.chunk_count == MAX_TREE_ENTRIES) return -11;
 
-        if (strcmp(dir_entries[i].name, path_c.components[path_c.count-1]) == 0) {
-            read_inode(dir_entries[i].inode_num, &file_inode);
-            break;
+        struct tree_entry* entry = &out->entries[out->fm.chunk_count];
+        struct inode node;
+        int len = snprintf(entry->path, sizeof(entry->path), "%s%s", prefix, dir_entries[i].name);
+        if (len > MAX_PATH_LEN - MAX_NAME_LEN) return -11;
+
+        sfs_lock();
+        read_inode(dir_entries[i].inode_num, &node);
+        sfs_unlock();
+        out->fm.chunk_count++;
+
+        if (node.type == DIR) {
+            // len was checked above, so the path and its slash always fit
+            char sub_prefix[MAX_PATH_LEN + 2];
+            entry->type = DIR;
+            memcpy(sub_prefix, entry->path, len);
+            sub_prefix[len] = '/';
+            sub_prefix[len + 1] = '\0';
+            int8_t result = collect_tree(dir_entries[i].inode_num, sub_prefix, cleartext, image, out);
+            if (result != 0) return result;
+            continue;
         }
-    }
 
-    file_metadata fm = {
-        .send_time = time(NULL)
-    };
-    strncpy(fm.filename,  path_c.components[path_c.count - 1], MAX_NAME_LEN);
-    send(sock, &fm, sizeof(file_metadata), 0);
+        struct outgoing_file* file = &out->files[out->file_count++];
+        int8_t result = prepare_file(dir_entries[i].inode_num, &node, dir_entries[i].name, 0, cleartext, image, file);
+        if (result != 0) return result;
+        if (encrypted_name(dir_entries[i].name)) out->fm.flags |= TRANSFER_CLEARTEXT;
 
-    char response[2];
-    struct pollfd pfd = { .fd = sock, .events = POLLIN };
-    if (poll(&pfd, 1, 10000) == 0) {
-        close(sock);
-        return -4;
-    }
-    recv(sock, response, 1, 0);
-    
-    if (response[0] != 'y') {
-        close(sock);
-        return -5;
+        uint8_t file_crc[4];
+        entry->type = FIL;
+        entry->size = file->size;
+        file->first_chunk = out->chunk_total;
+        out->chunk_total += file->chunk_count;
+        out->fm.file_size += file->size;
+        put32(file_crc, file->file_crc);
+        out->checksum = crc32_update(out->checksum, file_crc, sizeof(file_crc));
     }
+    return 0;
+}
 
-    for (int i = 0; i < MAX_BLOCK_COUNT && file_inode.blocks[i] != 0; i++) {
-        char data[BLOCK_SIZE] = {0};
-        read_block(file_inode.blocks[i], data);
-        send(sock, data, BLOCK_SIZE, 0);
-    }
-    
-    close(sock);
+// Sends a whole directory subtree over one connection, with one accept decision on the other side.
+// options work as for send_file; a tree holding .enc files needs TRANSFER_CLEARTEXT
+int8_t send_tree(char* dirpath, const char* ip, int port, uint32_t options) {
+    int32_t dir_inode_num = find_dir(dirpath);
+    if (dir_inode_num < 0) return -2;
+
+    struct outgoing out = {
+        .fm = {
+            .send_time = time(NULL),
+            .chunk_size = TRANSFER_CHUNK_SIZE,
+            .window = TRANSFER_WINDOW,
+            .flags = TRANSFER_TREE | (options & TRANSFER_COMPRESS)
+        },
+        .files = calloc(MAX_TREE_ENTRIES, sizeof(struct outgoing_file)),
+        .entries = calloc(MAX_TREE_ENTRIES, sizeof(struct tree_entry))
+    };
+    // The tree arrives as a directory named like this one; the root has no name of its own
+    struct path_components path_c = parse_path(dirpath);
+    strncpy(out.fm.filename, path_c.count > 0 ? path_c.components[path_c.count - 1] : "root", MAX_NAME_LEN - 1);
     free_path_component_struct(&path_c);
-    return 1;
+    // Extra streams find the transfer by its ID
+    while (out.fm.transfer_id == 0) random_bytes((uint8_t*)&out.fm.transfer_id, sizeof(out.fm.transfer_id));
+
+    uint8_t* image = mmap(NULL, SFS_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    int8_t result = out.files && out.entries && image != MAP_FAILED ? 0 : -1;
+    if (result == 0) result = collect_tree(dir_inode_num, "", (options & TRANSFER_CLEARTEXT) != 0, image, &out);
+    if (image != MAP_FAILED) munmap(image, SFS_SIZE);
+
+    // Nothing to recreate without at least one entry
+    if (result == 0 && out.fm.chunk_count == 0) result = -3;
+    out.fm.streams = out.chunk_total < PARALLEL_MIN_CHUNKS ? 1 : TRANSFER_STREAMS;
+    if (result == 0) result = run_outgoing(&out, ip, port);
+
+    if (out.files) free_outgoing(&out);
+    free(out.files);
+    free(out.entries);
+    return result;
 }
 
-void check_incoming_requests(WINDOW* win, int* row) {
-    pthread_mutex_lock(&requests_mutex);
+// Lists the requests still waiting for an answer, oldest first, and returns how many there are.
+// Nothing here waits for the user; the answer comes later through answer_request
+int check_incoming_requests(WINDOW* win, int* row) {
+    time_t now = time(NULL);
 
-    time_t current_time = time(NULL);
-    
-    for (int i = 0; i < request_count; ) {
-        if (current_time - pending_requests[i].fm.send_time >= 10) {
-            close(pending_requests[i].socket_fd);
-            
-            for (int j = i; j < request_count - 1; j++) {
-                pending_requests[j] = pending_requests[j+1];
-            }
-            request_count--;
+    // The list is the UI thread's own, nothing to lock while drawing it
+    collect_requests();
+    for (int i = 0; i < waiting_count; i++) {
+        long left = (long)(waiting[i].deadline - now);
+        if (waiting[i].fm.flags & TRANSFER_TREE) {
+            mvwprintw(win, (*row)++, 2, "Directory: %s (%u entries, %llu bytes), From: %s, %lds left", waiting[i].fm.filename,
+                      waiting[i].fm.chunk_count, (unsigned long long)waiting[i].fm.file_size, waiting[i].sender_ip, left);
         } else {
-            i++;
+            uint8_t update = (waiting[i].fm.flags & TRANSFER_DELTA) && root_has_entry(waiting[i].fm.filename);
+            mvwprintw(win, (*row)++, 2, "%s: %s (%llu bytes), From: %s, %lds left", update ? "Update" : "File",
+                      waiting[i].fm.filename, (unsigned long long)waiting[i].fm.file_size, waiting[i].sender_ip, left);
         }
+        if (waiting[i].fm.flags & TRANSFER_CLEARTEXT) mvwprintw(win, (*row)++, 4, "! encrypted contents sent unencrypted");
     }
+    return waiting_count;
+}
 
-    for (int i = 0; i < request_count; i++) {
-        mvwprintw(win, *row, 2, "File: %s, From: %s", pending_requests[i].fm.filename, pending_requests[i].sender_ip);
-        (*row)++;
-        mvwprintw(win, *row, 2, "Accept? (y/n):");
-        char choice;
-        int flag = 0;
-        
-        nodelay(win, TRUE);
+// The request that has waited longest and can still be answered
+uint8_t oldest_request(file_request* out) {
+    collect_requests();
+    for (int i = 0; i < waiting_count; i++) {
+        if (i == 0 || waiting[i].deadline < out->deadline) *out = waiting[i];
+    }
+    return waiting_count > 0;
+}
 
-        while (time(NULL) - pending_requests[i].fm.send_time < 10) {
-            choice = wgetch(win);
-            if (choice == 'y' || choice == 'n') {
-                flag = 1;
-                break;
-            }
+// Whether the request can still be answered: it has neither timed out nor been withdrawn
+uint8_t request_pending(uint32_t conn_id) {
+    collect_requests();
+    for (int i = 0; i < waiting_count; i++) {
+        if (waiting[i].conn_id == conn_id) return 1;
+    }
+    return 0;
+}
 
-            napms(100);
-        }
-
-        nodelay(win, FALSE);
-
-        if (choice == 'y' && flag) {
-            int sock = pending_requests[i].socket_fd;
-            send(sock, "y", 1, 0);
-            
-            struct inode parent_inode;
-            char buffer[BLOCK_SIZE] = {0};
-            read_inode(0, &parent_inode); 
-            read_block(parent_inode.blocks[0], buffer);
-            struct dirent* dir_entries = (struct dirent*)buffer;
-        
-            for (int i = 0; i < BLOCK_SIZE / sizeof(struct dirent); i++) {
-                if (dir_entries[i].inode_num == 0) break;
-        
-                if (strcmp(dir_entries[i].name, pending_requests[i].fm.filename) == 0) {
-                    (*row)++;
-                    mvwprintw(win, *row, 2, "File with this name already exists");
-                    close(pending_requests[i].socket_fd);
-                    return;
-                }
-            }
+// Queues the user's answer for the event loop, which does the receiving. target is where a tree goes
+void answer_request(const file_request* request, uint8_t accept, const char* target) {
+    uint8_t replace = request->fm.flags & (TRANSFER_DELTA | TRANSFER_TREE);
 
-            uint32_t file_inode_num = create_file(pending_requests[i].fm.filename);
-            struct inode file_inode;
-            read_inode(file_inode_num, &file_inode);
-            
-            for (int j = 0; j < MAX_BLOCK_COUNT; j++) {
-                char data[BLOCK_SIZE];
-                if (recv(sock, data, BLOCK_SIZE, 0) == 0) break;
-                uint32_t block_num = find_free_block();
-                set_block(block_num, 1);
-                write_block(block_num, data);
-                file_inode.blocks[j] = block_num;
-            }
-            write_inode(file_inode_num, &file_inode);
-        } else {
-            send(pending_requests[i].socket_fd, "n", 1, 0);
-        }
-        close(pending_requests[i].socket_fd);
+    forget_request(request->conn_id);
+    if (accept && !replace && root_has_entry(request->fm.filename)) post_decision(request->conn_id, 0, REJECT_EXISTS, NULL);
+    else post_decision(request->conn_id, accept, REJECT_DECLINED, target);
+}
+
+void show_transfer_progress(WINDOW* win, int* row) {
+    struct transfer_progress entries[MAX_PROGRESS_ENTRIES];
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&progress_mutex);
+    memcpy(entries, progress, sizeof(entries));
+    pthread_mutex_unlock(&progress_mutex);
+
+    for (int i = 0; i < MAX_PROGRESS_ENTRIES; i++) {
+        struct transfer_progress* entry = &entries[i];
+        if (entry->updated == 0 || (entry->state != PROGRESS_RECEIVING && now - entry->updated > PROGRESS_LINGER)) continue;
+
+        char bar[21];
+        uint32_t filled = entry->percent / 5;
+        for (uint32_t j = 0; j < 20; j++) bar[j] = j < filled ? '#' : '.';
+        bar[20] = '\0';
+
+        const char* state = entry->state == PROGRESS_DONE ? "done" : entry->state == PROGRESS_FAILED ? "failed" :
+                            entry->state == PROGRESS_INTERRUPTED ? "interrupted" : "receiving";
+        mvwprintw(win, (*row)++, 2, "%-24.24s%s [%s] %3u%% %s, From: %s", entry->name, entry->flags & TRANSFER_TREE ? "/" : " ",
+                  bar, entry->percent, state, entry->sender_ip);
     }
-    request_count = 0;
-    pthread_mutex_unlock(&requests_mutex);
-}
\ No newline at end of file
+}
@@ -1,12 +1,19 @@
 #pragma once
 
 #include "sfs.h"
+#include "protocol.h"
+#include "delta.h"
+#include "lz.h"
 
 #include <pthread.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <poll.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <string.h>
 #include <unistd.h>
 #include <malloc.h>
@@ -14,26 +21,129 @@
 #include <ncurses.h>
 
 #define SERVER_PORT 8080
-#define MAX_PENDING_REQUESTS 5
+#define MAX_CONNECTIONS 512 // inbound connections the event loop serves at once
+#define HANDSHAKE_TIMEOUT 10
+#define DECISION_TIMEOUT 10
+#define TRANSFER_IDLE_TIMEOUT 30
+#define EVENT_LOOP_TICK_MS 500
+#define EVENT_BATCH 64
+#define CONN_OUT_BUFFER 512 // control frames and one block signature list
+#define MAX_PARTIAL_TRANSFERS 16
+#define RESUME_RETENTION 300 // seconds the chunks of a broken transfer wait for the sender to come back
+#define TRANSFER_RETRIES 5
+#define RETRY_DELAY 1
+#define PARALLEL_MIN_CHUNKS 8 // smaller transfers are not worth the extra connections
+#define MAX_PROGRESS_ENTRIES 8
+#define PROGRESS_LINGER 10 // seconds a transfer that is no longer receiving stays listed
+#ifndef REQUEST_QUEUE_CAPACITY
+#define REQUEST_QUEUE_CAPACITY (2 * MAX_CONNECTIONS) // a request and a withdrawal per connection, a power of two
+#endif
+#define LISTEN_TAG MAX_CONNECTIONS
+#define WAKE_TAG (MAX_CONNECTIONS + 1)
 
-extern int server_port;
+#define CONN_FREE 0
+#define CONN_HELLO 1
+#define CONN_PENDING 2
+#define CONN_RECEIVING 3
+#define CONN_STREAM 4 // extra connection of a parallel transfer, its chunks land in the primary's buffer
 
-typedef struct {
-    char filename[MAX_NAME_LEN];
-    time_t send_time;
-} file_metadata;
+#define PROGRESS_RECEIVING 1
+#define PROGRESS_DONE 2
+#define PROGRESS_FAILED 3
+#define PROGRESS_INTERRUPTED 4 // the chunks wait for the sender to come back
+
+extern int server_port;
 
 typedef struct {
     //char filename[32];
     file_metadata fm;
     char sender_ip[INET_ADDRSTRLEN];
-    int socket_fd;
+    uint32_t conn_id;
+    time_t deadline;
 } file_request;
 
-extern pthread_mutex_t requests_mutex;
-extern file_request pending_requests[MAX_PENDING_REQUESTS];
-extern int request_count;
+// Inbound connection; id carries the slot and a generation, so a late answer never reaches a reused slot
+struct transfer_conn {
+    int fd;
+    uint8_t state;
+    uint16_t generation;
+    uint32_t id;
+    time_t deadline;
+    char sender_ip[INET_ADDRSTRLEN];
+    file_metadata fm;
+    uint8_t in[FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD]; // partial frames wait here for the rest
+    size_t in_len;
+    uint8_t out[CONN_OUT_BUFFER];
+    size_t out_len;
+    char* data;
+    uint32_t window;
+    uint32_t chunks_received;
+    uint32_t chunks_acked;
+    char* basis;       // delta sync: the receiver's old copy of the file
+    uint64_t basis_size;
+    uint64_t received; // delta sync: bytes of the new file rebuilt so far; tree: bytes the manifest lists
+    struct tree_entry* entries; // tree transfer: the manifest, fm.chunk_count entries once complete
+    uint32_t entry_count;
+    uint32_t chunk_total;       // DATA frames the sender will send
+    char target[MAX_PATH_LEN];  // tree transfer: directory the tree is recreated in
+    uint32_t streams;       // connections the chunks are spread over
+    uint32_t stream_index;  // 0 for the connection that did the handshake
+    uint32_t stream_end;    // this connection's range of chunks ends here
+    uint32_t stream_next[TRANSFER_STREAMS]; // primary: next chunk due on each stream
+    uint32_t chunks_landed; // primary: chunks in over all streams
+    uint32_t joined;        // primary: bit per extra stream that has connected
+    uint32_t primary_id;    // extra stream: id of the primary
+    size_t ring_pos;        // where the request went in the ring, to tell whether the UI has taken it
+};
+
+// Chunks of an interrupted transfer, picked up again when a HELLO with the same transfer ID arrives
+struct partial_transfer {
+    uint64_t transfer_id; // 0 marks a free slot
+    file_metadata fm;
+    char* data;
+    uint32_t streams;
+    uint32_t stream_next[TRANSFER_STREAMS];
+    time_t expires;
+};
+
+// One inbound transfer as the Network tab shows it; the event loop writes, the UI takes copies
+struct transfer_progress {
+    uint64_t transfer_id; // 0 marks a free slot
+    char name[MAX_NAME_LEN];
+    char sender_ip[INET_ADDRSTRLEN];
+    uint32_t flags;
+    uint8_t state;
+    uint32_t percent;
+    time_t updated;
+};
+
+// What the event loop tells the UI: a new request, or that one's connection is gone
+struct request_event {
+    uint8_t withdrawn;
+    file_request request; // a withdrawal only sets conn_id
+};
+
+struct request_slot {
+    size_t sequence; // position while free, position + 1 once filled, position + capacity once taken
+    uint32_t withdrawn; // the request's conn_id once it was withdrawn before the UI took it
+    struct request_event event;
+};
+
+struct transfer_decision {
+    uint32_t conn_id;
+    uint8_t accept;
+    uint32_t reason; // REJECT_* sent back when not accepted
+    char target[MAX_PATH_LEN];
+};
 
 void* server_thread(void* arg);
-int8_t send_file(char* filepath, const char* ip, int port);
-void check_incoming_requests(WINDOW* win, int* row);
\ No newline at end of file
+int8_t sync_file(char* filepath, const char* ip, int port, uint32_t options);
+int8_t send_tree(char* dirpath, const char* ip, int port, uint32_t options);
+int8_t send_file(char* filepath, const char* ip, int port, uint32_t options);
+int check_incoming_requests(WINDOW* win, int* row);
+void collect_requests(void);
+uint8_t oldest_request(file_request* out);
+uint8_t request_pending(uint32_t conn_id);
+void answer_request(const file_request* request, uint8_t accept, const char* target);
+void show_transfer_progress(WINDOW* win, int* row);
+void post_decision(uint32_t conn_id, uint8_t accept, uint32_t reason, const char* target);
\ No newline at end of file
@@ -0,0 +1,117 @@
+#include "plain_cache.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static struct plain_cache_entry entries[PLAIN_CACHE_BLOCKS];
+static uint8_t* blocks = NULL; // mlocked, so plaintext never reaches swap
+static uint32_t clock_hand = 0;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+// Without locked memory the cache stays off and every read goes through the cipher
+static void plain_cache_init(void) {
+    size_t size = (size_t)PLAIN_CACHE_BLOCKS * PLAIN_CACHE_BLOCK_SIZE;
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) return;
+
+    if (mlock(memory, size) != 0) {
+        munmap(memory, size);
+        return;
+    }
+#ifdef MADV_DONTDUMP
+    madvise(memory, size, MADV_DONTDUMP);
+#endif
+
+    blocks = memory;
+}
+
+static void wipe(struct plain_cache_entry* entry) {
+    volatile uint8_t* p = blocks + (size_t)(entry - entries) * PLAIN_CACHE_BLOCK_SIZE;
+    for (size_t i = 0; i < PLAIN_CACHE_BLOCK_SIZE; i++) p[i] = 0;
+    memset(entry, 0, sizeof(*entry));
+}
+
+static struct plain_cache_entry* find(uint32_t inode_num, uint32_t block_index) {
+    for (int i = 0; i < PLAIN_CACHE_BLOCKS; i++) {
+        if (entries[i].used && entries[i].inode_num == inode_num && entries[i].block_index == block_index) {
+            return &entries[i];
+        }
+    }
+    return NULL;
+}
+
+uint8_t plain_cache_get(uint32_t inode_num, uint32_t block_index, uint32_t key_gen, const uint8_t* nonce, void* data) {
+    pthread_once(&cache_once, plain_cache_init);
+    if (blocks == NULL) return 0;
+
+    pthread_mutex_lock(&cache_mutex);
+
+    struct plain_cache_entry* entry = find(inode_num, block_index);
+    uint8_t hit = entry != NULL && entry->key_gen == key_gen &&
+                  memcmp(entry->nonce, nonce, PLAIN_CACHE_NONCE_SIZE) == 0;
+
+    if (hit) {
+        memcpy(data, blocks + (size_t)(entry - entries) * PLAIN_CACHE_BLOCK_SIZE, PLAIN_CACHE_BLOCK_SIZE);
+        entry->last_use = ++clock_hand;
+    } else if (entry != NULL) {
+        // A rewritten or rekeyed block is dead, drop it now rather than wait for eviction
+        wipe(entry);
+    }
+
+    pthread_mutex_unlock(&cache_mutex);
+    return hit;
+}
+
+void plain_cache_put(uint32_t inode_num, uint32_t block_index, uint32_t key_gen, const uint8_t* nonce, const void* data) {
+    pthread_once(&cache_once, plain_cache_init);
+    if (blocks == NULL) return;
+
+    pthread_mutex_lock(&cache_mutex);
+
+    struct plain_cache_entry* entry = find(inode_num, block_index);
+    if (entry == NULL) {
+        entry = &entries[0];
+        for (int i = 0; i < PLAIN_CACHE_BLOCKS; i++) {
+            if (!entries[i].used) {
+                entry = &entries[i];
+                break;
+            }
+            if (entries[i].last_use < entry->last_use) entry = &entries[i];
+        }
+        if (entry->used) wipe(entry);
+    }
+
+    entry->inode_num = inode_num;
+    entry->block_index = block_index;
+    entry->key_gen = key_gen;
+    memcpy(entry->nonce, nonce, PLAIN_CACHE_NONCE_SIZE);
+    entry->last_use = ++clock_hand;
+    entry->used = 1;
+    memcpy(blocks + (size_t)(entry - entries) * PLAIN_CACHE_BLOCK_SIZE, data, PLAIN_CACHE_BLOCK_SIZE);
+
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void plain_cache_invalidate(uint32_t inode_num) {
+    if (blocks == NULL) return;
+    pthread_mutex_lock(&cache_mutex);
+
+    for (int i = 0; i < PLAIN_CACHE_BLOCKS; i++) {
+        if (entries[i].used && entries[i].inode_num == inode_num) wipe(&entries[i]);
+    }
+
+    pthread_mutex_unlock(&cache_mutex);
+}
+
+void plain_cache_flush(void) {
+    if (blocks == NULL) return;
+    pthread_mutex_lock(&cache_mutex);
+
+    for (int i = 0; i < PLAIN_CACHE_BLOCKS; i++) {
+        if (entries[i].used) wipe(&entries[i]);
+    }
+
+    pthread_mutex_unlock(&cache_mutex);
+}
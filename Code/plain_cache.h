@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define PLAIN_CACHE_BLOCKS 64 // 256 KiB of locked memory
+#define PLAIN_CACHE_BLOCK_SIZE 4096
+#define PLAIN_CACHE_NONCE_SIZE 8
+
+// A decrypted block; nonce ties it to one version of the file, key_gen to one set of keys
+struct plain_cache_entry {
+    uint32_t inode_num;
+    uint32_t block_index;
+    uint32_t key_gen;
+    uint8_t nonce[PLAIN_CACHE_NONCE_SIZE];
+    uint32_t last_use;
+    uint8_t used;
+};
+
+uint8_t plain_cache_get(uint32_t inode_num, uint32_t block_index, uint32_t key_gen, const uint8_t* nonce, void* data);
+void plain_cache_put(uint32_t inode_num, uint32_t block_index, uint32_t key_gen, const uint8_t* nonce, const void* data);
+void plain_cache_invalidate(uint32_t inode_num);
+void plain_cache_flush(void);
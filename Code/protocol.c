@@ -0,0 +1,208 @@
+#include "protocol.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+
+void put32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+uint32_t get32(const uint8_t* p) {
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+void put64(uint8_t* p, uint64_t v) {
+    put32(p, v >> 32);
+    put32(p + 4, (uint32_t)v);
+}
+
+uint64_t get64(const uint8_t* p) {
+    return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+void frame_header_build(uint8_t* out, uint8_t type, uint16_t flags, uint32_t seq, uint32_t length, uint32_t checksum) {
+    put32(out, PROTO_MAGIC);
+    out[4] = PROTO_VERSION;
+    out[5] = type;
+    out[6] = flags >> 8;
+    out[7] = flags;
+    put32(out + 8, seq);
+    put32(out + 12, length);
+    put32(out + 16, checksum);
+}
+
+// Header and payload in one buffer, so a frame goes out with a single send
+size_t frame_build(uint8_t* out, uint8_t type, uint32_t seq, const void* payload, uint32_t length) {
+    frame_header_build(out, type, 0, seq, length, length ? crc32(payload, length) : 0);
+    if (length) memcpy(out + FRAME_HEADER_SIZE, payload, length);
+    return FRAME_HEADER_SIZE + length;
+}
+
+int8_t frame_parse(const uint8_t* in, struct frame_header* header) {
+    header->magic = get32(in);
+    header->version = in[4];
+    header->type = in[5];
+    header->flags = (uint16_t)(in[6] << 8 | in[7]);
+    header->seq = get32(in + 8);
+    header->length = get32(in + 12);
+    header->checksum = get32(in + 16);
+
+    if (header->magic != PROTO_MAGIC || header->length > MAX_FRAME_PAYLOAD) return FRAME_BAD;
+    return FRAME_OK;
+}
+
+int8_t frame_payload_valid(const struct frame_header* header, const uint8_t* payload) {
+    return header->length == 0 ? header->checksum == 0 : crc32(payload, header->length) == header->checksum;
+}
+
+void hello_encode(const file_metadata* fm, uint8_t* out) {
+    memcpy(out, fm->filename, MAX_NAME_LEN);
+    put64(out + MAX_NAME_LEN, (uint64_t)fm->send_time);
+    put64(out + MAX_NAME_LEN + 8, fm->file_size);
+    put32(out + MAX_NAME_LEN + 16, fm->chunk_count);
+    put32(out + MAX_NAME_LEN + 20, fm->chunk_size);
+    put32(out + MAX_NAME_LEN + 24, fm->window);
+    put64(out + MAX_NAME_LEN + 28, fm->transfer_id);
+    put32(out + MAX_NAME_LEN + 36, fm->flags);
+    put32(out + MAX_NAME_LEN + 40, fm->streams);
+}
+
+void hello_decode(const uint8_t* in, file_metadata* fm) {
+    memcpy(fm->filename, in, MAX_NAME_LEN);
+    fm->filename[MAX_NAME_LEN - 1] = '\0';
+    fm->send_time = (time_t)get64(in + MAX_NAME_LEN);
+    fm->file_size = get64(in + MAX_NAME_LEN + 8);
+    fm->chunk_count = get32(in + MAX_NAME_LEN + 16);
+    fm->chunk_size = get32(in + MAX_NAME_LEN + 20);
+    fm->window = get32(in + MAX_NAME_LEN + 24);
+    fm->transfer_id = get64(in + MAX_NAME_LEN + 28);
+    fm->flags = get32(in + MAX_NAME_LEN + 36);
+    fm->streams = get32(in + MAX_NAME_LEN + 40);
+}
+
+// Entry on the wire: type, big-endian size, path length, path without the terminator
+size_t manifest_entry_encode(const struct tree_entry* entry, uint8_t* out) {
+    size_t len = strlen(entry->path);
+
+    out[0] = entry->type;
+    put32(out + 1, entry->size);
+    out[5] = len;
+    memcpy(out + 6, entry->path, len);
+    return 6 + len;
+}
+
+// Returns the bytes used, 0 if the entry is cut short or malformed
+size_t manifest_entry_decode(const uint8_t* in, size_t len, struct tree_entry* entry) {
+    if (len < 6 || len < 6 + (size_t)in[5] || in[5] == 0) return 0;
+
+    entry->type = in[0];
+    entry->size = get32(in + 1);
+    memcpy(entry->path, in + 6, in[5]);
+    entry->path[in[5]] = '\0';
+    if (entry->type != DIR && entry->type != FIL) return 0;
+    return 6 + in[5];
+}
+
+// Relative, no empty, "." or ".." components, and every name fits a dirent
+uint8_t tree_path_valid(const char* path) {
+    const char* start = path;
+
+    if (*path == '\0' || *path == '/') return 0;
+    while (1) {
+        const char* end = strchr(start, '/');
+        size_t len = end ? (size_t)(end - start) : strlen(start);
+        if (len == 0 || len >= MAX_NAME_LEN) return 0;
+        if ((len == 1 && start[0] == '.') || (len == 2 && start[0] == '.' && start[1] == '.')) return 0;
+        if (!end) return 1;
+        start = end + 1;
+    }
+}
+
+// Streams take consecutive, near-equal ranges of chunks; stream == streams gives the end of the last one
+uint32_t stream_first_chunk(uint32_t chunk_total, uint32_t streams, uint32_t stream) {
+    return (uint64_t)chunk_total * stream / streams;
+}
+
+// send may take only part of the buffer, keep going until all of it is out
+int8_t send_all(int sock, const void* buffer, size_t len) {
+    const uint8_t* p = buffer;
+    while (len > 0) {
+        ssize_t n = send(sock, p, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return FRAME_CLOSED;
+        p += n;
+        len -= n;
+    }
+    return FRAME_OK;
+}
+
+int8_t send_frame(int sock, uint8_t type, uint32_t seq, const void* payload, uint32_t length) {
+    return send_frame_flags(sock, type, 0, seq, payload, length);
+}
+
+int8_t send_frame_flags(int sock, uint8_t type, uint16_t flags, uint32_t seq, const void* payload, uint32_t length) {
+    uint8_t frame[FRAME_HEADER_SIZE + MAX_FRAME_PAYLOAD];
+    frame_header_build(frame, type, flags, seq, length, length ? crc32(payload, length) : 0);
+    if (length) memcpy(frame + FRAME_HEADER_SIZE, payload, length);
+    return send_all(sock, frame, FRAME_HEADER_SIZE + length);
+}
+
+// The payload goes from file_fd to the socket inside the kernel; the caller supplies its CRC
+int8_t send_frame_file(int sock, uint8_t type, uint32_t seq, int file_fd, off_t offset, uint32_t length, uint32_t checksum) {
+    uint8_t header[FRAME_HEADER_SIZE];
+    frame_header_build(header, type, 0, seq, length, checksum);
+
+    // MSG_MORE keeps the header from leaving as a segment of its own
+    const uint8_t* p = header;
+    size_t left = FRAME_HEADER_SIZE;
+    while (left > 0) {
+        ssize_t n = send(sock, p, left, MSG_NOSIGNAL | MSG_MORE);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return FRAME_CLOSED;
+        p += n;
+        left -= n;
+    }
+
+    while (length > 0) {
+        ssize_t n = sendfile(sock, file_fd, &offset, length);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return FRAME_CLOSED;
+        length -= n;
+    }
+    return FRAME_OK;
+}
+
+static int8_t recv_exact(int sock, uint8_t* buffer, size_t len, int timeout_ms) {
+    while (len > 0) {
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+        int ready = poll(&pfd, 1, timeout_ms);
+        if (ready == 0) return FRAME_TIMEOUT;
+        if (ready == -1) {
+            if (errno == EINTR) continue;
+            return FRAME_CLOSED;
+        }
+
+        ssize_t n = recv(sock, buffer, len, 0);
+        if (n == -1 && (errno == EINTR || errno == EAGAIN)) continue;
+        if (n <= 0) return FRAME_CLOSED;
+        buffer += n;
+        len -= n;
+    }
+    return FRAME_OK;
+}
+
+// Blocking receive of one whole frame; short reads are retried, payload must hold MAX_FRAME_PAYLOAD
+int8_t recv_frame(int sock, struct frame_header* header, uint8_t* payload, int timeout_ms) {
+    uint8_t raw[FRAME_HEADER_SIZE];
+
+    int8_t code = recv_exact(sock, raw, FRAME_HEADER_SIZE, timeout_ms);
+    if (code != FRAME_OK) return code;
+    if (frame_parse(raw, header) != FRAME_OK) return FRAME_BAD;
+
+    code = recv_exact(sock, payload, header->length, timeout_ms);
+    if (code != FRAME_OK) return code;
+    return frame_payload_valid(header, payload) ? FRAME_OK : FRAME_BAD;
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "sfs.h"
+
+#include <stdint.h>
+#include <time.h>
+
+#define PROTO_MAGIC 0x53465354 // "SFST"
+// 2: HELLO carries a transfer ID, ACCEPT the chunk to resume from
+// 3: HELLO carries transfer flags, delta sync frames
+// 4: directory tree transfers
+// 5: parallel streams, ACCEPT carries the stream count
+// 6: compressed payloads, ACCEPT carries the granted transfer flags
+#define PROTO_VERSION 6
+
+#define FRAME_HEADER_SIZE 20
+#define MAX_FRAME_PAYLOAD (BLOCK_SIZE + 64)
+#define TRANSFER_CHUNK_SIZE BLOCK_SIZE
+#define TRANSFER_WINDOW 16 // chunks the sender may have in flight before it waits for an ACK
+#define TRANSFER_STREAMS 4 // connections one transfer may spread its chunks over
+
+#define FRAME_HELLO 1  // sender: file name, size, chunk count
+#define FRAME_ACCEPT 2 // receiver: agreed window, payload is the first chunk it still needs, the stream count and the granted flags
+#define FRAME_REJECT 3 // receiver: reason in seq
+#define FRAME_DATA 4   // sender: chunk number seq
+#define FRAME_ACK 5    // receiver: chunks before seq have landed; ACK 0 also confirms a tree's manifest
+#define FRAME_END 6    // sender: payload is the CRC32 of the whole file
+#define FRAME_DONE 7   // receiver: file stored
+#define FRAME_ERROR 8  // either side: reason in seq, the connection is closed after it
+#define FRAME_SIGNATURE 9 // receiver, delta sync: seq block signatures of the file it already has
+#define FRAME_COPY 10     // sender, delta sync: append block seq of the receiver's old file
+#define FRAME_LITERAL 11  // sender, delta sync: append the payload
+#define FRAME_MANIFEST 12 // sender, tree transfer: seq more entries of the manifest
+#define FRAME_JOIN 13     // sender: extra connection carrying stream seq of the transfer whose ID is the payload
+
+#define TRANSFER_DELTA 0x1 // only send what the receiver's copy of the file is missing
+#define TRANSFER_TREE 0x2  // a directory: file_size is the total of all files, chunk_count the manifest entries
+#define TRANSFER_COMPRESS 0x4 // DATA and LITERAL payloads may come LZ-compressed
+#define TRANSFER_CLEARTEXT 0x8 // carries decrypted .enc contents; the link itself is not encrypted
+
+#define FRAME_COMPRESSED 0x1 // header flag: the payload expands to the chunk's bytes
+
+#define MAX_TREE_ENTRIES TOTAL_INODE
+#define MANIFEST_ENTRY_MAX (1 + 4 + 1 + MAX_PATH_LEN)
+
+#define REJECT_DECLINED 1
+#define REJECT_VERSION 2
+#define REJECT_BUSY 3
+#define REJECT_EXISTS 4
+#define REJECT_TOO_LARGE 5
+
+#define ERROR_CHECKSUM 1
+#define ERROR_SEQUENCE 2
+#define ERROR_SIZE 3
+#define ERROR_STORE 4
+#define ERROR_SPACE 5
+
+#define FRAME_OK 0
+#define FRAME_CLOSED -1
+#define FRAME_TIMEOUT -2
+#define FRAME_BAD -3
+
+struct frame_header {
+    uint32_t magic;
+    uint8_t version;
+    uint8_t type;
+    uint16_t flags;
+    uint32_t seq;
+    uint32_t length;   // payload bytes that follow the header
+    uint32_t checksum; // CRC32 of the payload
+};
+
+// HELLO payload, decoded; on the wire every field is big-endian and the name is fixed-size
+typedef struct {
+    char filename[MAX_NAME_LEN];
+    time_t send_time;
+    uint64_t file_size;
+    uint32_t chunk_count;
+    uint32_t chunk_size;
+    uint32_t window;
+    uint64_t transfer_id; // random, kept by the sender across reconnects of one transfer
+    uint32_t flags;
+    uint32_t streams; // connections the sender would like to use, the receiver may grant fewer
+} file_metadata;
+
+#define HELLO_SIZE (MAX_NAME_LEN + 8 + 8 + 4 + 4 + 4 + 8 + 4 + 4)
+#define ACCEPT_SIZE 12
+#define JOIN_SIZE 8
+
+// One file or directory of a tree transfer. The path is relative to the tree's top directory,
+// and parents always come before their contents. Files fill whole chunks, starting at first_chunk
+struct tree_entry {
+    uint8_t type; // DIR or FIL
+    uint32_t size;
+    uint32_t first_chunk;
+    char path[MAX_PATH_LEN + 1];
+};
+
+void put32(uint8_t* p, uint32_t v);
+uint32_t get32(const uint8_t* p);
+void put64(uint8_t* p, uint64_t v);
+uint64_t get64(const uint8_t* p);
+
+void frame_header_build(uint8_t* out, uint8_t type, uint16_t flags, uint32_t seq, uint32_t length, uint32_t checksum);
+size_t frame_build(uint8_t* out, uint8_t type, uint32_t seq, const void* payload, uint32_t length);
+int8_t frame_parse(const uint8_t* in, struct frame_header* header);
+int8_t frame_payload_valid(const struct frame_header* header, const uint8_t* payload);
+void hello_encode(const file_metadata* fm, uint8_t* out);
+void hello_decode(const uint8_t* in, file_metadata* fm);
+size_t manifest_entry_encode(const struct tree_entry* entry, uint8_t* out);
+size_t manifest_entry_decode(const uint8_t* in, size_t len, struct tree_entry* entry);
+uint8_t tree_path_valid(const char* path);
+uint32_t stream_first_chunk(uint32_t chunk_total, uint32_t streams, uint32_t stream);
+
+int8_t send_all(int sock, const void* buffer, size_t len);
+int8_t send_frame(int sock, uint8_t type, uint32_t seq, const void* payload, uint32_t length);
+int8_t send_frame_flags(int sock, uint8_t type, uint16_t flags, uint32_t seq, const void* payload, uint32_t length);
+int8_t send_frame_file(int sock, uint8_t type, uint32_t seq, int file_fd, off_t offset, uint32_t length, uint32_t checksum);
+int8_t recv_frame(int sock, struct frame_header* header, uint8_t* payload, int timeout_ms);
@@ -0,0 +1,421 @@
+#include "recovery.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <unistd.h>
+
+struct carved_file {
+    uint16_t blocks[MAX_BLOCK_COUNT];
+    uint8_t block_count;
+    uint8_t type;
+    uint32_t size;
+};
+
+static uint8_t is_zero(const uint8_t* data, size_t size) {
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(uint64_t));
+        if (word != 0) return 0;
+    }
+    for (; i < size; i++) {
+        if (data[i] != 0) return 0;
+    }
+    return 1;
+}
+
+static uint8_t valid_name(const char* name) {
+    size_t len = strnlen(name, MAX_NAME_LEN);
+    if (len == 0 || len == MAX_NAME_LEN) return 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if ((uint8_t)name[i] < 0x20 || name[i] == '/') return 0;
+    }
+    return 1;
+}
+
+static uint16_t used_bytes(const uint8_t* data) {
+    uint16_t len = BLOCK_SIZE;
+    while (len > 0 && data[len - 1] == 0) len--;
+    return len;
+}
+
+uint8_t classify_block(const uint8_t* data) {
+    if (is_zero(data, BLOCK_SIZE)) return BLK_EMPTY;
+
+    const struct dirent* entries = (const struct dirent*)data;
+    uint32_t entries_count = BLOCK_SIZE / sizeof(struct dirent);
+    uint32_t i = 0;
+    while (i < entries_count && entries[i].inode_num > 0 && entries[i].inode_num < TOTAL_INODE && valid_name(entries[i].name)) i++;
+
+    size_t entries_end = i * sizeof(struct dirent);
+    if (i > 0 && is_zero(data + entries_end, BLOCK_SIZE - entries_end)) return BLK_DIR;
+
+    size_t len = 0;
+    while (len < BLOCK_SIZE && data[len] != 0) {
+        if (data[len] < 0x20 && data[len] != '\n' && data[len] != '\r' && data[len] != '\t') break;
+        len++;
+    }
+
+    if (is_zero(data + len, BLOCK_SIZE - len)) return BLK_TEXT;
+    return BLK_BINARY;
+}
+
+void* scan_worker(void* arg) {
+    struct scan_job* job = (struct scan_job*)arg;
+    uint8_t* buffer = malloc(RECOVERY_CHUNK_BLOCKS * BLOCK_SIZE);
+    uint32_t chunks = (TOTAL_BLOCKS + RECOVERY_CHUNK_BLOCKS - 1) / RECOVERY_CHUNK_BLOCKS;
+
+    while (1) {
+        uint32_t chunk = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED);
+        if (chunk >= chunks) break;
+
+        uint32_t first = chunk * RECOVERY_CHUNK_BLOCKS;
+        uint32_t count = TOTAL_BLOCKS - first < RECOVERY_CHUNK_BLOCKS ? TOTAL_BLOCKS - first : RECOVERY_CHUNK_BLOCKS;
+
+        // One large positioned read per chunk keeps every worker streaming without sharing the file offset
+        ssize_t readden = pread(fd, buffer, (size_t)count * BLOCK_SIZE, BLOCK_OFFSET(first));
+        if (readden < 0) {
+            perror("read recovery chunk");
+            readden = 0;
+        }
+        uint32_t got = readden / BLOCK_SIZE;
+
+        for (uint32_t i = 0; i < count; i++) {
+            uint32_t block = first + i;
+            if (job->live[block]) job->classes[block] = BLK_LIVE;
+            else if (i >= got) job->classes[block] = BLK_EMPTY;
+            else {
+                job->classes[block] = classify_block(buffer + (size_t)i * BLOCK_SIZE);
+                job->used[block] = used_bytes(buffer + (size_t)i * BLOCK_SIZE);
+            }
+        }
+
+        __atomic_fetch_add(&job->scanned, got, __ATOMIC_RELAXED);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+// Keeps only entries that point at orphans nobody has claimed yet, returns the amount of kept entries
+static uint32_t adopt_children(uint16_t block, uint32_t self, const uint8_t* orphan, uint8_t* parented) {
+    char buffer[BLOCK_SIZE] = {0};
+    read_block(block, buffer);
+    struct dirent* entries = (struct dirent*)buffer;
+    uint32_t kept = 0;
+
+    for (int i = 0; i < BLOCK_SIZE / sizeof(struct dirent); i++) {
+        if (entries[i].inode_num == 0) break;
+
+        uint32_t child = entries[i].inode_num;
+        if (child < TOTAL_INODE && child != self && orphan[child] && !parented[child]) {
+            parented[child] = 1;
+            entries[kept++] = entries[i];
+        }
+    }
+
+    // A stray block that adopts nobody is left as it is
+    if (kept == 0 && self == 0) return 0;
+
+    memset(&entries[kept], 0, BLOCK_SIZE - kept * sizeof(struct dirent));
+    write_block(block, buffer);
+    return kept;
+}
+
+static uint8_t dir_has_name(const struct dirent* entries, int count, const char* name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(entries[i].name, name) == 0) return 1;
+    }
+    return 0;
+}
+
+static void release_recovered(uint32_t inode_num);
+
+// Frees the inodes a directory block lists, see release_recovered
+static void release_entries(uint16_t block) {
+    char buffer[BLOCK_SIZE];
+    read_block(block, buffer);
+    struct dirent* entries = (struct dirent*)buffer;
+
+    for (int i = 0; i < BLOCK_SIZE / sizeof(struct dirent) && entries[i].inode_num != 0; i++) {
+        release_recovered(entries[i].inode_num);
+    }
+}
+
+// Marks a recovered inode, its blocks and whatever it adopted free again when it cannot be linked.
+// Nothing is wiped, so a later pass finds the same data again
+static void release_recovered(uint32_t inode_num) {
+    struct superblock sb;
+    struct inode node;
+
+    read_sb(&sb);
+    if (inode_num == ROOT_INODE || inode_num >= TOTAL_INODE || !sb.bitmap_inode[inode_num]) return;
+    // Freed first, so directories that adopted each other do not recurse forever
+    set_inode(inode_num, 0);
+
+    read_inode(inode_num, &node);
+    if (node.type == DIR && node.blocks[0] != 0) release_entries(node.blocks[0]);
+    for (int i = 0; i < MAX_BLOCK_COUNT && node.blocks[i] != 0; i++) set_block(node.blocks[i], 0);
+}
+
+static int8_t link_recovered(uint32_t dir_num, uint32_t inode_num, const char* name) {
+    struct inode dir_inode;
+    char buffer[BLOCK_SIZE] = {0};
+    read_inode(dir_num, &dir_inode);
+    if (dir_inode.blocks[0] != 0) read_block(dir_inode.blocks[0], buffer);
+    struct dirent* entries = (struct dirent*)buffer;
+
+    struct dirent entry = {.inode_num = inode_num};
+    snprintf(entry.name, MAX_NAME_LEN, "%s", name);
+
+    int count = 0;
+    while (count < BLOCK_SIZE / sizeof(struct dirent) && entries[count].inode_num != 0) count++;
+    if (count >= BLOCK_SIZE / sizeof(struct dirent) - 1) return -1;
+
+    // The inode number goes in front of a taken name, then a counter as well, until nothing has it
+    for (int attempt = 0; dir_has_name(entries, count, entry.name); attempt++) {
+        if (attempt == 0) snprintf(entry.name, MAX_NAME_LEN, "%u_%s", inode_num, name);
+        else snprintf(entry.name, MAX_NAME_LEN, "%u_%d_%s", inode_num, attempt, name);
+    }
+
+    add_dirent_to_dir(dir_num, &entry);
+    return 1;
+}
+
+int8_t recover_files(struct recovery_report* report) {
+    struct superblock sb;
+    struct inode* table = malloc(INODE_SIZE * TOTAL_INODE);
+    uint8_t reachable[TOTAL_INODE] = {0};
+    uint8_t orphan[TOTAL_INODE] = {0};
+    uint8_t parented[TOTAL_INODE] = {0};
+    char names[TOTAL_INODE][MAX_NAME_LEN] = {0};
+    uint8_t live[TOTAL_BLOCKS] = {0};
+    uint8_t claimed[TOTAL_BLOCKS] = {0};
+    uint8_t classes[TOTAL_BLOCKS] = {0};
+    uint16_t used[TOTAL_BLOCKS] = {0};
+
+    memset(report, 0, sizeof(struct recovery_report));
+    read_sb(&sb);
+    if (!read_inode_table(table)) {
+        free(table);
+        return -1;
+    }
+
+    // Everything reachable from the root directory is alive and must not be touched
+    uint32_t queue[TOTAL_INODE];
+    uint32_t head = 0, tail = 0;
+    queue[tail++] = ROOT_INODE;
+    reachable[ROOT_INODE] = 1;
+    live[0] = 1;
+
+    // Trashed inodes are still owned by the volume until the reclaimer frees them
+    for (uint32_t i = sb.trash_head; i != 0 && i < TOTAL_INODE && !reachable[i]; i = table[i].trash_next) {
+        reachable[i] = 1;
+        queue[tail++] = i;
+    }
+
+    while (head < tail) {
+        uint32_t inode_num = queue[head++];
+        struct inode* node = &table[inode_num];
+
+        for (int j = 0; j < MAX_BLOCK_COUNT; j++) {
+            if (node->blocks[j] == 0) break;
+            if (node->blocks[j] < TOTAL_BLOCKS) live[node->blocks[j]] = 1;
+        }
+
+        if (node->type != DIR || (inode_num != ROOT_INODE && node->blocks[0] == 0)) continue;
+
+        char buffer[BLOCK_SIZE];
+        read_block(node->blocks[0], buffer);
+        struct dirent* entries = (struct dirent*)buffer;
+
+        for (int j = 0; j < BLOCK_SIZE / sizeof(struct dirent); j++) {
+            if (entries[j].inode_num == 0) break;
+            if (entries[j].inode_num >= TOTAL_INODE || reachable[entries[j].inode_num]) continue;
+
+            reachable[entries[j].inode_num] = 1;
+            queue[tail++] = entries[j].inode_num;
+        }
+    }
+
+    struct scan_job job = {.live = live, .classes = classes, .used = used, .next_chunk = 0, .scanned = 0};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1 ? 1 : (cpus > RECOVERY_MAX_THREADS ? RECOVERY_MAX_THREADS : cpus);
+    pthread_t workers[RECOVERY_MAX_THREADS];
+
+    posix_fadvise(fd, BLOCK_OFFSET(0), (off_t)TOTAL_BLOCKS * BLOCK_SIZE, POSIX_FADV_SEQUENTIAL);
+    for (int i = 0; i < threads; i++) pthread_create(&workers[i], NULL, scan_worker, &job);
+    for (int i = 0; i < threads; i++) pthread_join(workers[i], NULL);
+    report->scanned_blocks = job.scanned;
+
+    // Orphans are initialized inodes that are no longer reachable but still describe intact blocks
+    for (int i = 1; i < TOTAL_INODE; i++) {
+        struct inode* node = &table[i];
+        if (reachable[i] || (node->type != FIL && node->type != DIR) || node->create_time == 0) continue;
+
+        int valid = 1;
+        for (int j = 0; j < MAX_BLOCK_COUNT && node->blocks[j] != 0; j++) {
+            uint16_t block = node->blocks[j];
+            if (block >= TOTAL_BLOCKS || live[block] || claimed[block]) {
+                valid = 0;
+                break;
+            }
+        }
+        if (!valid) continue;
+
+        for (int j = 0; j < MAX_BLOCK_COUNT && node->blocks[j] != 0; j++) {
+            claimed[node->blocks[j]] = 1;
+            sb.bitmap_blocks[node->blocks[j]] = 1;
+        }
+        orphan[i] = 1;
+        sb.bitmap_inode[i] = 1;
+        report->orphan_inodes++;
+    }
+
+    // Surviving directory blocks give orphans back their names
+    for (int b = 1; b < TOTAL_BLOCKS; b++) {
+        if (classes[b] != BLK_DIR) continue;
+
+        char buffer[BLOCK_SIZE];
+        read_block(b, buffer);
+        struct dirent* entries = (struct dirent*)buffer;
+        for (int j = 0; j < BLOCK_SIZE / sizeof(struct dirent); j++) {
+            if (entries[j].inode_num == 0) break;
+            if (entries[j].inode_num < TOTAL_INODE && orphan[entries[j].inode_num] && names[entries[j].inode_num][0] == 0) {
+                memcpy(names[entries[j].inode_num], entries[j].name, MAX_NAME_LEN - 1);
+                names[entries[j].inode_num][MAX_NAME_LEN - 1] = '\0';
+            }
+        }
+    }
+
+    uint8_t dir_blocks[TOTAL_BLOCKS] = {0};
+    for (int b = 1; b < TOTAL_BLOCKS; b++) {
+        if (classes[b] == BLK_DIR && !claimed[b]) {
+            dir_blocks[b] = 1;
+            claimed[b] = 1;
+            sb.bitmap_blocks[b] = 1;
+        }
+    }
+
+    struct carved_file* carved = calloc(TOTAL_BLOCKS, sizeof(struct carved_file));
+    uint32_t carved_count = 0;
+    for (int b = 1; b < TOTAL_BLOCKS; b++) {
+        if ((classes[b] != BLK_TEXT && classes[b] != BLK_BINARY) || claimed[b]) continue;
+
+        struct carved_file* file = &carved[carved_count++];
+        file->type = classes[b];
+        int last = b;
+        file->blocks[file->block_count++] = b;
+        claimed[b] = 1;
+
+        // A full block followed by a block of the same kind is most likely the same file
+        while (file->block_count < MAX_BLOCK_COUNT && last + 1 < TOTAL_BLOCKS && used[last] == BLOCK_SIZE
+               && classes[last + 1] == file->type && !claimed[last + 1]) {
+            last++;
+            file->blocks[file->block_count++] = last;
+            claimed[last] = 1;
+        }
+
+        for (int j = 0; j < file->block_count; j++) sb.bitmap_blocks[file->blocks[j]] = 1;
+        file->size = (file->block_count - 1) * BLOCK_SIZE + used[last];
+    }
+
+    // Everything found is marked busy before any new inode or block gets allocated
+    write_sb(sb);
+
+    char recovered_path[] = "/" RECOVERED_DIR;
+    struct path_components path_c = parse_path(recovered_path);
+    int32_t dir_num = find_dir_to_print(path_c);
+    if (dir_num == -1) {
+        create_dir(recovered_path);
+        dir_num = find_dir_to_print(path_c);
+    }
+    free_path_component_struct(&path_c);
+
+    if (dir_num == -1) {
+        free(carved);
+        free(table);
+        return -2;
+    }
+
+    for (int i = 1; i < TOTAL_INODE; i++) {
+        if (!orphan[i] || table[i].type != DIR || table[i].blocks[0] == 0) continue;
+
+        table[i].size = adopt_children(table[i].blocks[0], i, orphan, parented) * sizeof(struct dirent);
+        write_inode(i, &table[i]);
+    }
+
+    // Whatever does not fit in the recovered directory is given back rather than left busy
+    for (int b = 1; b < TOTAL_BLOCKS; b++) {
+        if (!dir_blocks[b]) continue;
+
+        uint32_t kept = adopt_children(b, 0, orphan, parented);
+        uint32_t inode_num = find_free_inode();
+        if (kept == 0 || inode_num == -1) {
+            if (kept != 0) release_entries(b);
+            set_block(b, 0);
+            continue;
+        }
+
+        struct inode dir_inode = {
+            .type = DIR, .size = kept * sizeof(struct dirent), .blocks = {b}, .create_time = time(NULL)
+        };
+        write_inode(inode_num, &dir_inode);
+        set_inode(inode_num, 1);
+
+        char name[MAX_NAME_LEN];
+        snprintf(name, MAX_NAME_LEN, "dir_%d", b);
+        if (link_recovered(dir_num, inode_num, name) == -1) {
+            release_recovered(inode_num);
+            continue;
+        }
+        report->dir_blocks++;
+        report->recovered_files++;
+    }
+
+    for (int i = 1; i < TOTAL_INODE; i++) {
+        if (!orphan[i] || parented[i]) continue;
+
+        char name[MAX_NAME_LEN];
+        if (names[i][0] != 0) snprintf(name, MAX_NAME_LEN, "%s", names[i]);
+        else snprintf(name, MAX_NAME_LEN, "inode_%d", i);
+
+        if (link_recovered(dir_num, i, name) == -1) {
+            release_recovered(i);
+            continue;
+        }
+        report->recovered_files++;
+    }
+
+    for (uint32_t i = 0; i < carved_count; i++) {
+        struct carved_file* file = &carved[i];
+        uint32_t inode_num = find_free_inode();
+        if (inode_num == -1) {
+            for (int j = 0; j < file->block_count; j++) set_block(file->blocks[j], 0);
+            continue;
+        }
+
+        struct inode file_inode = {
+            .type = FIL, .size = file->size, .blocks = {0}, .create_time = time(NULL)
+        };
+        memcpy(file_inode.blocks, file->blocks, file->block_count * sizeof(uint16_t));
+        write_inode(inode_num, &file_inode);
+        set_inode(inode_num, 1);
+
+        char name[MAX_NAME_LEN];
+        snprintf(name, MAX_NAME_LEN, "carved_%d.%s", file->blocks[0], file->type == BLK_TEXT ? "txt" : "bin");
+        if (link_recovered(dir_num, inode_num, name) == -1) {
+            release_recovered(inode_num);
+            continue;
+        }
+        report->carved_files++;
+        report->recovered_files++;
+    }
+
+    free(carved);
+    free(table);
+    return 1;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "sfs.h"
+
+#include <pthread.h>
+
+#define RECOVERY_MAX_THREADS 8
+#define RECOVERY_CHUNK_BLOCKS 64
+
+#define RECOVERED_DIR "recovered"
+
+#define BLK_LIVE 0
+#define BLK_EMPTY 1
+#define BLK_DIR 2
+#define BLK_TEXT 3
+#define BLK_BINARY 4
+
+struct recovery_report {
+    uint32_t scanned_blocks;
+    uint32_t orphan_inodes;
+    uint32_t dir_blocks;
+    uint32_t carved_files;
+    uint32_t recovered_files;
+};
+
+struct scan_job {
+    const uint8_t* live;
+    uint8_t* classes;
+    uint16_t* used;
+    uint32_t next_chunk;
+    uint32_t scanned;
+};
+
+int8_t recover_files(struct recovery_report* report);
+void* scan_worker(void* arg);
+uint8_t classify_block(const uint8_t* data);
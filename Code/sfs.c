@@ -1,5 +1,6 @@
 #include "sfs.h"
 #include "aes.h"
+#include "crypto.h"
 #include "network.h"
 #include "ui.h"
 
@@ -12,8 +13,26 @@
 
 uint32_t fd = 0;
 struct superblock sb;
+pthread_mutex_t sfs_mutex;
+pthread_t reclaim_tid;
+
+uint32_t sb_generation = 0;
+pthread_once_t sfs_lock_once = PTHREAD_ONCE_INIT;
+
+void sfs_lock_init() {
+    // Recursive, so that public operations can be locked as a whole and still call each other
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&sfs_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
 
 void sfs_init(const char* path) {
+    pthread_once(&sfs_lock_once, sfs_lock_init);
+
+    file_key_flush();
+    plain_cache_flush();
     fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
 
     if (fd == -1) {
@@ -27,16 +46,13 @@ void sfs_init(const char* path) {
     }
 
     struct superblock sb = {
-        0xDEADBEEF, BLOCK_SIZE, TOTAL_BLOCKS, TOTAL_BLOCKS, TOTAL_INODE, {0}, {0}
+        SFS_MAGIC, 0, 0, BLOCK_SIZE, TOTAL_BLOCKS, TOTAL_BLOCKS, TOTAL_INODE, 0, 0, {0}, {0}
     };
     sb.bitmap_inode[0] = 1;
     sb.bitmap_blocks[0] = 1;
 
-    if (lseek(fd, 0, SEEK_SET) == -1) {
-        perror("lseek superblock");
-        return;
-    }
-    write(fd, &sb, sizeof(struct superblock));
+    sb_generation = 0;
+    write_sb(sb);
 
     struct inode root_inode = {
         .type = DIR, .size = 0, .create_time = time(NULL), .blocks = {0}
@@ -45,6 +61,62 @@ void sfs_init(const char* path) {
     write_inode(0, &root_inode);
 }
 
+uint8_t sb_copy_valid(const struct superblock* copy) {
+    struct superblock tmp = *copy;
+    tmp.checksum = 0;
+    return copy->magic == SFS_MAGIC && copy->checksum == crc32(&tmp, sizeof(struct superblock));
+}
+
+int read_sb_copies(struct superblock* copies) {
+    int best = -1;
+    for (int i = 0; i < SB_COPIES; i++) {
+        memset(&copies[i], 0, sizeof(struct superblock));
+        pread(fd, &copies[i], sizeof(struct superblock), SB_COPY_OFFSET(i));
+
+        if (sb_copy_valid(&copies[i]) && (best == -1 || copies[i].generation > copies[best].generation)) best = i;
+    }
+
+    return best;
+}
+
+int8_t sfs_mount(const char* path) {
+    pthread_once(&sfs_lock_once, sfs_lock_init);
+
+    file_key_flush();
+    plain_cache_flush();
+    fd = open(path, O_RDWR);
+    if (fd == -1) {
+        sfs_init(path);
+        return 0;
+    }
+
+    struct superblock copies[SB_COPIES];
+    int best = read_sb_copies(copies);
+    if (best == -1) {
+        close(fd);
+        return -1;
+    }
+
+    sb_generation = copies[best].generation;
+    for (int i = 0; i < SB_COPIES; i++) {
+        if (memcmp(&copies[i], &copies[best], sizeof(struct superblock)) != 0) {
+            // A torn or stale copy is repaired by rewriting every location from the winner
+            write_sb(copies[best]);
+            return 2;
+        }
+    }
+
+    return 1;
+}
+
+void sfs_lock() {
+    pthread_mutex_lock(&sfs_mutex);
+}
+
+void sfs_unlock() {
+    pthread_mutex_unlock(&sfs_mutex);
+}
+
 uint8_t read_inode(uint32_t inode_num, struct inode* buffer) {
     uint32_t offset = sizeof(struct superblock) + inode_num * sizeof(struct inode);
     if (lseek(fd, offset, SEEK_SET) == -1) {
@@ -77,6 +149,21 @@ uint8_t write_inode(uint32_t inode_num, const struct inode* buffer) {
     return 1;
 }
 
+uint8_t read_inode_table(struct inode* table) {
+    if (lseek(fd, sizeof(struct superblock), SEEK_SET) == -1) {
+        perror("lseek inode table");
+        return 0;
+    }
+
+    size_t readden = read(fd, table, INODE_SIZE * TOTAL_INODE);
+    if (readden != INODE_SIZE * TOTAL_INODE) {
+        perror("read inode table");
+        return 0;
+    }
+
+    return 1;
+}
+
 uint8_t read_block(uint32_t block_num, void* buffer) {
     if (block_num >= TOTAL_BLOCKS) {
         printf("Error (read block): block number is bigger than total amount of blocks\n");
@@ -143,13 +230,42 @@ void read_sb(struct superblock* sb) {
     read(fd, sb, sizeof(struct superblock));
 }
 
-void write_sb(const struct superblock sb) {
-    if (lseek(fd, 0, SEEK_SET) == -1) {
-        perror("lseek superblock");
-        return;
+void write_sb(struct superblock sb) {
+    sb.generation = ++sb_generation;
+    sb.checksum = 0;
+    sb.checksum = crc32(&sb, sizeof(struct superblock));
+
+    // The primary goes first, so a torn write always leaves an older valid backup behind
+    for (int i = 0; i < SB_COPIES; i++) {
+        if (pwrite(fd, &sb, sizeof(struct superblock), SB_COPY_OFFSET(i)) != sizeof(struct superblock)) {
+            perror("write superblock");
+        }
+    }
+}
+
+uint32_t crc32_table[256];
+pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+void crc32_init() {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        crc32_table[i] = c;
     }
+}
+
+// Continues a CRC32 over another piece of data; start with 0
+uint32_t crc32_update(uint32_t crc, const void* data, size_t size) {
+    const uint8_t* bytes = (const uint8_t*)data;
+
+    crc ^= 0xFFFFFFFF;
+    pthread_once(&crc32_once, crc32_init);
+    for (size_t i = 0; i < size; i++) crc = crc32_table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    return crc ^ 0xFFFFFFFF;
+}
 
-    write(fd, &sb, sizeof(struct superblock));
+uint32_t crc32(const void* data, size_t size) {
+    return crc32_update(0, data, size);
 }
 
 struct path_components parse_path(char* path) {
@@ -320,13 +436,15 @@ int32_t create_file(char* path) {
     struct inode parent_inode;
     char buffer[BLOCK_SIZE] = {0};
     read_inode(parent_inode_num, &parent_inode);
-    read_block(parent_inode.blocks[0], buffer);
+    // A directory without entries has no block yet; block 0 belongs to the root
+    if (parent_inode_num == ROOT_INODE || parent_inode.blocks[0] != 0) read_block(parent_inode.blocks[0], buffer);
     struct dirent* dir_entries = (struct dirent*)buffer;
 
-    for (int i = 0; i < BLOCK_SIZE / sizeof(struct dirent); i++) {
-        if (dir_entries[i].inode_num == 0) break;
+    int entry_count = 0;
+    for (; entry_count < BLOCK_SIZE / sizeof(struct dirent); entry_count++) {
+        if (dir_entries[entry_count].inode_num == 0) break;
 
-        if (strcmp(dir_entries[i].name, path_c.components[path_c.count - 1]) == 0) {
+        if (strcmp(dir_entries[entry_count].name, path_c.components[path_c.count - 1]) == 0) {
             free_path_component_struct(&path_c);
             return -4;
         }
@@ -336,7 +454,12 @@ int32_t create_file(char* path) {
         .type = FIL, .size = 0, .blocks = {0}, .create_time = time(NULL)
     };
 
-    int new_inode_num = find_free_inode();
+    // A full directory or inode table must not leave a half-created file behind
+    int new_inode_num = entry_count < BLOCK_SIZE / sizeof(struct dirent) ? find_free_inode() : -1;
+    if (new_inode_num == -1) {
+        free_path_component_struct(&path_c);
+        return -5;
+    }
     write_inode(new_inode_num, &new_file);
     set_inode(new_inode_num, 1);
 
@@ -379,27 +502,16 @@ void write_data_to_file(const struct dirent object, char* filename) {
     file_inode.blocks[0] = new_block_num;
     set_block(new_block_num, 1);
 
+    // A fresh nonce per rewrite, so no keystream is ever reused
+    uint8_t encrypted = compare_last_n_chars(filename, ".enc", 4);
+    if (encrypted) renew_file_nonce(&file_inode);
+
     while (1) {
         char c = getchar();
 
         if (c == 27) {
-            if (compare_last_n_chars(filename, ".enc", 4) == 1) {
-                uint8_t key[] = {
-                    0x00, 0x01, 0x02, 0x03,
-                    0x04, 0x05, 0x06, 0x07,
-                    0x08, 0x09, 0x0a, 0x0b,
-                    0x0c, 0x0d, 0x0e, 0x0f,
-                    0x10, 0x11, 0x12, 0x13,
-                    0x14, 0x15, 0x16, 0x17,
-                    0x18, 0x19, 0x1a, 0x1b,
-                    0x1c, 0x1d, 0x1e, 0x1f};
-
-                uint8_t* exp_key = aes_init(sizeof(key));
-                aes_key_expansion(key, exp_key);
-                char enc_data[BLOCK_SIZE] = {0};
-                aes_encrypt(data, enc_data, BLOCK_SIZE, exp_key);
-                write_block(file_inode.blocks[block_index], enc_data);
-            } else write_block(file_inode.blocks[block_index], data);
+            if (encrypted) encrypt_data(data, BLOCK_SIZE, object.inode_num, &file_inode, block_index);
+            write_block(file_inode.blocks[block_index], data);
 
             break;
         }
@@ -408,22 +520,7 @@ void write_data_to_file(const struct dirent object, char* filename) {
         total_size++;
 
         if (total_size % BLOCK_SIZE == 0) {
-            if (compare_last_n_chars(filename, ".enc", 4) == 1) {
-                uint8_t key[] = {
-                    0x00, 0x01, 0x02, 0x03,
-                    0x04, 0x05, 0x06, 0x07,
-                    0x08, 0x09, 0x0a, 0x0b,
-                    0x0c, 0x0d, 0x0e, 0x0f,
-                    0x10, 0x11, 0x12, 0x13,
-                    0x14, 0x15, 0x16, 0x17,
-                    0x18, 0x19, 0x1a, 0x1b,
-                    0x1c, 0x1d, 0x1e, 0x1f};
-
-                uint8_t* exp_key = aes_init(sizeof(key));
-                aes_key_expansion(key, exp_key);
-                char enc_data[BLOCK_SIZE] = {0};
-                aes_inv_cipher(enc_data, data, exp_key);
-            }
+            if (encrypted) encrypt_data(data, BLOCK_SIZE, object.inode_num, &file_inode, block_index);
             write_block(file_inode.blocks[block_index], data);
             block_index++;
             if (block_index == 12) {
@@ -494,35 +591,234 @@ void read_data_from_file(const struct dirent object, char* filename) {
         return;
     }
 
-    char data[BLOCK_SIZE] = {0};
     printf("Data in file '%s':\n", object.name);
 
-    size_t total_size = 0;
-    int block_index = 0;
+    int block_count = 0;
+    while (block_count < MAX_BLOCK_COUNT && file_inode.blocks[block_count] != 0) block_count++;
 
-    while (file_inode.blocks[block_index] != 0 && block_index != MAX_BLOCK_COUNT) {
-        read_block(file_inode.blocks[block_index], data);
-        
-        if (compare_last_n_chars(filename, ".enc", 4) == 1) {
-            uint8_t key[] = {
-                0x00, 0x01, 0x02, 0x03,
-                0x04, 0x05, 0x06, 0x07,
-                0x08, 0x09, 0x0a, 0x0b,
-                0x0c, 0x0d, 0x0e, 0x0f,
-                0x10, 0x11, 0x12, 0x13,
-                0x14, 0x15, 0x16, 0x17,
-                0x18, 0x19, 0x1a, 0x1b,
-                0x1c, 0x1d, 0x1e, 0x1f};
-
-            uint8_t* exp_key = aes_init(sizeof(key));
-            aes_key_expansion(key, exp_key);
-            char dec_data[BLOCK_SIZE] = {0};
-            aes_decrypt(data, dec_data, BLOCK_SIZE, exp_key);
-            printf("%s", dec_data);
-        } else printf("%s", data);
-        block_index++;
+    char* data = calloc(MAX_BLOCK_COUNT * BLOCK_SIZE + 1, 1);
+    if (compare_last_n_chars(filename, ".enc", 4) == 1) {
+        if (read_encrypted_file(object.inode_num, &file_inode, data, block_count) != 0) {
+            printf("\nError: '%s' failed authentication\n", object.name);
+            free(data);
+            return;
+        }
+    } else {
+        for (int i = 0; i < block_count; i++) read_block(file_inode.blocks[i], data + i * BLOCK_SIZE);
     }
+
+    for (int i = 0; i < block_count; i++) printf("%.*s", BLOCK_SIZE, data + i * BLOCK_SIZE);
     printf("\n\n");
+    free(data);
+}
+
+// A whole rewrite of an .enc file: a fresh nonce, so no keystream is ever reused, and the current key generation
+void renew_file_nonce(struct inode* node) {
+    random_bytes(node->nonce, CTR_NONCE_SIZE);
+    node->key_gen = sb.key_gen;
+}
+
+// Every block is sealed with AES-GCM under the file's own key and IV = nonce || block index;
+// the tag of each block lands in node->tags
+void encrypt_data(char* data, size_t size, uint32_t inode_num, struct inode* node, uint32_t block_index) {
+    struct aes_ctx ctx;
+    // Just written blocks are the likeliest to be read next
+    for (size_t done = 0; done + BLOCK_SIZE <= size; done += BLOCK_SIZE) {
+        plain_cache_put(inode_num, block_index + done / BLOCK_SIZE, node->key_gen, node->nonce, data + done);
+    }
+    file_key_get(inode_num, node->key_gen, &ctx);
+    gcm_crypt_extents(&ctx, node->nonce, block_index, (uint8_t*)data, size, node->tags[block_index], 0);
+    aes_clear(&ctx);
+}
+
+// Returns -1 and leaves zeroes in data if any block fails authentication
+int8_t decrypt_data(char* data, size_t size, uint32_t inode_num, const struct inode* node, uint32_t block_index) {
+    struct aes_ctx ctx;
+    file_key_get(inode_num, node->key_gen, &ctx);
+    int8_t result = gcm_crypt_extents(&ctx, node->nonce, block_index, (uint8_t*)data, size,
+                                      (uint8_t*)node->tags[block_index], 1);
+    aes_clear(&ctx);
+    return result;
+}
+
+// Reads and decrypts the first block_count blocks of an .enc file into data.
+// Cached blocks skip both the disk and the cipher, the rest are decrypted in contiguous runs
+int8_t read_encrypted_file(uint32_t inode_num, const struct inode* node, char* data, uint32_t block_count) {
+    uint8_t cached[MAX_BLOCK_COUNT];
+    int8_t result = 0;
+
+    sfs_lock();
+    for (uint32_t i = 0; i < block_count; i++) {
+        cached[i] = plain_cache_get(inode_num, i, node->key_gen, node->nonce, data + i * BLOCK_SIZE);
+        if (!cached[i]) read_block(node->blocks[i], data + i * BLOCK_SIZE);
+    }
+    sfs_unlock();
+
+    for (uint32_t start = 0; start < block_count; ) {
+        if (cached[start]) {
+            start++;
+            continue;
+        }
+
+        uint32_t end = start;
+        while (end < block_count && !cached[end]) end++;
+
+        char* run = data + start * BLOCK_SIZE;
+        if (decrypt_data(run, (end - start) * BLOCK_SIZE, inode_num, node, start) != 0) {
+            result = -1;
+        } else {
+            for (uint32_t i = start; i < end; i++) {
+                plain_cache_put(inode_num, i, node->key_gen, node->nonce, data + i * BLOCK_SIZE);
+            }
+        }
+        start = end;
+    }
+
+    return result;
+}
+
+// Derives the master key for the mounted volume; the first unlock also picks the salt.
+// Returns 1 when a new key was set, 0 when the passphrase matched, -1 when it did not
+int8_t unlock_volume(const char* passphrase) {
+    uint8_t key[VOLUME_KEY_SIZE], check[KEY_CHECK_SIZE], unset[KEY_CHECK_SIZE] = {0};
+    int8_t result = 0;
+
+    sfs_lock();
+    read_sb(&sb);
+    uint8_t fresh = memcmp(sb.key_check, unset, KEY_CHECK_SIZE) == 0;
+    if (fresh) random_bytes(sb.key_salt, KEY_SALT_SIZE);
+
+    derive_master_key(passphrase, sb.key_salt, key, check);
+
+    if (fresh) {
+        memcpy(sb.key_check, check, KEY_CHECK_SIZE);
+        write_sb(sb);
+        result = 1;
+    } else if (memcmp(check, sb.key_check, KEY_CHECK_SIZE) != 0) {
+        result = -1;
+    }
+
+    if (result != -1) {
+        set_master_key(key);
+        plain_cache_flush();
+    }
+    sfs_unlock();
+
+    memset(key, 0, sizeof(key));
+    return result;
+}
+
+// Free blocks straight from the bitmap; unlike find_free_block this never reclaims the trash,
+// which would pull inodes out from under a pass over the inode table
+static uint8_t claim_free_blocks(uint32_t count, uint16_t* out) {
+    struct superblock current;
+    uint32_t found = 0;
+
+    read_sb(&current);
+    for (uint32_t i = 1; i < TOTAL_BLOCKS && found < count; i++) {
+        if (current.bitmap_blocks[i] == 0) out[found++] = i;
+    }
+    if (found < count) return 0;
+
+    for (uint32_t i = 0; i < count; i++) set_block(out[i], 1);
+    return 1;
+}
+
+// Re-encrypts one file under the subkey of generation key_gen with a fresh nonce. The new blocks
+// go to free space and the inode switches over in one write, so a crash leaves the file on
+// either its old or its new generation, never in between
+static int8_t rotate_file_key(uint32_t inode_num, struct inode* node, uint32_t key_gen) {
+    uint16_t fresh[MAX_BLOCK_COUNT];
+    uint32_t block_count = 0;
+
+    while (block_count < MAX_BLOCK_COUNT && node->blocks[block_count] != 0) block_count++;
+
+    char* data = calloc(MAX_BLOCK_COUNT, BLOCK_SIZE);
+    if (data == NULL || read_encrypted_file(inode_num, node, data, block_count) != 0 ||
+        !claim_free_blocks(block_count, fresh)) {
+        free(data);
+        return -1;
+    }
+
+    uint8_t key[VOLUME_KEY_SIZE];
+    struct aes_ctx ctx;
+    derive_file_key(inode_num, key_gen, key);
+    aes_init(&ctx, key, VOLUME_KEY_SIZE);
+    memset(key, 0, sizeof(key));
+
+    struct inode rotated = *node;
+    random_bytes(rotated.nonce, CTR_NONCE_SIZE);
+    rotated.key_gen = key_gen;
+    gcm_crypt_extents(&ctx, rotated.nonce, 0, (uint8_t*)data, block_count * BLOCK_SIZE, rotated.tags[0], 0);
+    aes_clear(&ctx);
+
+    for (uint32_t i = 0; i < block_count; i++) {
+        write_block(fresh[i], data + i * BLOCK_SIZE);
+        rotated.blocks[i] = fresh[i];
+    }
+    fdatasync(fd);
+    write_inode(inode_num, &rotated);
+    fdatasync(fd);
+
+    for (uint32_t i = 0; i < block_count; i++) set_block(node->blocks[i], 0);
+    *node = rotated;
+    plain_cache_invalidate(inode_num);
+
+    free(data);
+    return 0;
+}
+
+// Moves every .enc file, including the ones in the trash, to the next key generation. Every inode
+// records its own generation, so a file that is not moved, because it fails authentication or
+// there is no room for its copy, stays readable and is counted in failed
+int8_t rotate_file_keys(uint32_t* rotated, uint32_t* failed) {
+    struct inode* table = malloc(INODE_SIZE * TOTAL_INODE);
+    uint8_t encrypted[TOTAL_INODE] = {0};
+
+    *rotated = 0;
+    *failed = 0;
+    sfs_lock();
+    read_sb(&sb);
+    if (!read_inode_table(table)) {
+        sfs_unlock();
+        free(table);
+        return -1;
+    }
+
+    for (int i = 0; i < TOTAL_INODE; i++) {
+        if (sb.bitmap_inode[i] == 0) continue;
+
+        if (table[i].type == FIL && table[i].delete_time != 0) {
+            encrypted[i] = compare_last_n_chars(table[i].name, ".enc", 4);
+        } else if (table[i].type == DIR) {
+            char buffer[BLOCK_SIZE];
+            read_block(table[i].blocks[0], buffer);
+            struct dirent* objects = (struct dirent*)buffer;
+
+            for (int j = 0; j < BLOCK_SIZE / sizeof(struct dirent) && objects[j].inode_num != 0; j++) {
+                if (objects[j].inode_num < TOTAL_INODE && compare_last_n_chars(objects[j].name, ".enc", 4)) {
+                    encrypted[objects[j].inode_num] = 1;
+                }
+            }
+        }
+    }
+
+    // New writes take the new generation from here on
+    uint32_t key_gen = sb.key_gen + 1;
+    sb.key_gen = key_gen;
+    write_sb(sb);
+
+    for (int i = 0; i < TOTAL_INODE; i++) {
+        if (!encrypted[i] || table[i].type != FIL) continue;
+
+        if (rotate_file_key(i, &table[i], key_gen) == 0) (*rotated)++;
+        else (*failed)++;
+    }
+    read_sb(&sb);
+    sfs_unlock();
+
+    free(table);
+    return 0;
 }
 
 int8_t read_file(char* path) {
@@ -590,17 +886,7 @@ int8_t delete_file(char* path) {
         if (strcmp(objects[i].name, path_c.components[path_c.count - 1]) == 0) {
             struct inode file_inode;
             read_inode(objects[i].inode_num, &file_inode);
-
-            char buffer[BLOCK_SIZE] = {0}; 
-            for (int j = 0; j < MAX_BLOCK_COUNT; j++) {
-                if (file_inode.blocks[j] == 0) break; 
-                set_block(file_inode.blocks[j], 0);
-                write_block(file_inode.blocks[j], buffer);
-            }
-
-            struct inode clear_node = {0};
-            set_inode(objects[i].inode_num, 0);
-            write_inode(objects[i].inode_num, &clear_node);
+            trash_push(objects[i].inode_num, &file_inode, parent_inode_num, objects[i].name);
 
             for (int j = i; j < BLOCK_SIZE / sizeof(struct dirent); j++) {
                 if (objects[j].inode_num == 0 && j != 0) {
@@ -620,7 +906,6 @@ int8_t delete_file(char* path) {
 }
 
 void delete_file_in_dir(struct inode obj_inode) {
-    printf("1");
     char buffer[BLOCK_SIZE] = {0}; 
     for (int i = 0; i < MAX_BLOCK_COUNT; i++) {
         if (obj_inode.blocks[i] == 0) break;
@@ -630,7 +915,6 @@ void delete_file_in_dir(struct inode obj_inode) {
 }
 
 void delete_dir_inode(struct inode obj_inode) {
-    printf("1");
     char buffer[BLOCK_SIZE];
     if (obj_inode.blocks[0] == 0) return;
     read_block(obj_inode.blocks[0], buffer);
@@ -646,6 +930,7 @@ void delete_dir_inode(struct inode obj_inode) {
         else if (delete_inode.type == DIR) delete_dir_inode(delete_inode);
 
         struct inode clear_inode = {0};
+        plain_cache_invalidate(objects[i].inode_num);
         set_inode(objects[i].inode_num, 0);
         write_inode(objects[i].inode_num, &clear_inode);
     }
@@ -681,29 +966,13 @@ int8_t delete_dir(char* path) {
         if (strcmp(objects[i].name, path_c.components[path_c.count - 1]) == 0) {
             struct inode dir_inode_to_delete;
             read_inode(objects[i].inode_num, &dir_inode_to_delete);
-
-            char buffer1[BLOCK_SIZE];
-            if (dir_inode_to_delete.blocks[0] != 0) {
-                read_block(dir_inode_to_delete.blocks[0], &buffer1);
-                struct dirent* dir_objects = (struct dirent*)buffer1;
-
-                for (int j = 0; j < BLOCK_SIZE / sizeof(struct dirent); j++) {
-                    if (dir_objects[j].inode_num == 0) break;
-                    struct inode obj_inode;
-                    read_inode(dir_objects[j].inode_num, &obj_inode);
-
-                    if (obj_inode.type == DIR) delete_dir_inode(obj_inode);
-                    else if (obj_inode.type == FIL) delete_file_in_dir(obj_inode);
-
-                    struct inode clear_node = {0};
-                    set_inode(dir_objects[j].inode_num, 0);
-                    write_inode(dir_objects[j].inode_num, &clear_node);
-                }
+            if (dir_inode_to_delete.type != DIR) {
+                free_path_component_struct(&path_c);
+                return -3;
             }
 
-            struct inode clear_node = {0};
-            set_inode(objects[i].inode_num, 0);
-            write_inode(objects[i].inode_num, &clear_node);
+            // The whole subtree stays intact under the trashed directory until it is reclaimed
+            trash_push(objects[i].inode_num, &dir_inode_to_delete, parent_inode_num, objects[i].name);
 
             for (int j = i; j < BLOCK_SIZE / sizeof(struct dirent); j++) {
                 if (objects[j].inode_num == 0 && j != 0) {
@@ -712,11 +981,6 @@ int8_t delete_dir(char* path) {
                 objects[j] = objects[j + 1];
             }
             
-            if (dir_inode_to_delete.blocks[0] != 0) {
-                char clear_buffer[BLOCK_SIZE] = {0};
-                set_block(dir_inode_to_delete.blocks[0], 0);
-                write_block(dir_inode_to_delete.blocks[0], clear_buffer);
-            }
             write_block(dir_inode.blocks[0], objects);
 
             break;
@@ -727,6 +991,207 @@ int8_t delete_dir(char* path) {
     return 1;
 }
 
+void trash_push(uint32_t inode_num, struct inode* node, uint32_t parent, const char* name) {
+    struct superblock sb;
+    read_sb(&sb);
+
+    struct inode parent_inode;
+    read_inode(parent, &parent_inode);
+
+    node->delete_time = time(NULL);
+    node->parent = parent;
+    node->parent_created = parent_inode.create_time;
+    node->trash_prev = 0;
+    node->trash_next = sb.trash_head;
+    strncpy(node->name, name, MAX_NAME_LEN - 1);
+    node->name[MAX_NAME_LEN - 1] = '\0';
+
+    if (sb.trash_head != 0) {
+        struct inode head;
+        read_inode(sb.trash_head, &head);
+        head.trash_prev = inode_num;
+        write_inode(sb.trash_head, &head);
+    }
+
+    sb.trash_head = inode_num;
+    if (sb.trash_tail == 0) sb.trash_tail = inode_num;
+
+    write_inode(inode_num, node);
+    write_sb(sb);
+}
+
+void trash_unlink(uint32_t inode_num, struct inode* node, struct superblock* sb) {
+    if (node->trash_prev != 0) {
+        struct inode prev;
+        read_inode(node->trash_prev, &prev);
+        prev.trash_next = node->trash_next;
+        write_inode(node->trash_prev, &prev);
+    } else {
+        sb->trash_head = node->trash_next;
+    }
+
+    if (node->trash_next != 0) {
+        struct inode next;
+        read_inode(node->trash_next, &next);
+        next.trash_prev = node->trash_prev;
+        write_inode(node->trash_next, &next);
+    } else {
+        sb->trash_tail = node->trash_prev;
+    }
+
+    node->delete_time = 0;
+    node->trash_prev = 0;
+    node->trash_next = 0;
+}
+
+// Walks the live tree from the root; a trashed directory, or one under a trashed ancestor, is not in it
+static uint8_t dir_reachable(uint32_t target) {
+    uint32_t queue[TOTAL_INODE];
+    uint8_t seen[TOTAL_INODE] = {0};
+    uint32_t head = 0, tail = 0;
+
+    queue[tail++] = ROOT_INODE;
+    seen[ROOT_INODE] = 1;
+    while (head < tail) {
+        uint32_t dir_num = queue[head++];
+        if (dir_num == target) return 1;
+
+        struct inode dir;
+        char buffer[BLOCK_SIZE];
+        read_inode(dir_num, &dir);
+        if (dir.type != DIR || (dir_num != ROOT_INODE && dir.blocks[0] == 0)) continue;
+        read_block(dir.blocks[0], buffer);
+
+        struct dirent* objects = (struct dirent*)buffer;
+        for (int i = 0; i < BLOCK_SIZE / sizeof(struct dirent) && objects[i].inode_num != 0; i++) {
+            uint32_t child = objects[i].inode_num;
+            if (child >= TOTAL_INODE || seen[child]) continue;
+            seen[child] = 1;
+            queue[tail++] = child;
+        }
+    }
+    return 0;
+}
+
+int8_t undelete(uint32_t inode_num) {
+    struct superblock sb;
+    struct inode node;
+
+    read_sb(&sb);
+    if (inode_num == 0 || inode_num >= TOTAL_INODE || sb.bitmap_inode[inode_num] == 0) return -1;
+
+    read_inode(inode_num, &node);
+    if (node.delete_time == 0) return -1;
+
+    // The original parent is used only while it is the same directory and can still be reached from the root
+    uint32_t parent = node.parent < TOTAL_INODE ? node.parent : ROOT_INODE;
+    struct inode parent_inode;
+    read_inode(parent, &parent_inode);
+    if (parent != ROOT_INODE && (sb.bitmap_inode[parent] == 0 || parent_inode.type != DIR ||
+                                 parent_inode.create_time != node.parent_created || !dir_reachable(parent))) {
+        parent = ROOT_INODE;
+        read_inode(parent, &parent_inode);
+    }
+
+    char buffer[BLOCK_SIZE] = {0};
+    if (parent == ROOT_INODE || parent_inode.blocks[0] != 0) read_block(parent_inode.blocks[0], buffer);
+    struct dirent* objects = (struct dirent*)buffer;
+
+    int i = 0;
+    for (; i < BLOCK_SIZE / sizeof(struct dirent); i++) {
+        if (objects[i].inode_num == 0) break;
+        if (strcmp(objects[i].name, node.name) == 0) return -2;
+    }
+    if (i >= BLOCK_SIZE / sizeof(struct dirent) - 1) return -3;
+
+    trash_unlink(inode_num, &node, &sb);
+    write_inode(inode_num, &node);
+    write_sb(sb);
+
+    struct dirent entry = {.inode_num = inode_num};
+    strncpy(entry.name, node.name, MAX_NAME_LEN);
+    add_dirent_to_dir(parent, &entry);
+    return 1;
+}
+
+void reclaim_inode(uint32_t inode_num, struct inode* node) {
+    if (node->type == FIL) delete_file_in_dir(*node);
+    else if (node->type == DIR) delete_dir_inode(*node);
+
+    struct inode clear_node = {0};
+    plain_cache_invalidate(inode_num);
+    set_inode(inode_num, 0);
+    write_inode(inode_num, &clear_node);
+}
+
+int8_t trash_reclaim_oldest() {
+    struct superblock sb;
+    struct inode node;
+
+    read_sb(&sb);
+    if (sb.trash_tail == 0) return 0;
+
+    uint32_t inode_num = sb.trash_tail;
+    read_inode(inode_num, &node);
+    trash_unlink(inode_num, &node, &sb);
+    write_sb(sb);
+
+    reclaim_inode(inode_num, &node);
+    return 1;
+}
+
+// Frees one trashed file or directory right away instead of waiting for it to age out
+int8_t trash_purge(uint32_t inode_num) {
+    struct superblock sb;
+    struct inode node;
+
+    read_sb(&sb);
+    if (inode_num == 0 || inode_num >= TOTAL_INODE || sb.bitmap_inode[inode_num] == 0) return -1;
+
+    read_inode(inode_num, &node);
+    if (node.delete_time == 0) return -1;
+
+    trash_unlink(inode_num, &node, &sb);
+    write_sb(sb);
+
+    reclaim_inode(inode_num, &node);
+    return 1;
+}
+
+uint32_t trash_reclaim(time_t now) {
+    uint32_t count = 0;
+
+    while (1) {
+        struct superblock sb;
+        struct inode oldest;
+        uint32_t free_blocks = 0;
+
+        read_sb(&sb);
+        if (sb.trash_tail == 0) break;
+
+        for (int i = 1; i < TOTAL_BLOCKS; i++) free_blocks += !sb.bitmap_blocks[i];
+
+        read_inode(sb.trash_tail, &oldest);
+        if (now - oldest.delete_time < TRASH_RETENTION && free_blocks >= TRASH_LOW_WATERMARK) break;
+
+        trash_reclaim_oldest();
+        count++;
+    }
+
+    return count;
+}
+
+void* reclaim_thread(void* arg) {
+    while (1) {
+        sleep(TRASH_RECLAIM_INTERVAL);
+
+        sfs_lock();
+        trash_reclaim(time(NULL));
+        sfs_unlock();
+    }
+    return NULL;
+}
+
 int32_t find_dir_to_print(struct path_components path_c) {
     uint32_t inode_num = 0;
 
@@ -826,6 +1291,9 @@ uint32_t find_free_block() {
         if (sb.bitmap_blocks[i] == 0) return i;
     }
 
+    // Space held by the trash is given back before the volume is reported as full
+    if (trash_reclaim_oldest() == 1) return find_free_block();
+
     printf("There is no free block to store data\n");
     return -1;
 }
@@ -838,6 +1306,8 @@ uint32_t find_free_inode() {
         if (sb.bitmap_inode[i] == 0) return i;
     }
 
+    if (trash_reclaim_oldest() == 1) return find_free_inode();
+
     printf("There is no free inode to store metadata\n");
     return -1;
 }
@@ -882,6 +1352,10 @@ void delete_all() {
         }
     }
 
+    sb.trash_head = 0;
+    sb.trash_tail = 0;
+    write_sb(sb);
+
     printf("Filesystem was cleared successfully\n");
 }
 
@@ -938,16 +1412,141 @@ void defragment(WINDOW* win, int* row) {
     mvwprintw(win, *row, 2, "Amount of corrected blocks of memory: %d", count);
 }
 
+void analyze_fragmentation(struct frag_report* report) {
+    struct superblock sb;
+    struct inode* table = malloc(INODE_SIZE * TOTAL_INODE);
+
+    memset(report, 0, sizeof(struct frag_report));
+    read_sb(&sb);
+    if (!read_inode_table(table)) {
+        free(table);
+        return;
+    }
+
+    report->block_map[0] = MAP_SYSTEM;
+    for (int i = 1; i < TOTAL_BLOCKS; i++) {
+        report->block_map[i] = sb.bitmap_blocks[i] ? MAP_CONTIGUOUS : MAP_FREE;
+        if (sb.bitmap_blocks[i]) report->used_blocks++;
+        else report->free_blocks++;
+    }
+
+    for (int i = 1; i < TOTAL_INODE; i++) {
+        if (sb.bitmap_inode[i] == 0) continue;
+
+        struct frag_file* file = &report->files[report->file_count++];
+        file->inode_num = i;
+        file->type = table[i].type;
+
+        for (int j = 0; j < MAX_BLOCK_COUNT; j++) {
+            if (table[i].blocks[j] == 0) break;
+
+            if (j == 0 || table[i].blocks[j] != table[i].blocks[j - 1] + 1) file->extent_count++;
+            file->block_count++;
+        }
+
+        report->total_extents += file->extent_count;
+        if (file->extent_count > 1) {
+            report->fragmented_files++;
+            for (int j = 0; j < file->block_count; j++) {
+                if (table[i].blocks[j] < TOTAL_BLOCKS) report->block_map[table[i].blocks[j]] = MAP_FRAGMENTED;
+            }
+        }
+    }
+
+    for (int i = 1; i < TOTAL_BLOCKS; ) {
+        if (sb.bitmap_blocks[i]) {
+            i++;
+            continue;
+        }
+
+        uint32_t run = 0;
+        while (i < TOTAL_BLOCKS && sb.bitmap_blocks[i] == 0) {
+            run++;
+            i++;
+        }
+
+        int bucket = 0;
+        while (bucket < FRAG_HIST_BUCKETS - 1 && (run >> (bucket + 1)) != 0) bucket++;
+        report->free_run_hist[bucket]++;
+        report->free_runs++;
+        if (run > report->largest_free_run) report->largest_free_run = run;
+    }
+
+    // Replay defragment() on a copy of the bitmap to count the blocks it would move
+    uint8_t bitmap[TOTAL_BLOCKS];
+    memcpy(bitmap, sb.bitmap_blocks, TOTAL_BLOCKS);
+
+    for (int i = 1; i < TOTAL_INODE; i++) {
+        for (int j = 0; j < MAX_BLOCK_COUNT; j++) {
+            uint16_t block = table[i].blocks[j];
+            if (block == 0) break;
+
+            for (int k = 1; k < TOTAL_BLOCKS; k++) {
+                if (k == block) break;
+
+                if (bitmap[k] == 0) {
+                    bitmap[k] = 1;
+                    if (block < TOTAL_BLOCKS) bitmap[block] = 0;
+                    table[i].blocks[j] = k;
+                    report->defrag_moves++;
+                    break;
+                }
+            }
+        }
+    }
+
+    free(table);
+}
+
+int8_t dump_fragmentation_json(const struct frag_report* report, const char* path) {
+    FILE* out = fopen(path, "w");
+    if (out == NULL) {
+        perror("open fragmentation report");
+        return -1;
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"block_size\": %d,\n  \"total_blocks\": %d,\n", BLOCK_SIZE, TOTAL_BLOCKS);
+    fprintf(out, "  \"used_blocks\": %u,\n  \"free_blocks\": %u,\n", report->used_blocks, report->free_blocks);
+    fprintf(out, "  \"free_runs\": %u,\n  \"largest_free_run\": %u,\n", report->free_runs, report->largest_free_run);
+
+    fprintf(out, "  \"free_run_histogram\": [");
+    for (int i = 0; i < FRAG_HIST_BUCKETS; i++) {
+        fprintf(out, "%s\n    {\"min\": %u, \"max\": %u, \"count\": %u}", i ? "," : "",
+                1u << i, (1u << (i + 1)) - 1, report->free_run_hist[i]);
+    }
+    fprintf(out, "\n  ],\n");
+
+    fprintf(out, "  \"file_count\": %u,\n  \"fragmented_files\": %u,\n  \"total_extents\": %u,\n",
+            report->file_count, report->fragmented_files, report->total_extents);
+
+    fprintf(out, "  \"files\": [");
+    for (uint32_t i = 0; i < report->file_count; i++) {
+        const struct frag_file* file = &report->files[i];
+        fprintf(out, "%s\n    {\"inode\": %u, \"type\": \"%s\", \"blocks\": %u, \"extents\": %u}", i ? "," : "",
+                file->inode_num, file->type == DIR ? "dir" : "file", file->block_count, file->extent_count);
+    }
+    fprintf(out, "\n  ],\n");
+
+    fprintf(out, "  \"defrag_estimate\": {\"moves\": %u, \"io_bytes\": %u},\n",
+            report->defrag_moves, report->defrag_moves * BLOCK_SIZE * 3);
+    fprintf(out, "  \"block_map\": \"%s\"\n", report->block_map);
+    fprintf(out, "}\n");
+
+    fclose(out);
+    return 1;
+}
+
 void check_blocks(WINDOW* win, int* row) {
     uint32_t count = 0;
-    uint32_t inode_num = 0;
     struct inode object;
     struct superblock sb;
 
     read_sb(&sb);
 
     for (int i = 0; i < TOTAL_INODE; i++) {
-        read_inode(inode_num, &object);
+        if (sb.bitmap_inode[i] == 0) continue;
+        read_inode(i, &object);
 
         for (int j = 0; j < MAX_BLOCK_COUNT; j++) {
             if (object.blocks[j] == 0) break;
@@ -958,8 +1557,6 @@ void check_blocks(WINDOW* win, int* row) {
                 sb.bitmap_blocks[object.blocks[j]] = 1;
             }
         }
-
-        write_inode(inode_num, &object);
     }
 
     mvwprintw(win, *row, 2, "Amount of corrected blocks: %d", count);
@@ -967,6 +1564,138 @@ void check_blocks(WINDOW* win, int* row) {
     write_sb(sb);
 }
 
+static inline uint8_t bitset_test(const uint64_t* set, uint32_t n) {
+    return (set[n / 64] >> (n % 64)) & 1;
+}
+
+static inline void bitset_set(uint64_t* set, uint32_t n) {
+    set[n / 64] |= (uint64_t)1 << (n % 64);
+}
+
+void bitset_pack(uint64_t* set, const uint8_t* bytes, uint32_t count) {
+    memset(set, 0, BITSET_WORDS(count) * sizeof(uint64_t));
+    for (uint32_t i = 0; i < count; i++) {
+        if (bytes[i]) bitset_set(set, i);
+    }
+}
+
+uint32_t bitset_count(const uint64_t* set, uint32_t words) {
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < words; i++) count += __builtin_popcountll(set[i]);
+    return count;
+}
+
+// Marks everything reachable from inode_num in the expected bitsets, noting blocks claimed twice
+void mark_tree(const struct inode* table, uint32_t inode_num, uint64_t* inodes, uint64_t* blocks, uint64_t* shared) {
+    uint32_t stack[TOTAL_INODE];
+    uint32_t top = 0;
+
+    if (bitset_test(inodes, inode_num)) return;
+    bitset_set(inodes, inode_num);
+    stack[top++] = inode_num;
+
+    while (top > 0) {
+        const struct inode* node = &table[stack[--top]];
+
+        for (int j = 0; j < MAX_BLOCK_COUNT; j++) {
+            if (node->blocks[j] == 0 || node->blocks[j] >= TOTAL_BLOCKS) break;
+
+            if (bitset_test(blocks, node->blocks[j])) bitset_set(shared, node->blocks[j]);
+            else bitset_set(blocks, node->blocks[j]);
+        }
+
+        if (node->type != DIR || (node->blocks[0] == 0 && node != &table[0])) continue;
+
+        char buffer[BLOCK_SIZE];
+        read_block(node->blocks[0], buffer);
+        struct dirent* objects = (struct dirent*)buffer;
+
+        for (int i = 0; i < BLOCK_SIZE / sizeof(struct dirent); i++) {
+            uint32_t child = objects[i].inode_num;
+            if (child == 0) break;
+            if (child >= TOTAL_INODE || bitset_test(inodes, child)) continue;
+
+            bitset_set(inodes, child);
+            stack[top++] = child;
+        }
+    }
+}
+
+int8_t rebuild_bitmaps(struct bitmap_report* report, uint8_t apply) {
+    struct superblock sb;
+    struct inode* table = malloc(sizeof(struct inode) * TOTAL_INODE);
+
+    memset(report, 0, sizeof(struct bitmap_report));
+    read_sb(&sb);
+    if (!read_inode_table(table)) {
+        free(table);
+        return -1;
+    }
+
+    uint64_t want_inodes[BITSET_WORDS(TOTAL_INODE)] = {0};
+    uint64_t want_blocks[BITSET_WORDS(TOTAL_BLOCKS)] = {0};
+    uint64_t shared[BITSET_WORDS(TOTAL_BLOCKS)] = {0};
+    uint64_t have_inodes[BITSET_WORDS(TOTAL_INODE)];
+    uint64_t have_blocks[BITSET_WORDS(TOTAL_BLOCKS)];
+
+    // Block 0 is the root directory block
+    bitset_set(want_blocks, 0);
+    mark_tree(table, 0, want_inodes, want_blocks, shared);
+
+    // Trashed objects keep their inodes and blocks until reclaim
+    uint32_t steps = 0;
+    for (uint16_t i = sb.trash_head; i != 0 && i < TOTAL_INODE && steps < TOTAL_INODE; i = table[i].trash_next, steps++) {
+        mark_tree(table, i, want_inodes, want_blocks, shared);
+    }
+
+    bitset_pack(have_inodes, sb.bitmap_inode, TOTAL_INODE);
+    bitset_pack(have_blocks, sb.bitmap_blocks, TOTAL_BLOCKS);
+
+    // Compare whole words: XOR finds every disagreement, AND with either side tells which way it goes
+    for (int i = 0; i < BITSET_WORDS(TOTAL_BLOCKS); i++) {
+        uint64_t diff = have_blocks[i] ^ want_blocks[i];
+        report->leaked_blocks += __builtin_popcountll(diff & have_blocks[i]);
+        report->missing_blocks += __builtin_popcountll(diff & want_blocks[i]);
+    }
+
+    for (int i = 0; i < BITSET_WORDS(TOTAL_INODE); i++) {
+        uint64_t diff = have_inodes[i] ^ want_inodes[i];
+        report->leaked_inodes += __builtin_popcountll(diff & have_inodes[i]);
+        report->missing_inodes += __builtin_popcountll(diff & want_inodes[i]);
+    }
+
+    report->shared_blocks = bitset_count(shared, BITSET_WORDS(TOTAL_BLOCKS));
+    report->free_blocks = TOTAL_BLOCKS - bitset_count(want_blocks, BITSET_WORDS(TOTAL_BLOCKS));
+
+    uint8_t changed = report->leaked_blocks || report->missing_blocks || report->leaked_inodes
+        || report->missing_inodes || report->free_blocks != sb.free_blocks;
+    if (apply && changed) {
+        for (uint32_t i = 0; i < TOTAL_BLOCKS; i++) sb.bitmap_blocks[i] = bitset_test(want_blocks, i);
+        for (uint32_t i = 0; i < TOTAL_INODE; i++) sb.bitmap_inode[i] = bitset_test(want_inodes, i);
+        sb.free_blocks = report->free_blocks;
+        write_sb(sb);
+    }
+
+    free(table);
+    return changed;
+}
+
+void check_superblocks(WINDOW* win, int* row) {
+    struct superblock copies[SB_COPIES];
+    uint32_t valid = 0;
+
+    int best = read_sb_copies(copies);
+    for (int i = 0; i < SB_COPIES && best != -1; i++) {
+        if (memcmp(&copies[i], &copies[best], sizeof(struct superblock)) == 0) valid++;
+    }
+
+    mvwprintw(win, (*row)++, 2, "Up-to-date superblock copies: %u/%d", valid, SB_COPIES);
+    if (best != -1 && valid != SB_COPIES) {
+        mvwprintw(win, *row, 2, "Superblock copies were rewritten");
+        write_sb(copies[best]);
+    }
+}
+
 void check_metadata(WINDOW* win, int* row) {
     struct superblock sb;
     uint32_t free_blocks_amount = 0;
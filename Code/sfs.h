@@ -2,8 +2,13 @@
 
 #include <stdint.h>
 #include <time.h>
+#include <sys/types.h>
 
 #include <ncurses.h>
+#include <pthread.h>
+
+#include "crypto.h"
+#include "plain_cache.h"
 
 #define DIR 0
 #define FIL 1
@@ -19,24 +24,51 @@
 
 #define ROOT_INODE 0
 
+#define SFS_MAGIC 0xDEADBEEF
+#define SB_COPIES 3
+#define SB_COPY_OFFSET(i) ((i) == 0 ? 0 : (off_t)SFS_SIZE - (i) * BLOCK_SIZE)
+
 #define SFS_SIZE 1024 * 1024 * 32
 #define BLOCK_SIZE 4096
 #define INODE_SIZE sizeof(struct inode)
+#define CTR_NONCE_SIZE 8
+#define BITSET_WORDS(n) (((n) + 63) / 64)
+#define BLOCK_OFFSET(n) (sizeof(struct superblock) + INODE_SIZE * TOTAL_INODE + (off_t)(n) * BLOCK_SIZE)
 
 #define MAX_NAME_LEN 32
 #define MAX_PATH_LEN 255
 
+#define TRASH_RETENTION (60 * 60 * 24 * 7)
+#define TRASH_RECLAIM_INTERVAL 5
+#define TRASH_LOW_WATERMARK (TOTAL_BLOCKS / 8)
+
+#define FRAG_HIST_BUCKETS 9
+
+#define MAP_SYSTEM 'S'
+#define MAP_FREE '.'
+#define MAP_CONTIGUOUS '#'
+#define MAP_FRAGMENTED 'x'
+
 extern uint32_t fd;
 extern struct superblock sb;
+extern pthread_mutex_t sfs_mutex;
+extern pthread_t reclaim_tid;
 
 struct superblock {
     uint32_t magic;
+    uint32_t generation;    // Incremented on every write, the newest valid copy wins on mount
+    uint32_t checksum;      // CRC32 of the structure with this field set to 0
     uint16_t block_size;
     uint16_t total_blocks; 
     uint16_t free_blocks;
     uint16_t total_inode;
+    uint16_t trash_head;
+    uint16_t trash_tail;
     uint8_t bitmap_inode[TOTAL_INODE];
     uint8_t bitmap_blocks[TOTAL_BLOCKS];
+    uint32_t key_gen;                  // Part of every file key, bumped to rotate them all
+    uint8_t key_salt[KEY_SALT_SIZE];
+    uint8_t key_check[KEY_CHECK_SIZE]; // Derived from the master key, all zero until the first unlock
 };
 
 struct inode {
@@ -44,6 +76,15 @@ struct inode {
     uint32_t size;
     uint16_t blocks[MAX_BLOCK_COUNT];
     time_t create_time;
+    time_t delete_time;     // Non-zero while the inode sits in the trash
+    uint16_t trash_prev;
+    uint16_t trash_next;
+    uint16_t parent;
+    time_t parent_created;  // create_time of the parent when trashed, tells it apart from a reuse of its inode
+    char name[MAX_NAME_LEN];
+    uint8_t nonce[CTR_NONCE_SIZE]; // Nonce prefix of .enc files, renewed on every rewrite
+    uint32_t key_gen;       // Key generation the blocks of an .enc file are sealed with
+    uint8_t tags[MAX_BLOCK_COUNT][GCM_TAG_SIZE]; // GCM tag of every block of .enc files
 };
 
 struct dirent {
@@ -51,13 +92,49 @@ struct dirent {
     char name[MAX_NAME_LEN];
 };
 
+struct frag_file {
+    uint32_t inode_num;
+    uint32_t type;
+    uint16_t block_count;
+    uint16_t extent_count;
+};
+
+// Fragmentation statistics, built from the superblock and the inode table only
+struct frag_report {
+    uint32_t file_count;
+    uint32_t fragmented_files;
+    uint32_t total_extents;
+    uint32_t used_blocks;
+    uint32_t free_blocks;
+    uint32_t free_runs;
+    uint32_t largest_free_run;
+    uint32_t free_run_hist[FRAG_HIST_BUCKETS]; // bucket i counts free runs of length [2^i, 2^(i+1))
+    uint32_t defrag_moves;
+    char block_map[TOTAL_BLOCKS + 1];
+    struct frag_file files[TOTAL_INODE];
+};
+
+// Differences between the on-disk bitmaps and the ones derived from the directory tree
+struct bitmap_report {
+    uint32_t leaked_blocks;  // marked used, but owned by no reachable inode
+    uint32_t missing_blocks; // owned by a reachable inode, but marked free
+    uint32_t shared_blocks;  // owned by more than one inode
+    uint32_t leaked_inodes;
+    uint32_t missing_inodes;
+    uint32_t free_blocks;
+};
+
 struct path_components {
     char** components;
     int count;
 };
 
 void sfs_init(const char* path);
+int8_t sfs_mount(const char* path);
+void sfs_lock();
+void sfs_unlock();
 void read_sb(struct superblock* sb);
+void write_sb(struct superblock sb);
 
 uint8_t read_block(uint32_t block_num, void* buffer);
 uint8_t write_block(uint32_t block_num, const void* buffer);
@@ -68,6 +145,7 @@ uint8_t create_inode();
 void delete_inode();
 uint8_t read_inode(uint32_t inode_num, struct inode* node);
 uint8_t write_inode(uint32_t inode_num, const struct inode* node);
+uint8_t read_inode_table(struct inode* table);
 uint32_t find_free_inode();
 void set_inode(uint32_t inode_num, uint8_t is_busy);
 
@@ -78,22 +156,40 @@ int8_t write_file(char* path);
 void search_file(const char* name);
 
 int8_t create_dir(char* path);
+void add_dirent_to_dir(uint32_t inode_num, struct dirent* object);
+int32_t find_dir_to_print(struct path_components path_c);
 void read_dir();
 char** print_dir(char* path);
 int8_t delete_dir(char* path);
 
+void trash_push(uint32_t inode_num, struct inode* node, uint32_t parent, const char* name);
+int8_t undelete(uint32_t inode_num);
+int8_t trash_reclaim_oldest();
+int8_t trash_purge(uint32_t inode_num);
+uint32_t trash_reclaim(time_t now);
+void* reclaim_thread(void* arg);
+
 void check_inodes(uint32_t count, uint32_t inode_num, struct superblock* sb);
 void check_dirs(uint32_t count, uint32_t inode_num);
 void check_duplicates(WINDOW* win, int* row);
 void check_metadata(WINDOW* win, int* row);
 void check_blocks(WINDOW* win, int* row);
+void check_superblocks(WINDOW* win, int* row);
+int8_t rebuild_bitmaps(struct bitmap_report* report, uint8_t apply);
+void mark_tree(const struct inode* table, uint32_t inode_num, uint64_t* inodes, uint64_t* blocks, uint64_t* shared);
+void bitset_pack(uint64_t* set, const uint8_t* bytes, uint32_t count);
+uint32_t bitset_count(const uint64_t* set, uint32_t words);
 
 void clear_files_data();
 void delete_all();
 void defragment();
+void analyze_fragmentation(struct frag_report* report);
+int8_t dump_fragmentation_json(const struct frag_report* report, const char* path);
 void change_sfs();
 
 char* get_time_str(time_t t);
+uint32_t crc32(const void* data, size_t size);
+uint32_t crc32_update(uint32_t crc, const void* data, size_t size);
 struct path_components parse_path(char* path);
 void free_path_component_struct(struct path_components* s);
 uint8_t compare_last_n_chars(const char* str, const char* substr, uint8_t n);
@@ -101,5 +197,9 @@ void print_bitmap_inode();
 void print_bitmap_blocks();
 uint32_t find_parent_dir(struct path_components path_c);
 
-void encrypt_data(char* data, size_t size, const uint8_t* key);
-void decrypt_data(char *data, size_t size, const uint8_t *key);
\ No newline at end of file
+void encrypt_data(char* data, size_t size, uint32_t inode_num, struct inode* node, uint32_t block_index);
+int8_t decrypt_data(char* data, size_t size, uint32_t inode_num, const struct inode* node, uint32_t block_index);
+int8_t read_encrypted_file(uint32_t inode_num, const struct inode* node, char* data, uint32_t block_count);
+int8_t unlock_volume(const char* passphrase);
+int8_t rotate_file_keys(uint32_t* rotated, uint32_t* failed);
+void renew_file_nonce(struct inode* node);
\ No newline at end of file
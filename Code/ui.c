@@ -22,6 +22,8 @@ void init_ui(void) {
 
     mousemask(ALL_MOUSE_EVENTS | REPORT_MOUSE_POSITION, NULL);
     mouseinterval(0);
+    // getch returns now and then, so the Network tab shows requests and progress as they change
+    timeout(UI_REFRESH_MS);
 
     init_pair(CP_DEFAULT, COLOR_WHITE, COLOR_BLACK);
     init_pair(CP_HIGHLIGHT, COLOR_BLACK, COLOR_WHITE);
@@ -167,6 +169,7 @@ void handle_input(void) {
             exit(0);
         default:
             // Обработка специфичных для вкладки команд
+            if (current_tab == 1 && (ch == 'y' || ch == 'n')) handle_network_key(ch);
             break;
     }
 }
@@ -183,7 +186,8 @@ void draw_help_tab(void) {
     mvwprintw(win, 4, 2, "Left/Right Arrows - Switch tabs");
     mvwprintw(win, 5, 2, "1-4 - Jump to tab");
     mvwprintw(win, 6, 2, "Mouse click to action");
-    mvwprintw(win, 7, 2, "Q - Quit");
+    mvwprintw(win, 7, 2, "Y/N - Accept/reject the oldest incoming request (Network tab)");
+    mvwprintw(win, 8, 2, "Q - Quit");
     
     wrefresh(win);
 }
@@ -215,7 +219,9 @@ void create_file_dialog(WINDOW *win) {
     wrefresh(win);
 
     row++;
+    sfs_lock();
     int32_t code = create_file(path);
+    sfs_unlock();
     if (code > 0) {
         mvwprintw(win, row++, 2, "File was created successfully");
     } else if (code == -1) {
@@ -226,6 +232,8 @@ void create_file_dialog(WINDOW *win) {
         mvwprintw(win, row++, 2, "There is no such directory");
     } else if (code == -4) {
         mvwprintw(win, row, 2, "File with this name already exists");
+    } else if (code == -5) {
+        mvwprintw(win, row++, 2, "Error: directory or inode table is full");
     }
 
     wtimeout(win, 100);
@@ -280,7 +288,9 @@ void delete_file_dialog(WINDOW* win) {
     mvwprintw(win, row++, 2, "Deleting file: %s", path);
     wrefresh(win);
 
+    sfs_lock();
     int8_t code = delete_file(path);
+    sfs_unlock();
     if (code == 1) {
         mvwprintw(win, row++, 2, "File was deleted successfully");
     } else if (code == -1) {
@@ -342,7 +352,9 @@ void create_dir_dialog(WINDOW* win) {
     wrefresh(win);
 
     row++;
+    sfs_lock();
     int8_t code = create_dir(path);
+    sfs_unlock();
     if (code == 1) {
         mvwprintw(win, row++, 2, "Directory was created successfully");
     } else if (code == -1) {
@@ -406,7 +418,9 @@ void delete_dir_dialog(WINDOW* win) {
     mvwprintw(win, row++, 2, "Deleting directory: %s", path);
     wrefresh(win);
 
+    sfs_lock();
     int8_t code = delete_dir(path);
+    sfs_unlock();
 
     if (code == 1) {
         mvwprintw(win, row++, 2, "Directory was deleted successfully");
@@ -477,7 +491,9 @@ void print_dir_dialog(WINDOW* win) {
     noecho();
     curs_set(0);
 
+    sfs_lock();
     char** dirents = print_dir(path);
+    sfs_unlock();
     wrefresh(inner_win);
     
 
@@ -591,7 +607,9 @@ void write_to_file_dialog(WINDOW* parent_win) {
     
     // Проверка существования файла
     struct path_components path_c = parse_path(path);
+    sfs_lock();
     uint32_t parent_inode_num = find_parent_dir(path_c);
+    sfs_unlock();
     int8_t status = -1;
 
     if (parent_inode_num == -1) {
@@ -609,10 +627,11 @@ void write_to_file_dialog(WINDOW* parent_win) {
     noecho();
 
     struct inode dir_inode;
-    read_inode(parent_inode_num, &dir_inode);
-    
     char buffer[BLOCK_SIZE];
+    sfs_lock();
+    read_inode(parent_inode_num, &dir_inode);
     read_block(dir_inode.blocks[0], buffer);
+    sfs_unlock();
     struct dirent* objects = (struct dirent*)buffer;
 
     for (int i = 0; i < BLOCK_SIZE / sizeof(struct dirent); i++) {
@@ -634,7 +653,9 @@ void write_to_file_dialog(WINDOW* parent_win) {
             //write_data_to_file(objects[i], path_c.components[path_c.count - 1]);       
 
             struct inode file_inode;
+            sfs_lock();
             read_inode(objects[i].inode_num, &file_inode);
+            sfs_unlock();
 
             if (file_inode.type != FIL) {
                 //printf("Error: '%s' is not a file\n", objects[i].name);
@@ -659,8 +680,13 @@ void write_to_file_dialog(WINDOW* parent_win) {
             int pos = 0;
             size_t total_size = 0;
             int block_index = 0;
+            uint8_t encrypted = compare_last_n_chars(objects[i].name, ".enc", 4);
+            if (encrypted) renew_file_nonce(&file_inode);
 
+            sfs_lock();
             uint32_t new_block_num = find_free_block();
+            if (new_block_num != -1) set_block(new_block_num, 1);
+            sfs_unlock();
             if (new_block_num == -1) {
                 //printf("Error writing data to file\n");
                 mvwprintw(inner_win, 2, 0, "Error writing data to file");
@@ -674,13 +700,15 @@ void write_to_file_dialog(WINDOW* parent_win) {
                 return;
             }
             file_inode.blocks[0] = new_block_num;
-            set_block(new_block_num, 1);
             
             while(1) {
                 ch = wgetch(inner_win);
                 
                 if (ch == 27) {
+                    if (encrypted) encrypt_data(content, BLOCK_SIZE, objects[i].inode_num, &file_inode, block_index);
+                    sfs_lock();
                     write_block(file_inode.blocks[block_index], content);
+                    sfs_unlock();
                     break;
                 }
 
@@ -688,14 +716,18 @@ void write_to_file_dialog(WINDOW* parent_win) {
                 total_size++;
 
                 if (total_size % BLOCK_SIZE == 0) {
+                    if (encrypted) encrypt_data(content, BLOCK_SIZE, objects[i].inode_num, &file_inode, block_index);
+                    sfs_lock();
                     write_block(file_inode.blocks[block_index], content);
                     block_index++;
                     if (block_index == 12) {
+                        sfs_unlock();
                         break;
                     }
                     new_block_num = find_free_block();
                     file_inode.blocks[block_index] = new_block_num;
                     set_block(new_block_num, 1);
+                    sfs_unlock();
                     for (int i = 0; i < BLOCK_SIZE; i++) {
                         content[i] = '\0';
                     }
@@ -706,7 +738,9 @@ void write_to_file_dialog(WINDOW* parent_win) {
             }
 
             file_inode.size = total_size;
+            sfs_lock();
             write_inode(objects[i].inode_num, &file_inode);
+            sfs_unlock();
             status = 1;
             noecho();
             curs_set(0);
@@ -787,7 +821,9 @@ void read_file_dialog(WINDOW* parent_win) {
     
     // Получаем информацию о файле
     struct path_components pc = parse_path(path);
+    sfs_lock();
     uint32_t parent_inode = find_parent_dir(pc);
+    sfs_unlock();
     
     if(parent_inode == -1) {
         mvwprintw(inner_win, row++, 2, "Error: Invalid path");
@@ -807,8 +843,10 @@ void read_file_dialog(WINDOW* parent_win) {
     
     // Ищем файл в родительском каталоге
     char buffer[BLOCK_SIZE];
+    sfs_lock();
     read_inode(parent_inode, &file_inode);
     read_block(file_inode.blocks[0], buffer);
+    sfs_unlock();
     struct dirent* entries = (struct dirent*)buffer;
     
     for(int i = 0; i < BLOCK_SIZE/sizeof(struct dirent); i++) {
@@ -832,7 +870,9 @@ void read_file_dialog(WINDOW* parent_win) {
         return;
     }
     
+    sfs_lock();
     read_inode(file_entry.inode_num, &file_inode);
+    sfs_unlock();
     
     if(file_inode.type != FIL) {
         mvwprintw(inner_win, row++, col, "Error: Not a file");
@@ -859,8 +899,26 @@ void read_file_dialog(WINDOW* parent_win) {
     int block_index = 0;
     int current_line_pos = 0;
     
-    while(file_inode.blocks[block_index] != 0 && block_index < MAX_BLOCK_COUNT) {
-        read_block(file_inode.blocks[block_index], data);
+    char* file_data = calloc(MAX_BLOCK_COUNT, BLOCK_SIZE);
+    int block_count = 0;
+    while(block_count < MAX_BLOCK_COUNT && file_inode.blocks[block_count] != 0) block_count++;
+
+    // Hot .enc files come from the plaintext cache, the rest is decrypted in as few calls as possible
+    uint8_t tampered = 0;
+    if (compare_last_n_chars(file_entry.name, ".enc", 4)) {
+        tampered = read_encrypted_file(file_entry.inode_num, &file_inode, file_data, block_count) != 0;
+    } else {
+        sfs_lock();
+        for (int i = 0; i < block_count; i++) read_block(file_inode.blocks[i], file_data + i * BLOCK_SIZE);
+        sfs_unlock();
+    }
+    if (tampered) {
+        snprintf(content.lines[0], WIDTH + 1, "Error: authentication failed, the file is damaged or was modified");
+        block_count = 0;
+    }
+
+    while(block_index < block_count) {
+        memcpy(data, file_data + block_index * BLOCK_SIZE, BLOCK_SIZE);
         
         for(int i = 0; i < BLOCK_SIZE && data[i] != '\0'; i++) {
             if (data[i] == '\n' || current_line_pos >= WIDTH - 1) {
@@ -880,6 +938,7 @@ void read_file_dialog(WINDOW* parent_win) {
         
         block_index++;
     }
+    free(file_data);
 
 
     // Первоначальная отрисовка
@@ -929,6 +988,78 @@ void read_file_dialog(WINDOW* parent_win) {
 
 /* READ FILE*/
 
+void trash_dialog(void) {
+    int row = 0;
+    int col = 0;
+    char input[12] = {0};
+
+    const int HEIGHT = LINES - 10;
+    const int WIDTH = COLS - 20;
+    WINDOW* win = newwin(HEIGHT + 2, WIDTH + 2, 5, 10);
+    box(win, 0, 0);
+    WINDOW* inner_win = derwin(win, HEIGHT, WIDTH, 1, 1);
+    wrefresh(win);
+
+    mmask_t old_mask;
+    mousemask(0, &old_mask);
+
+    mvwprintw(inner_win, row++, col, "Trash (newest first):");
+
+    struct superblock sb;
+    struct inode node;
+    int shown = 0, hidden = 0;
+    sfs_lock();
+    read_sb(&sb);
+    for (uint32_t i = sb.trash_head; i != 0 && i < TOTAL_INODE; i = node.trash_next) {
+        read_inode(i, &node);
+        if (row >= HEIGHT - 4) {
+            hidden++;
+            continue;
+        }
+
+        char* time_str = get_time_str(node.delete_time);
+        mvwprintw(inner_win, row++, col, "Inode %u: %s (%s), deleted %s", i, node.name, node.type == DIR ? "dir" : "file", time_str);
+        free(time_str);
+        shown++;
+    }
+    sfs_unlock();
+
+    if (shown == 0) mvwprintw(inner_win, row++, col, "Trash is empty");
+    if (hidden > 0) mvwprintw(inner_win, row++, col, "... and %d more", hidden);
+    row++;
+
+    mvwprintw(inner_win, row++, col, "Inode number to restore (Enter to cancel):");
+    echo();
+    curs_set(1);
+    mvwgetnstr(inner_win, row++, col, input, sizeof(input) - 1);
+    noecho();
+    curs_set(0);
+
+    if (input[0] != '\0') {
+        sfs_lock();
+        int8_t code = undelete(atoi(input));
+        sfs_unlock();
+
+        if (code == 1) {
+            mvwprintw(inner_win, row++, col, "Restored successfully");
+        } else if (code == -1) {
+            mvwprintw(inner_win, row++, col, "Error: inode %s is not in the trash", input);
+        } else if (code == -2) {
+            mvwprintw(inner_win, row++, col, "Error: name is already taken in the original directory");
+        } else if (code == -3) {
+            mvwprintw(inner_win, row++, col, "Error: original directory is full");
+        }
+    }
+
+    mvwprintw(inner_win, row, col, "Press any key to continue...");
+    wrefresh(inner_win);
+    wgetch(inner_win);
+
+    mousemask(old_mask, NULL);
+    delwin(inner_win);
+    delwin(win);
+}
+
 void handle_files_mouse(MEVENT *mevent) {
     int win_y = mevent->y - TAB_BAR_HEIGHT;
     int win_x = mevent->x;
@@ -960,10 +1091,12 @@ void handle_files_mouse(MEVENT *mevent) {
         //delwin(dialog_win);
     } else if (win_y == 9 && win_x >= 26 && win_x <= 49) {
         read_file_dialog(NULL);
+    } else if (win_y == 11 && win_x >= 2 && win_x <= 10) {
+        trash_dialog();
     }
 }
 
-void send_file_dialog(WINDOW* win) {
+void send_file_dialog(WINDOW* win, uint8_t mode) {
     int row = 1;
     char filepath[MAX_PATH_LEN] = {0};
     char ip[16];
@@ -973,7 +1106,7 @@ void send_file_dialog(WINDOW* win) {
     // Настройка окна
     wclear(win);
     box(win, 0, 0);
-    mvwprintw(win, row++, 2, "Enter file path, including file name:");
+    mvwprintw(win, row++, 2, mode == SEND_TREE ? "Enter directory path:" : "Enter file path, including file name:");
     wmove(win, row++, 2);
     wrefresh(win);
 
@@ -1003,7 +1136,33 @@ void send_file_dialog(WINDOW* win) {
     noecho();
     curs_set(0);
 
-    int8_t code = send_file(filepath, ip, port);
+    // Compression is worth it on a slow link; without it plaintext goes out with sendfile
+    uint32_t options = 0;
+    mvwprintw(win, row, 2, "Compress the data? (y/n)");
+    wrefresh(win);
+    int compress = wgetch(win);
+    wmove(win, row, 1);
+    wclrtoeol(win);
+    box(win, 0, 0);
+    if (compress == 'y' || compress == 'Y') options |= TRANSFER_COMPRESS;
+
+    // .enc contents would cross the link decrypted, so that only happens when the user says so
+    int8_t code;
+    for (;;) {
+        if (mode == SEND_TREE) code = send_tree(filepath, ip, port, options);
+        else if (mode == SEND_SYNC) code = sync_file(filepath, ip, port, options);
+        else code = send_file(filepath, ip, port, options);
+        if (code != -12 || options & TRANSFER_CLEARTEXT) break;
+
+        mvwprintw(win, row, 2, "Send .enc contents unencrypted? (y/n)");
+        wrefresh(win);
+        int answer = wgetch(win);
+        wmove(win, row, 1);
+        wclrtoeol(win);
+        box(win, 0, 0);
+        if (answer != 'y' && answer != 'Y') break;
+        options |= TRANSFER_CLEARTEXT;
+    }
     if (code == 1) {
         mvwprintw(win, row++, 2, "File was sended successfully");
     } else if (code == -1) {
@@ -1014,6 +1173,22 @@ void send_file_dialog(WINDOW* win) {
         mvwprintw(win, row++, 2, "There is no such file in this directory");
     } else if (code == -4) {
         mvwprintw(win, row++, 2, "Timeout waiting for response");
+    } else if (code == -5) {
+        mvwprintw(win, row++, 2, "Transfer was declined");
+    } else if (code == -6) {
+        mvwprintw(win, row++, 2, "File failed authentication, not sent");
+    } else if (code == -7) {
+        mvwprintw(win, row++, 2, "Receiver already has a file with this name");
+    } else if (code == -8) {
+        mvwprintw(win, row++, 2, "Receiver speaks another protocol version");
+    } else if (code == -9) {
+        mvwprintw(win, row++, 2, "Transfer failed, receiver did not confirm the file");
+    } else if (code == -10) {
+        mvwprintw(win, row++, 2, "Not enough space on the receiver");
+    } else if (code == -11) {
+        mvwprintw(win, row++, 2, "Directory has too many entries to send");
+    } else if (code == -12) {
+        mvwprintw(win, row++, 2, "Not sent: .enc would cross unencrypted");
     }
     wrefresh(win);
 
@@ -1046,46 +1221,96 @@ void send_file_dialog(WINDOW* win) {
     wrefresh(win);
 }
 
+// Like wgetnstr, but gives up once deadline has passed; returns 0 then
+uint8_t read_line_until(WINDOW* win, char* buffer, int size, time_t deadline) {
+    int len = 0, y, x;
+
+    getyx(win, y, x);
+    buffer[0] = '\0';
+    wtimeout(win, 100);
+    curs_set(1);
+    while (time(NULL) < deadline) {
+        int ch = wgetch(win);
+        if (ch == '\n' || ch == KEY_ENTER) {
+            curs_set(0);
+            return 1;
+        }
+        if ((ch == KEY_BACKSPACE || ch == 127 || ch == 8) && len > 0) len--;
+        else if (ch >= 32 && ch < 127 && len < size - 1) buffer[len++] = ch;
+        else continue;
+
+        buffer[len] = '\0';
+        mvwprintw(win, y, x, "%s", buffer);
+        wclrtoeol(win);
+        box(win, 0, 0);
+        wmove(win, y, x + len);
+        wrefresh(win);
+    }
+    curs_set(0);
+    return 0;
+}
+
+// Answers the request that has waited longest; a tree first asks where it should go.
+// Only the answer is queued here, the receiving itself stays on the server thread. The sender
+// waits for the answer no longer than the request's deadline, so the prompt ends there too
+void answer_oldest_request(WINDOW* win, int* row, uint8_t accept) {
+    file_request request;
+    char target[MAX_PATH_LEN] = {0};
+
+    if (!oldest_request(&request)) return;
+
+    if (accept && (request.fm.flags & TRANSFER_TREE)) {
+        mvwprintw(win, (*row)++, 2, "Target directory for %s", request.fm.filename);
+        mvwprintw(win, (*row)++, 2, "(empty for /, %lds left):", (long)(request.deadline - time(NULL)));
+        wmove(win, (*row)++, 2);
+        wrefresh(win);
+        uint8_t in_time = read_line_until(win, target, MAX_PATH_LEN, request.deadline);
+        if (!in_time || !request_pending(request.conn_id)) {
+            mvwprintw(win, (*row)++, 2, "Request expired, nothing was received");
+            wrefresh(win);
+            wtimeout(win, -1);
+            wgetch(win);
+            return;
+        }
+    }
+    answer_request(&request, accept, target[0] ? target : "/");
+}
+
 void check_incoming_requests_dialog(WINDOW* win) {
-    int row = 1;
-    char filepath[MAX_PATH_LEN] = {0};
-    char ip[16];
-    int port;
     int timeout_seconds = 10; // Таймаут 10 секунд
-    
-    // Настройка окна
-    wclear(win);
-    box(win, 0, 0);
-    wrefresh(win);
 
     // Временное отключение мыши
     mmask_t old_mask;
     mousemask(0, &old_mask);
-    
-    check_incoming_requests(win, &row);
-    wrefresh(win);
-    row++;
 
-    time_t current_time;
     wtimeout(win, 100);
-    int ch;
-    
+    int ch = 0;
+
+    // Requests come and go while the dialog is open, so the list is redrawn every tick
     time_t start_time = time(NULL);
-    do {
-        current_time = time(NULL);
-        int remaining = timeout_seconds - (current_time - start_time);
+    while (time(NULL) - start_time < timeout_seconds) {
+        int row = 1;
+        werase(win);
+        box(win, 0, 0);
+        mvwprintw(win, row++, 2, "Y accepts, N rejects the oldest");
+        if (check_incoming_requests(win, &row) == 0) mvwprintw(win, row++, 2, "No incoming requests");
+        row++;
 
         // Визуализация таймера
         wattron(win, A_BLINK);
-        mvwprintw(win, row, 2, "Auto-continue in: %2d sec ", remaining);
+        mvwprintw(win, row++, 2, "Auto-continue in: %2ld sec ", (long)(timeout_seconds - (time(NULL) - start_time)));
         wattroff(win, A_BLINK);
         wrefresh(win);
 
         // Проверка ввода
         ch = wgetch(win);
-        if(ch == 27) break;
-        
-    } while(current_time - start_time < timeout_seconds);
+        if (ch == 27) break;
+        if (ch == 'y' || ch == 'n') {
+            answer_oldest_request(win, &row, ch == 'y');
+            wtimeout(win, 100);
+            start_time = time(NULL);
+        }
+    }
 
     // Восстановление настроек
     mousemask(old_mask, NULL);
@@ -1094,6 +1319,17 @@ void check_incoming_requests_dialog(WINDOW* win) {
     wrefresh(win);
 }
 
+void handle_network_key(int ch) {
+    WINDOW* dialog_win = newwin(10, 50, (LINES - 10) / 2, (COLS - 50) / 2);
+    int row = 1;
+
+    box(dialog_win, 0, 0);
+    answer_oldest_request(dialog_win, &row, ch == 'y');
+    wclear(dialog_win);
+    wrefresh(dialog_win);
+    delwin(dialog_win);
+}
+
 // Реализация для вкладки Network
 void handle_network_mouse(MEVENT *mevent) {
     int win_y = mevent->y - TAB_BAR_HEIGHT;
@@ -1101,7 +1337,19 @@ void handle_network_mouse(MEVENT *mevent) {
 
     if (win_x >= 2 && win_x <= 14 && win_y == 3) {
         WINDOW* dialog_win = newwin(10, 50, (LINES - 10) / 2, (COLS - 50) / 2);
-        send_file_dialog(dialog_win);
+        send_file_dialog(dialog_win, SEND_PLAIN);
+        delwin(dialog_win);
+    }
+
+    if (win_x >= 2 && win_x <= 14 && win_y == 7) {
+        WINDOW* dialog_win = newwin(10, 50, (LINES - 10) / 2, (COLS - 50) / 2);
+        send_file_dialog(dialog_win, SEND_SYNC);
+        delwin(dialog_win);
+    }
+
+    if (win_x >= 2 && win_x <= 19 && win_y == 9) {
+        WINDOW* dialog_win = newwin(10, 50, (LINES - 10) / 2, (COLS - 50) / 2);
+        send_file_dialog(dialog_win, SEND_TREE);
         delwin(dialog_win);
     }
     
@@ -1127,12 +1375,16 @@ void check_filesystem_dialog(WINDOW* win) {
     mmask_t old_mask;
     mousemask(0, &old_mask);
 
+    sfs_lock();
     check_blocks(win, &row);
     row++;
     check_metadata(win, &row);
     row++;
+    check_superblocks(win, &row);
+    row++;
     check_duplicates(win, &row);
     row++;
+    sfs_unlock();
     //check_dirs(0, 0);
 
     // Настройка таймаута
@@ -1179,7 +1431,9 @@ void format_filesystem_dialog(WINDOW* win) {
     mmask_t old_mask;
     mousemask(0, &old_mask);
 
+    sfs_lock();
     defragment(win, &row);
+    sfs_unlock();
     row++;
 
     time_t start_time = time(NULL);
@@ -1211,6 +1465,254 @@ void format_filesystem_dialog(WINDOW* win) {
     wrefresh(win);
 }
 
+void recover_files_dialog(WINDOW* win) {
+    int row = 1;
+    int timeout_seconds = 10;
+
+    wclear(win);
+    box(win, 0, 0);
+    mvwprintw(win, row++, 2, "Scanning blocks for deleted data...");
+    wrefresh(win);
+
+    mmask_t old_mask;
+    mousemask(0, &old_mask);
+
+    struct recovery_report report;
+    sfs_lock();
+    int8_t code = recover_files(&report);
+    sfs_unlock();
+    if (code == 1) {
+        mvwprintw(win, row++, 2, "Scanned blocks: %u", report.scanned_blocks);
+        mvwprintw(win, row++, 2, "Orphaned inodes: %u", report.orphan_inodes);
+        mvwprintw(win, row++, 2, "Directory blocks: %u", report.dir_blocks);
+        mvwprintw(win, row++, 2, "Carved files: %u", report.carved_files);
+        mvwprintw(win, row++, 2, "Recovered into /%s: %u", RECOVERED_DIR, report.recovered_files);
+    } else if (code == -1) {
+        mvwprintw(win, row++, 2, "Error: unable to read inode table");
+    } else if (code == -2) {
+        mvwprintw(win, row++, 2, "Error: unable to create /%s", RECOVERED_DIR);
+    }
+
+    wtimeout(win, 100);
+    time_t current_time;
+    int ch;
+
+    time_t start_time = time(NULL);
+    do {
+        current_time = time(NULL);
+        int remaining = timeout_seconds - (current_time - start_time);
+
+        wattron(win, A_BLINK);
+        mvwprintw(win, row, 2, "Auto-continue in: %2d sec ", remaining);
+        wattroff(win, A_BLINK);
+        wrefresh(win);
+
+        ch = wgetch(win);
+        if(ch == 27) break;
+
+    } while(current_time - start_time < timeout_seconds);
+
+    mousemask(old_mask, NULL);
+    wtimeout(win, -1);
+    wclear(win);
+    wrefresh(win);
+}
+
+void rebuild_bitmaps_dialog(WINDOW* win) {
+    int row = 1;
+    int timeout_seconds = 10;
+
+    wclear(win);
+    box(win, 0, 0);
+    mvwprintw(win, row++, 2, "Rebuilding bitmaps from inode table...");
+    wrefresh(win);
+
+    mmask_t old_mask;
+    mousemask(0, &old_mask);
+
+    struct bitmap_report report;
+    sfs_lock();
+    int8_t code = rebuild_bitmaps(&report, 1);
+    sfs_unlock();
+    if (code == -1) {
+        mvwprintw(win, row++, 2, "Error: unable to read inode table");
+    } else {
+        mvwprintw(win, row++, 2, "Leaked blocks freed: %u", report.leaked_blocks);
+        mvwprintw(win, row++, 2, "Unmarked blocks claimed: %u", report.missing_blocks);
+        mvwprintw(win, row++, 2, "Leaked inodes freed: %u", report.leaked_inodes);
+        mvwprintw(win, row++, 2, "Unmarked inodes claimed: %u", report.missing_inodes);
+        mvwprintw(win, row++, 2, "Double-allocated blocks: %u", report.shared_blocks);
+        mvwprintw(win, row++, 2, code ? "Bitmaps were rewritten" : "Bitmaps are consistent");
+    }
+
+    wtimeout(win, 100);
+    time_t current_time;
+    int ch;
+
+    time_t start_time = time(NULL);
+    do {
+        current_time = time(NULL);
+        int remaining = timeout_seconds - (current_time - start_time);
+
+        wattron(win, A_BLINK);
+        mvwprintw(win, row, 2, "Auto-continue in: %2d sec ", remaining);
+        wattroff(win, A_BLINK);
+        wrefresh(win);
+
+        ch = wgetch(win);
+        if(ch == 27) break;
+
+    } while(current_time - start_time < timeout_seconds);
+
+    mousemask(old_mask, NULL);
+    wtimeout(win, -1);
+    wclear(win);
+    wrefresh(win);
+}
+
+void rotate_keys_dialog(WINDOW* win) {
+    int row = 1;
+    int timeout_seconds = 10;
+
+    wclear(win);
+    box(win, 0, 0);
+    mvwprintw(win, row++, 2, "Re-encrypting .enc files with new keys...");
+    wrefresh(win);
+
+    mmask_t old_mask;
+    mousemask(0, &old_mask);
+
+    uint32_t rotated, failed;
+    if (rotate_file_keys(&rotated, &failed) == -1) {
+        mvwprintw(win, row++, 2, "Error: unable to read inode table");
+    } else {
+        mvwprintw(win, row++, 2, "Files re-encrypted: %u", rotated);
+        mvwprintw(win, row++, 2, "Files left on their old key: %u", failed);
+        mvwprintw(win, row++, 2, "Key generation: %u", sb.key_gen);
+    }
+
+    wtimeout(win, 100);
+    time_t current_time;
+    int ch;
+
+    time_t start_time = time(NULL);
+    do {
+        current_time = time(NULL);
+        int remaining = timeout_seconds - (current_time - start_time);
+
+        wattron(win, A_BLINK);
+        mvwprintw(win, row, 2, "Auto-continue in: %2d sec ", remaining);
+        wattroff(win, A_BLINK);
+        wrefresh(win);
+
+        ch = wgetch(win);
+        if(ch == 27) break;
+
+    } while(current_time - start_time < timeout_seconds);
+
+    mousemask(old_mask, NULL);
+    wtimeout(win, -1);
+    wclear(win);
+    wrefresh(win);
+}
+
+void add_content_line(content_buffer* content, int width, const char* fmt, ...) {
+    va_list args;
+    content->lines = realloc(content->lines, (content->line_count + 1) * sizeof(char*));
+    content->lines[content->line_count] = malloc(width + 1);
+
+    va_start(args, fmt);
+    vsnprintf(content->lines[content->line_count], width + 1, fmt, args);
+    va_end(args);
+
+    content->line_count++;
+}
+
+void fragmentation_dialog(void) {
+    const int HEIGHT = LINES - 10;
+    const int WIDTH = COLS - 20;
+    WINDOW* win = newwin(HEIGHT + 2, WIDTH + 2, 5, 10);
+    box(win, 0, 0);
+    WINDOW* inner_win = derwin(win, HEIGHT, WIDTH, 1, 1);
+    wrefresh(win);
+
+    mmask_t old_mask;
+    mousemask(0, &old_mask);
+
+    struct frag_report* report = malloc(sizeof(struct frag_report));
+    sfs_lock();
+    analyze_fragmentation(report);
+    sfs_unlock();
+
+    char json_path[MAX_PATH_LEN];
+    snprintf(json_path, MAX_PATH_LEN, "%s.frag.json", sfs_name);
+    int8_t dumped = dump_fragmentation_json(report, json_path);
+
+    content_buffer content = {0};
+    add_content_line(&content, WIDTH, "Used blocks: %u, free blocks: %u", report->used_blocks, report->free_blocks);
+    add_content_line(&content, WIDTH, "Files: %u, fragmented: %u, extents: %u",
+                     report->file_count, report->fragmented_files, report->total_extents);
+    add_content_line(&content, WIDTH, "Free runs: %u, largest free run: %u blocks", report->free_runs, report->largest_free_run);
+    add_content_line(&content, WIDTH, "Defragment estimate: %u block moves, %u KiB of I/O",
+                     report->defrag_moves, report->defrag_moves * BLOCK_SIZE * 3 / 1024);
+    add_content_line(&content, WIDTH, dumped == 1 ? "JSON report: %s" : "Error: unable to write %s", json_path);
+    add_content_line(&content, WIDTH, "");
+
+    add_content_line(&content, WIDTH, "Free space histogram (run length: count):");
+    for (int i = 0; i < FRAG_HIST_BUCKETS; i++) {
+        add_content_line(&content, WIDTH, "  %3u-%-3u: %u", 1u << i, (1u << (i + 1)) - 1, report->free_run_hist[i]);
+    }
+    add_content_line(&content, WIDTH, "");
+
+    add_content_line(&content, WIDTH, "Block map (%c system, %c free, %c contiguous, %c fragmented):",
+                     MAP_SYSTEM, MAP_FREE, MAP_CONTIGUOUS, MAP_FRAGMENTED);
+    for (int i = 0; i < TOTAL_BLOCKS; i += 64) {
+        add_content_line(&content, WIDTH, "  %3d %.64s", i, report->block_map + i);
+    }
+    add_content_line(&content, WIDTH, "");
+
+    add_content_line(&content, WIDTH, "Extents per file:");
+    for (uint32_t i = 0; i < report->file_count; i++) {
+        struct frag_file* file = &report->files[i];
+        add_content_line(&content, WIDTH, "  Inode %u (%s): %u blocks, %u extents", file->inode_num,
+                         file->type == DIR ? "dir" : "file", file->block_count, file->extent_count);
+    }
+    free(report);
+
+    draw_visible_lines(inner_win, &content, HEIGHT, WIDTH);
+
+    keypad(inner_win, TRUE);
+    int ch;
+    while((ch = wgetch(inner_win)) != 27) {
+        switch(ch) {
+            case KEY_UP:
+                if(content.top_line > 0) content.top_line--;
+                break;
+            case KEY_DOWN:
+                if(content.top_line + HEIGHT - 2 < content.line_count) content.top_line++;
+                break;
+            case KEY_HOME:
+                content.top_line = 0;
+                break;
+            case KEY_END:
+                content.top_line = (content.line_count - (HEIGHT - 2)) > 0 ?
+                (content.line_count - (HEIGHT - 2)) : 0;
+                break;
+        }
+        draw_visible_lines(inner_win, &content, HEIGHT, WIDTH);
+    }
+    keypad(inner_win, FALSE);
+
+    for(int i = 0; i < content.line_count; i++) {
+        free(content.lines[i]);
+    }
+    free(content.lines);
+
+    mousemask(old_mask, NULL);
+    delwin(inner_win);
+    delwin(win);
+}
+
 // Реализация для вкладки Tools
 void handle_tools_mouse(MEVENT *mevent) {
     int win_y = mevent->y - TAB_BAR_HEIGHT;
@@ -1227,6 +1729,28 @@ void handle_tools_mouse(MEVENT *mevent) {
         format_filesystem_dialog(dialog_win);
         delwin(dialog_win);
     }
+
+    if (win_y == 9 && win_x >= 2 && win_x <= 25) {
+        fragmentation_dialog();
+    }
+
+    if (win_y == 11 && win_x >= 2 && win_x <= 26) {
+        WINDOW* dialog_win = newwin(10, 50, (LINES - 10) / 2, (COLS - 50) / 2);
+        recover_files_dialog(dialog_win);
+        delwin(dialog_win);
+    }
+
+    if (win_y == 13 && win_x >= 2 && win_x <= 20) {
+        WINDOW* dialog_win = newwin(10, 50, (LINES - 10) / 2, (COLS - 50) / 2);
+        rebuild_bitmaps_dialog(dialog_win);
+        delwin(dialog_win);
+    }
+
+    if (win_y == 15 && win_x >= 2 && win_x <= 21) {
+        WINDOW* dialog_win = newwin(10, 50, (LINES - 10) / 2, (COLS - 50) / 2);
+        rotate_keys_dialog(dialog_win);
+        delwin(dialog_win);
+    }
 }
 
 // Реализация для вкладки Help
@@ -1256,6 +1780,7 @@ void draw_files_tab(void) {
     register_button(2, 7, 15, 1, "Print directory", NULL);
     register_button(2, 9, 18, 1, "Write data to file", NULL);
     register_button(26, 9, 19, 1, "Read data from file", NULL);
+    register_button(2, 11, 5, 1, "Trash", NULL);
     //register_button(30, 3, 12, 1, "Rename", rename_file);
     
     wrefresh(win);
@@ -1272,6 +1797,20 @@ void draw_network_tab(void) {
     
     register_button(2, 3, 13, 1, "Send file", NULL);
     register_button(2, 5, 27, 1, "Check incoming requests", NULL);
+    register_button(2, 7, 13, 1, "Sync file", NULL);
+    register_button(2, 9, 18, 1, "Send directory", NULL);
+
+    int row = 11;
+    wattron(win, A_BOLD);
+    mvwprintw(win, row++, 2, "Incoming requests (Y/N answers the oldest):");
+    wattroff(win, A_BOLD);
+    if (check_incoming_requests(win, &row) == 0) mvwprintw(win, row++, 2, "None");
+
+    row++;
+    wattron(win, A_BOLD);
+    mvwprintw(win, row++, 2, "Transfers:");
+    wattroff(win, A_BOLD);
+    show_transfer_progress(win, &row);
     
     wrefresh(win);
 }
@@ -1288,6 +1827,10 @@ void draw_tools_tab(void) {
     register_button(2, 3, 28, 1, "Check filesystem integrity", NULL);
     register_button(2, 5, 18, 1, "Defragment", NULL);
     register_button(2, 7, 18, 1, "Clear all files", NULL);
+    register_button(2, 9, 20, 1, "Fragmentation report", NULL);
+    register_button(2, 11, 21, 1, "Recover deleted files", NULL);
+    register_button(2, 13, 15, 1, "Rebuild bitmaps", NULL);
+    register_button(2, 15, 16, 1, "Rotate file keys", NULL);
     
     wrefresh(win);
 }
\ No newline at end of file
@@ -11,12 +11,20 @@
 #include <malloc.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <stdarg.h>
 
 #include "sfs.h"
 #include "network.h"
+#include "recovery.h"
+#include "crypto.h"
 
 #define TAB_COUNT 4
 #define TAB_BAR_HEIGHT 3
+#define UI_REFRESH_MS 250
+
+#define SEND_PLAIN 0
+#define SEND_SYNC 1
+#define SEND_TREE 2
 
 enum ColorPairs {
     CP_DEFAULT = 1,
@@ -69,11 +77,13 @@ void handle_input(void);
 void register_button(int x, int y, int w, int h, const char* label, void (*action)(void));
 int check_button_click(MEVENT* mevent);
 void draw_visible_lines(WINDOW* win, content_buffer* content, int height, int width);
+void add_content_line(content_buffer* content, int width, const char* fmt, ...);
 
 void draw_files_tab(void);
 void handle_files_mouse(MEVENT* mevent);
 void draw_network_tab(void);
 void handle_network_mouse(MEVENT* mevent);
+void handle_network_key(int ch);
 void draw_tools_tab(void);
 void handle_tools_mouse(MEVENT* mevent);
 void draw_help_tab(void);